@@ -0,0 +1,653 @@
+#define _POSIX_C_SOURCE 200112L		/* mmap and friends under -ansi */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "docs-common.h"
+
+/* The vector distance kernels are only built for GCC compatible compilers
+   on x86, everything else uses the scalar kernel                    */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_KERNELS
+#include <immintrin.h>
+#endif
+
+int num_subs, sub_stride, code_stride;
+void *mapped_file = NULL;
+size_t mapped_size;
+double (*calculateDistance)(double *subjects, double *averages);
+double (*calculateFloatDistance)(float *subjects, float *averages);
+double (*calculateCodeDistance)(unsigned char *codes, double *scales, double *offsets);
+double (*calculateSparseDistance)(int *subs, double *values, int count, double *averages);
+void (*calculateCrossProducts)(double **docs, double *packed, double *cross);
+double exact_powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};	/* Powers of ten held exactly by doubles */
+
+/* Function that allocates a zeroed matrix of doubles as a single block.
+   Every line starts on a cache line boundary, so num_columns should be a 
+   padded length such as sub_stride                                  */
+double *allocateDoubleMatrix(int num_lines, int num_columns){
+	size_t size = (size_t) num_lines * num_columns * sizeof(double);
+	char *block = (char*) calloc(size + ALIGNMENT + sizeof(void*), 1);
+	char *matrix;
+	
+	if(block == NULL)
+		return NULL;
+	
+	matrix = block + sizeof(void*);
+	matrix += (ALIGNMENT - (size_t) matrix % ALIGNMENT) % ALIGNMENT;
+	((void**) matrix)[-1] = block;
+
+	return (double*) matrix;
+}
+
+/* Function that frees a matrix of doubles */
+void freeDoubleMatrix(double *matrix){
+	if(matrix != NULL)
+		free(((void**) matrix)[-1]);
+}
+
+/* Function that allocates a zeroed matrix of floats with lines of
+   sub_stride floats, freed with freeDoubleMatrix                  */
+float *allocateFloatMatrix(int num_lines){
+	return (float*) allocateDoubleMatrix(num_lines, sub_stride / 2);
+}
+
+/* Function that calculates the distance between a document and a cabinet */
+double calculateDistanceScalar(double *subjects, double *averages){
+	int sub_i;
+	double current_distance = 0;
+	
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		double subtract = subjects[sub_i] - averages[sub_i];
+		current_distance += (subtract * subtract);
+	}
+
+	return current_distance;
+}
+
+#ifdef SIMD_KERNELS
+/* The vector kernels run over the whole padded line, which is zero past
+   num_subs on both sides, and use independent accumulators to break the
+   dependency chain on the sum. Both lines must come from 
+   allocateDoubleMatrix so that the aligned loads are valid.          */
+
+/* Function that calculates the distance between a document and a cabinet
+   with SSE2 */
+__attribute__((target("sse2")))
+double calculateDistanceSSE2(double *subjects, double *averages){
+	int sub_i;
+	__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+	
+	for(sub_i = 0; sub_i < sub_stride; sub_i += 4){
+		__m128d sub0 = _mm_sub_pd(_mm_load_pd(subjects + sub_i), _mm_load_pd(averages + sub_i));
+		__m128d sub1 = _mm_sub_pd(_mm_load_pd(subjects + sub_i + 2), _mm_load_pd(averages + sub_i + 2));
+		acc0 = _mm_add_pd(acc0, _mm_mul_pd(sub0, sub0));
+		acc1 = _mm_add_pd(acc1, _mm_mul_pd(sub1, sub1));
+	}
+	
+	acc0 = _mm_add_pd(acc0, acc1);
+	acc0 = _mm_add_sd(acc0, _mm_unpackhi_pd(acc0, acc0));
+	return _mm_cvtsd_f64(acc0);
+}
+
+/* Function that calculates the distance between a document and a cabinet
+   with AVX2 and FMA */
+__attribute__((target("avx2,fma")))
+double calculateDistanceAVX2(double *subjects, double *averages){
+	int sub_i;
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+	__m128d sum;
+	
+	for(sub_i = 0; sub_i < sub_stride; sub_i += 8){
+		__m256d sub0 = _mm256_sub_pd(_mm256_load_pd(subjects + sub_i), _mm256_load_pd(averages + sub_i));
+		__m256d sub1 = _mm256_sub_pd(_mm256_load_pd(subjects + sub_i + 4), _mm256_load_pd(averages + sub_i + 4));
+		acc0 = _mm256_fmadd_pd(sub0, sub0, acc0);
+		acc1 = _mm256_fmadd_pd(sub1, sub1, acc1);
+	}
+	
+	acc0 = _mm256_add_pd(acc0, acc1);
+	sum = _mm_add_pd(_mm256_castpd256_pd128(acc0), _mm256_extractf128_pd(acc0, 1));
+	sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+	return _mm_cvtsd_f64(sum);
+}
+
+/* Function that calculates the distance between a document and a cabinet
+   with AVX-512 */
+__attribute__((target("avx512f")))
+double calculateDistanceAVX512(double *subjects, double *averages){
+	int sub_i;
+	__m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+	
+	for(sub_i = 0; sub_i + 16 <= sub_stride; sub_i += 16){
+		__m512d sub0 = _mm512_sub_pd(_mm512_load_pd(subjects + sub_i), _mm512_load_pd(averages + sub_i));
+		__m512d sub1 = _mm512_sub_pd(_mm512_load_pd(subjects + sub_i + 8), _mm512_load_pd(averages + sub_i + 8));
+		acc0 = _mm512_fmadd_pd(sub0, sub0, acc0);
+		acc1 = _mm512_fmadd_pd(sub1, sub1, acc1);
+	}
+	
+	if(sub_i < sub_stride){
+		__m512d sub0 = _mm512_sub_pd(_mm512_load_pd(subjects + sub_i), _mm512_load_pd(averages + sub_i));
+		acc0 = _mm512_fmadd_pd(sub0, sub0, acc0);
+	}
+	
+	return _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+}
+#endif
+
+/* Function that calculates the distance between a document and a cabinet
+   stored as floats                                                  */
+double calculateFloatDistanceScalar(float *subjects, float *averages){
+	int sub_i;
+	float current_distance = 0;
+	
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		float subtract = subjects[sub_i] - averages[sub_i];
+		current_distance += (subtract * subtract);
+	}
+
+	return current_distance;
+}
+
+#ifdef SIMD_KERNELS
+/* The single precision kernels load twice as many subjects per vector.
+   Lines of sub_stride floats are only 32 byte aligned, so the AVX-512
+   kernel uses unaligned loads                                        */
+
+/* Function that calculates the distance between a document and a cabinet
+   stored as floats with SSE */
+__attribute__((target("sse2")))
+double calculateFloatDistanceSSE(float *subjects, float *averages){
+	int sub_i;
+	__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+	
+	for(sub_i = 0; sub_i < sub_stride; sub_i += 8){
+		__m128 sub0 = _mm_sub_ps(_mm_load_ps(subjects + sub_i), _mm_load_ps(averages + sub_i));
+		__m128 sub1 = _mm_sub_ps(_mm_load_ps(subjects + sub_i + 4), _mm_load_ps(averages + sub_i + 4));
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(sub0, sub0));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(sub1, sub1));
+	}
+	
+	acc0 = _mm_add_ps(acc0, acc1);
+	acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+	acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+	return _mm_cvtss_f32(acc0);
+}
+
+/* Function that calculates the distance between a document and a cabinet
+   stored as floats with AVX2 and FMA */
+__attribute__((target("avx2,fma")))
+double calculateFloatDistanceAVX2(float *subjects, float *averages){
+	int sub_i;
+	__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+	__m128 sum;
+	
+	for(sub_i = 0; sub_i + 16 <= sub_stride; sub_i += 16){
+		__m256 sub0 = _mm256_sub_ps(_mm256_load_ps(subjects + sub_i), _mm256_load_ps(averages + sub_i));
+		__m256 sub1 = _mm256_sub_ps(_mm256_load_ps(subjects + sub_i + 8), _mm256_load_ps(averages + sub_i + 8));
+		acc0 = _mm256_fmadd_ps(sub0, sub0, acc0);
+		acc1 = _mm256_fmadd_ps(sub1, sub1, acc1);
+	}
+	
+	if(sub_i < sub_stride){
+		__m256 sub0 = _mm256_sub_ps(_mm256_load_ps(subjects + sub_i), _mm256_load_ps(averages + sub_i));
+		acc0 = _mm256_fmadd_ps(sub0, sub0, acc0);
+	}
+	
+	acc0 = _mm256_add_ps(acc0, acc1);
+	sum = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+}
+
+/* Function that calculates the distance between a document and a cabinet
+   stored as floats with AVX-512 */
+__attribute__((target("avx512f")))
+double calculateFloatDistanceAVX512(float *subjects, float *averages){
+	int sub_i;
+	__m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+	
+	for(sub_i = 0; sub_i + 32 <= sub_stride; sub_i += 32){
+		__m512 sub0 = _mm512_sub_ps(_mm512_loadu_ps(subjects + sub_i), _mm512_loadu_ps(averages + sub_i));
+		__m512 sub1 = _mm512_sub_ps(_mm512_loadu_ps(subjects + sub_i + 16), _mm512_loadu_ps(averages + sub_i + 16));
+		acc0 = _mm512_fmadd_ps(sub0, sub0, acc0);
+		acc1 = _mm512_fmadd_ps(sub1, sub1, acc1);
+	}
+	
+	/* Up to 24 floats are left, the last 8 loaded under a mask */
+	if(sub_i + 16 <= sub_stride){
+		__m512 sub0 = _mm512_sub_ps(_mm512_loadu_ps(subjects + sub_i), _mm512_loadu_ps(averages + sub_i));
+		acc0 = _mm512_fmadd_ps(sub0, sub0, acc0);
+		sub_i += 16;
+	}
+	if(sub_i < sub_stride){
+		__m512 sub1 = _mm512_sub_ps(_mm512_maskz_loadu_ps(0xFF, subjects + sub_i), _mm512_maskz_loadu_ps(0xFF, averages + sub_i));
+		acc1 = _mm512_fmadd_ps(sub1, sub1, acc1);
+	}
+	
+	return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+#endif
+
+/* Function that calculates the distance between a document rebuilt from
+   its 8 bit codes, every code times the step of its subject, and a
+   cabinet given as its offsets from the subjects of code 0         */
+double calculateCodeDistanceScalar(unsigned char *codes, double *scales, double *offsets){
+	int sub_i;
+	double current_distance = 0;
+	
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		double subtract = scales[sub_i] * codes[sub_i] - offsets[sub_i];
+		current_distance += subtract * subtract;
+	}
+	
+	return current_distance;
+}
+
+#ifdef SIMD_KERNELS
+/* The code kernels widen 8 codes at a time to doubles, over whole lines
+   of code_stride codes. The steps and offsets are zero past num_subs
+   like the other lines, and a line of codes is only 8 byte aligned,
+   so the codes are loaded 8 bytes at a time                       */
+
+/* Function that calculates the distance between a document rebuilt from
+   its 8 bit codes and a cabinet with SSE2 */
+__attribute__((target("sse2")))
+double calculateCodeDistanceSSE2(unsigned char *codes, double *scales, double *offsets){
+	int sub_i;
+	__m128i zero = _mm_setzero_si128();
+	__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+	
+	for(sub_i = 0; sub_i < code_stride; sub_i += 8){
+		__m128i words = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*) (codes + sub_i)), zero);
+		__m128i low = _mm_unpacklo_epi16(words, zero), high = _mm_unpackhi_epi16(words, zero);
+		__m128d sub0 = _mm_sub_pd(_mm_mul_pd(_mm_load_pd(scales + sub_i), _mm_cvtepi32_pd(low)), _mm_load_pd(offsets + sub_i));
+		__m128d sub1 = _mm_sub_pd(_mm_mul_pd(_mm_load_pd(scales + sub_i + 2), _mm_cvtepi32_pd(_mm_srli_si128(low, 8))), _mm_load_pd(offsets + sub_i + 2));
+		__m128d sub2 = _mm_sub_pd(_mm_mul_pd(_mm_load_pd(scales + sub_i + 4), _mm_cvtepi32_pd(high)), _mm_load_pd(offsets + sub_i + 4));
+		__m128d sub3 = _mm_sub_pd(_mm_mul_pd(_mm_load_pd(scales + sub_i + 6), _mm_cvtepi32_pd(_mm_srli_si128(high, 8))), _mm_load_pd(offsets + sub_i + 6));
+		acc0 = _mm_add_pd(acc0, _mm_add_pd(_mm_mul_pd(sub0, sub0), _mm_mul_pd(sub2, sub2)));
+		acc1 = _mm_add_pd(acc1, _mm_add_pd(_mm_mul_pd(sub1, sub1), _mm_mul_pd(sub3, sub3)));
+	}
+	
+	acc0 = _mm_add_pd(acc0, acc1);
+	acc0 = _mm_add_sd(acc0, _mm_unpackhi_pd(acc0, acc0));
+	return _mm_cvtsd_f64(acc0);
+}
+
+/* Function that calculates the distance between a document rebuilt from
+   its 8 bit codes and a cabinet with AVX2 and FMA */
+__attribute__((target("avx2,fma")))
+double calculateCodeDistanceAVX2(unsigned char *codes, double *scales, double *offsets){
+	int sub_i;
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+	__m128d sum;
+	
+	for(sub_i = 0; sub_i < code_stride; sub_i += 8){
+		__m256i words = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*) (codes + sub_i)));
+		__m256d sub0 = _mm256_fmsub_pd(_mm256_load_pd(scales + sub_i), _mm256_cvtepi32_pd(_mm256_castsi256_si128(words)), _mm256_load_pd(offsets + sub_i));
+		__m256d sub1 = _mm256_fmsub_pd(_mm256_load_pd(scales + sub_i + 4), _mm256_cvtepi32_pd(_mm256_extracti128_si256(words, 1)), _mm256_load_pd(offsets + sub_i + 4));
+		acc0 = _mm256_fmadd_pd(sub0, sub0, acc0);
+		acc1 = _mm256_fmadd_pd(sub1, sub1, acc1);
+	}
+	
+	acc0 = _mm256_add_pd(acc0, acc1);
+	sum = _mm_add_pd(_mm256_castpd256_pd128(acc0), _mm256_extractf128_pd(acc0, 1));
+	sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+	return _mm_cvtsd_f64(sum);
+}
+#endif
+
+/* Function that adds up x(x - 2c) over the nonzero subjects x of a
+   sparse document, c being the same subjects of a cabinet        */
+double calculateSparseDistanceScalar(int *subs, double *values, int count, double *averages){
+	int nz_i;
+	double distance = 0;
+	
+	for(nz_i = 0; nz_i < count; nz_i++)
+		distance += values[nz_i] * (values[nz_i] - 2 * averages[subs[nz_i]]);
+	
+	return distance;
+}
+
+#ifdef SIMD_KERNELS
+/* Function that adds up x(x - 2c) over the nonzero subjects of a sparse
+   document with AVX2, gathering four subjects of the cabinet at a time */
+__attribute__((target("avx2,fma")))
+double calculateSparseDistanceAVX2(int *subs, double *values, int count, double *averages){
+	int nz_i;
+	__m256d acc = _mm256_setzero_pd(), two = _mm256_set1_pd(2);
+	__m128d sum;
+	
+	for(nz_i = 0; nz_i + 4 <= count; nz_i += 4){
+		__m256d cab = _mm256_i32gather_pd(averages, _mm_loadu_si128((__m128i*) (subs + nz_i)), 8);
+		__m256d doc = _mm256_loadu_pd(values + nz_i);
+		acc = _mm256_fmadd_pd(doc, _mm256_fnmadd_pd(two, cab, doc), acc);
+	}
+	
+	sum = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+	sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+	return _mm_cvtsd_f64(sum) + calculateSparseDistanceScalar(subs + nz_i, values + nz_i, count - nz_i, averages);
+}
+
+/* Function that adds up x(x - 2c) over the nonzero subjects of a sparse
+   document with AVX-512, gathering eight subjects at a time       */
+__attribute__((target("avx512f")))
+double calculateSparseDistanceAVX512(int *subs, double *values, int count, double *averages){
+	int nz_i;
+	__m512d acc = _mm512_setzero_pd(), two = _mm512_set1_pd(2);
+	
+	for(nz_i = 0; nz_i + 8 <= count; nz_i += 8){
+		__m512d cab = _mm512_i32gather_pd(_mm256_loadu_si256((__m256i*) (subs + nz_i)), averages, 8);
+		__m512d doc = _mm512_loadu_pd(values + nz_i);
+		acc = _mm512_fmadd_pd(doc, _mm512_fnmadd_pd(two, cab, doc), acc);
+	}
+	
+	return _mm512_reduce_add_pd(acc) + calculateSparseDistanceScalar(subs + nz_i, values + nz_i, count - nz_i, averages);
+}
+#endif
+
+/* Function that calculates the dot products between four documents and a
+   group of PACK_CABS cabinets packed by calculateCabinetNorms. The 32
+   partial sums stay in registers and cross[doc * PACK_CABS + cab] gets
+   the product of each pair                                         */
+void calculateCrossProductsScalar(double **docs, double *packed, double *cross){
+	int sub_i, doc_k, cab_k;
+	double sum[4][PACK_CABS];
+	
+	memset(sum, 0, sizeof(sum));
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		double *cabs = packed + sub_i * PACK_CABS;
+		for(doc_k = 0; doc_k < 4; doc_k++){
+			double subject = docs[doc_k][sub_i];
+			for(cab_k = 0; cab_k < PACK_CABS; cab_k++)
+				sum[doc_k][cab_k] += subject * cabs[cab_k];
+		}
+	}
+	
+	memcpy(cross, sum, sizeof(sum));
+}
+
+#ifdef SIMD_KERNELS
+/* Function that calculates the dot products between four documents and a
+   group of packed cabinets with AVX2 and FMA */
+__attribute__((target("avx2,fma")))
+void calculateCrossProductsAVX2(double **docs, double *packed, double *cross){
+	int sub_i;
+	double *doc0 = docs[0], *doc1 = docs[1], *doc2 = docs[2], *doc3 = docs[3];
+	__m256d sum00 = _mm256_setzero_pd(), sum01 = _mm256_setzero_pd();
+	__m256d sum10 = _mm256_setzero_pd(), sum11 = _mm256_setzero_pd();
+	__m256d sum20 = _mm256_setzero_pd(), sum21 = _mm256_setzero_pd();
+	__m256d sum30 = _mm256_setzero_pd(), sum31 = _mm256_setzero_pd();
+	
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		__m256d cabs0 = _mm256_load_pd(packed + sub_i * PACK_CABS);
+		__m256d cabs1 = _mm256_load_pd(packed + sub_i * PACK_CABS + 4);
+		__m256d subject;
+		
+		subject = _mm256_broadcast_sd(doc0 + sub_i);
+		sum00 = _mm256_fmadd_pd(subject, cabs0, sum00);
+		sum01 = _mm256_fmadd_pd(subject, cabs1, sum01);
+		subject = _mm256_broadcast_sd(doc1 + sub_i);
+		sum10 = _mm256_fmadd_pd(subject, cabs0, sum10);
+		sum11 = _mm256_fmadd_pd(subject, cabs1, sum11);
+		subject = _mm256_broadcast_sd(doc2 + sub_i);
+		sum20 = _mm256_fmadd_pd(subject, cabs0, sum20);
+		sum21 = _mm256_fmadd_pd(subject, cabs1, sum21);
+		subject = _mm256_broadcast_sd(doc3 + sub_i);
+		sum30 = _mm256_fmadd_pd(subject, cabs0, sum30);
+		sum31 = _mm256_fmadd_pd(subject, cabs1, sum31);
+	}
+	
+	_mm256_storeu_pd(cross, sum00);
+	_mm256_storeu_pd(cross + 4, sum01);
+	_mm256_storeu_pd(cross + PACK_CABS, sum10);
+	_mm256_storeu_pd(cross + PACK_CABS + 4, sum11);
+	_mm256_storeu_pd(cross + 2 * PACK_CABS, sum20);
+	_mm256_storeu_pd(cross + 2 * PACK_CABS + 4, sum21);
+	_mm256_storeu_pd(cross + 3 * PACK_CABS, sum30);
+	_mm256_storeu_pd(cross + 3 * PACK_CABS + 4, sum31);
+}
+#endif
+
+/* Function that picks the fastest distance kernel the CPU supports */
+void selectDistanceKernel(){
+	calculateDistance = calculateDistanceScalar;
+	calculateFloatDistance = calculateFloatDistanceScalar;
+	calculateCodeDistance = calculateCodeDistanceScalar;
+	calculateSparseDistance = calculateSparseDistanceScalar;
+	calculateCrossProducts = calculateCrossProductsScalar;
+	
+#ifdef SIMD_KERNELS
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")){
+		calculateDistance = calculateDistanceSSE2;
+		calculateFloatDistance = calculateFloatDistanceSSE;
+		calculateCodeDistance = calculateCodeDistanceSSE2;
+	}
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+		calculateDistance = calculateDistanceAVX2;
+		calculateFloatDistance = calculateFloatDistanceAVX2;
+		calculateCodeDistance = calculateCodeDistanceAVX2;
+		calculateSparseDistance = calculateSparseDistanceAVX2;
+		calculateCrossProducts = calculateCrossProductsAVX2;
+	}
+	if(__builtin_cpu_supports("avx512f")){
+		calculateDistance = calculateDistanceAVX512;
+		calculateFloatDistance = calculateFloatDistanceAVX512;
+		calculateSparseDistance = calculateSparseDistanceAVX512;
+	}
+#endif
+}
+
+/* Function that parses the decimal number at *text and moves *text past
+   it. Numbers with at most 15 significant digits and an exponent of at
+   most 22 are rounded exactly like strtod with a single multiplication
+   or division of exact doubles, anything else is handed to strtod. When
+   no number comes before the end of the line, *text is left as it was
+   and 0 is returned                                               */
+double parseDouble(char **text){
+	char *start = *text, *cursor;
+	double mantissa = 0, value;
+	int negative = 0, digits = 0, significant = 0, exponent = 0;
+	
+	while(*start == ' ' || *start == '\t')
+		start++;
+	if(*start == '\r' || *start == '\n' || *start == '\0')
+		return 0;
+	cursor = start;
+	if(*cursor == '-' || *cursor == '+')
+		negative = (*cursor++ == '-');
+	
+	for(; *cursor >= '0' && *cursor <= '9'; cursor++, digits++){
+		significant += (significant || *cursor != '0');
+		mantissa = mantissa*10 + (*cursor - '0');
+	}
+	if(*cursor == '.'){
+		for(cursor++; *cursor >= '0' && *cursor <= '9'; cursor++, digits++, exponent--){
+			significant += (significant || *cursor != '0');
+			mantissa = mantissa*10 + (*cursor - '0');
+		}
+	}
+	if(digits && (*cursor == 'e' || *cursor == 'E')){
+		int exp_sign = 1, exp_value = 0;
+		
+		cursor++;
+		if(*cursor == '-' || *cursor == '+')
+			exp_sign = (*cursor++ == '-') ? -1 : 1;
+		if(*cursor < '0' || *cursor > '9')
+			digits = 0;
+		for(; *cursor >= '0' && *cursor <= '9'; cursor++)
+			if(exp_value < 10000)
+				exp_value = exp_value*10 + (*cursor - '0');
+		exponent += exp_sign*exp_value;
+	}
+	
+	if(!digits || significant > 15 || exponent < -22 || exponent > 22 || 
+		(*cursor != ' ' && *cursor != '\t' && *cursor != '\r' && *cursor != '\n' && *cursor != '\0')){
+		value = strtod(start, &cursor);
+		if(cursor != start)
+			*text = cursor;
+		return value;
+	}
+	
+	*text = cursor;
+	value = (exponent < 0) ? mantissa / exact_powers[-exponent] : mantissa * exact_powers[exponent];
+	return negative ? -value : value;
+}
+
+/* Function that yields the start of the line after the one at text */
+char *nextLine(char *text){
+	char *newline = strchr(text, '\n');
+	
+	return (newline != NULL) ? newline + 1 : text + strlen(text);
+}
+
+/* Function that parses the subjects of a document line into subjects and
+   yields the start of the next line, or NULL when the line holds fewer
+   than num_subs numbers                                            */
+char *parseSubjects(char *text, double *subjects){
+	int sub_i;
+	char *start;
+	
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		start = text;
+		subjects[sub_i] = parseDouble(&text);
+		if(text == start)
+			return NULL;
+	}
+	return nextLine(text);
+}
+
+/* Function that parses the subjects of a document line into floats,
+   rounded from their double values, and yields the next line, or NULL
+   when the line holds fewer than num_subs numbers                 */
+char *parseFloatSubjects(char *text, float *subjects){
+	int sub_i;
+	char *start;
+	
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		start = text;
+		subjects[sub_i] = (float) parseDouble(&text);
+		if(text == start)
+			return NULL;
+	}
+	return nextLine(text);
+}
+
+/* Function that starts reading a text file in blocks from where the file
+   stands, so the header can be read first                         */
+void openTextReader(text_reader *reader, FILE *file){
+	reader->file = file;
+	reader->capacity = TEXT_BLOCK;
+	reader->buffer = (char*) malloc(reader->capacity + 1);
+	reader->length = reader->lines = 0;
+}
+
+/* Function that reads the next block of a text file and yields it, with
+   *size set to the bytes of whole lines it starts with, or NULL at the
+   end of the file. A zero follows those lines so the parser stops
+   there, and the unfinished line after them starts the next block. The
+   buffer grows when a single line does not fit in it             */
+char *readTextBlock(text_reader *reader, size_t *size){
+	char *buffer;
+	size_t count, lines;
+	
+	if(reader->lines > 0){
+		reader->buffer[reader->lines] = reader->next;
+		reader->length -= reader->lines;
+		memmove(reader->buffer, reader->buffer + reader->lines, reader->length);
+	}
+	
+	for(;;){
+		buffer = reader->buffer;
+		count = fread(buffer + reader->length, 1, reader->capacity - reader->length, reader->file);
+		reader->length += count;
+		for(lines = reader->length; lines > 0 && buffer[lines - 1] != '\n'; lines--);
+		
+		/* The last line of the file may have no newline */
+		if(lines > 0 || count == 0){
+			if(count == 0 && lines == 0)
+				lines = reader->length;
+			break;
+		}
+		if(reader->length == reader->capacity){
+			reader->capacity *= 2;
+			reader->buffer = (char*) realloc(reader->buffer, reader->capacity + 1);
+		}
+	}
+	
+	reader->lines = *size = lines;
+	reader->next = buffer[lines];
+	buffer[lines] = '\0';
+	return (lines > 0) ? buffer : NULL;
+}
+
+/* Function that frees the buffer of a text reader, the file stays open */
+void closeTextReader(text_reader *reader){
+	free(reader->buffer);
+}
+
+/* Function that fills the header of a binary document file */
+void initBinaryHeader(binary_header *header, int flags, int cabs, int docs, int subs, int stride){
+	memset(header, 0, sizeof(binary_header));
+	strcpy(header->magic, BINARY_MAGIC);
+	header->version = BINARY_VERSION;
+	header->flags = flags;
+	header->num_cabs = cabs;
+	header->num_docs = docs;
+	header->num_subs = subs;
+	header->stride = stride;
+}
+
+/* Function that reads the header of a binary document file. Yields 0 and
+   rewinds the file when it holds text instead                       */
+int readBinaryHeader(FILE *input_file, binary_header *header){
+	if(fread(header, sizeof(binary_header), 1, input_file) == 1 && !memcmp(header->magic, BINARY_MAGIC, sizeof(BINARY_MAGIC)))
+		return 1;
+	
+	rewind(input_file);
+	return 0;
+}
+
+/* Function that maps a whole binary document file in memory and checks
+   that it holds every document it announces. Yields NULL, with the
+   reason printed, when it cannot                                   */
+binary_header *mapBinaryFile(char *input_filename){
+	binary_header *header;
+	struct stat file_stat;
+	size_t value_size, expected;
+	int fd = open(input_filename, O_RDONLY);
+	
+	if(fd < 0 || fstat(fd, &file_stat) != 0){
+		perror(input_filename);
+		return NULL;
+	}
+	
+	mapped_size = file_stat.st_size;
+	mapped_file = (mapped_size >= BINARY_HEADER) ? mmap(NULL, mapped_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if(mapped_file == MAP_FAILED){
+		perror(input_filename);
+		return NULL;
+	}
+	posix_madvise(mapped_file, mapped_size, POSIX_MADV_WILLNEED);
+	
+	header = (binary_header*) mapped_file;
+	value_size = (header->flags & BINARY_FLOAT32) ? sizeof(float) : sizeof(double);
+	expected = BINARY_HEADER + (size_t) header->num_docs * header->stride * value_size;
+	if(header->flags & BINARY_ASSIGNED)
+		expected += sizeof(int) * header->num_docs;
+	
+	if(header->version != BINARY_VERSION || header->stride < header->num_subs || mapped_size < expected){
+		fprintf(stderr, "%s: unsupported or truncated binary file\n", input_filename);
+		return NULL;
+	}
+	
+	return header;
+}
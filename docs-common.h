@@ -0,0 +1,78 @@
+#ifndef DOCS_COMMON_H
+#define DOCS_COMMON_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Pieces shared by docs-serial, docs-omp, docs-mpi, docs-mpi-omp and
+   docs-convert: the cache aligned matrices, the distance kernels, the
+   text parser and the binary document files. The kernels and the
+   parser work on lines of num_subs subjects padded to sub_stride,
+   which every program sets once it has read the input header       */
+
+#define ALIGNMENT 64			/* Cache line size in bytes */
+#define LINE_DOUBLES 8			/* Doubles that fit in a cache line */
+#define PACK_CABS 8			/* Cabinets packed side by side in the blocked mode */
+
+#define TEXT_BLOCK 16777216		/* Bytes of a text file read and parsed at a time */
+
+#define BINARY_MAGIC "CABDOCS"	/* Start of the binary document files written by docs-convert */
+#define BINARY_VERSION 1
+#define BINARY_HEADER 64		/* Bytes before the first document, keeps lines cache aligned */
+#define BINARY_FLOAT32 1		/* Subjects stored as floats */
+#define BINARY_ASSIGNED 2		/* Initial cabinet of each document follows the subjects */
+
+/* Macro that pads a number of subjects to a whole number of cache lines */
+#define PADDED(num) (((num) + LINE_DOUBLES - 1) / LINE_DOUBLES * LINE_DOUBLES)
+
+/* Macro that yields a line of a matrix allocated with allocateDoubleMatrix */
+#define ROW(matrix, line_i) ((matrix) + (size_t)(line_i) * sub_stride)
+
+typedef struct binary_header{
+	char magic[8];
+	int version;
+	int flags;
+	int num_cabs;
+	int num_docs;
+	int num_subs;
+	int stride;			/* Values stored per document */
+	char reserved[BINARY_HEADER - 32];
+} binary_header;
+
+typedef struct text_reader{
+	FILE *file;
+	char *buffer;
+	size_t capacity;		/* Bytes the buffer holds, besides the zero after them */
+	size_t length;			/* Bytes read into the buffer */
+	size_t lines;			/* Bytes of whole lines handed out by the last block */
+	char next;			/* Byte that the zero after those lines took the place of */
+} text_reader;
+
+extern int num_subs, sub_stride;	/* Subjects of a document, and the padded length of its line */
+extern int code_stride;			/* Bytes of a line of 8 bit codes, one per padded subject */
+extern void *mapped_file;		/* Binary document file mapped in memory */
+extern size_t mapped_size;
+
+/* Kernels picked by selectDistanceKernel */
+extern double (*calculateDistance)(double *subjects, double *averages);
+extern double (*calculateFloatDistance)(float *subjects, float *averages);
+extern double (*calculateCodeDistance)(unsigned char *codes, double *scales, double *offsets);
+extern double (*calculateSparseDistance)(int *subs, double *values, int count, double *averages);
+extern void (*calculateCrossProducts)(double **docs, double *packed, double *cross);
+
+double *allocateDoubleMatrix(int num_lines, int num_columns);
+void freeDoubleMatrix(double *matrix);
+float *allocateFloatMatrix(int num_lines);
+void selectDistanceKernel(void);
+double parseDouble(char **text);
+char *nextLine(char *text);
+char *parseSubjects(char *text, double *subjects);
+char *parseFloatSubjects(char *text, float *subjects);
+void openTextReader(text_reader *reader, FILE *file);
+char *readTextBlock(text_reader *reader, size_t *size);
+void closeTextReader(text_reader *reader);
+void initBinaryHeader(binary_header *header, int flags, int cabs, int docs, int subs, int stride);
+int readBinaryHeader(FILE *input_file, binary_header *header);
+binary_header *mapBinaryFile(char *input_filename);
+
+#endif
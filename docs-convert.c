@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "docs-common.h"
+
+/* Converts a text document file (.in) into the binary format that the
+   docs programs map straight into memory. The file is made of:
+	- a BINARY_HEADER bytes header (binary_header, zero padded)
+	- num_docs lines of stride values (doubles, or floats with -f32),
+	  ordered by document id and zero padded up to the stride
+	- with -a, the initial cabinet of each document as num_docs ints
+   Values are stored in the byte order of the machine that converts them */
+
+#define FILENAME_BUFFER 500
+
+/* Function that prints how to call the program and exits */
+void usage(char *program){
+	printf("Usage: %s <input file> [options]\n", program);
+	printf("  -o <file>         binary file to write (default: input file with .bin)\n");
+	printf("  -f32              store the subjects as floats instead of doubles\n");
+	printf("  -a <file>         store the initial cabinets of a .out file\n");
+	exit(-1);
+}
+
+/* Function that reads the cabinet of each document from a .out file */
+int *readAssignment(char *assign_filename, int num_docs, int num_cabs){
+	int doc_id, cab_id, *assignment;
+	FILE *assign_file = fopen(assign_filename, "r");
+
+	if(assign_file == NULL){
+		perror(assign_filename);
+		exit(-1);
+	}
+
+	assignment = (int*) malloc(sizeof(int) * num_docs);
+	for(doc_id = 0; doc_id < num_docs; doc_id++)
+		assignment[doc_id] = doc_id % num_cabs;
+
+	while(fscanf(assign_file, "%d %d", &doc_id, &cab_id) == 2){
+		if(doc_id < 0 || doc_id >= num_docs || cab_id < 0 || cab_id >= num_cabs){
+			fprintf(stderr, "%s: invalid line \"%d %d\"\n", assign_filename, doc_id, cab_id);
+			exit(-1);
+		}
+		assignment[doc_id] = cab_id;
+	}
+
+	fclose(assign_file);
+	return assignment;
+}
+
+int main(int argc, char *argv[]){
+	int arg_i, doc_i, sub_i, doc_id, next_doc = 0;
+	char *output_filename = NULL, *assign_filename = NULL;
+	char default_filename[FILENAME_BUFFER];
+	int *assignment = NULL, value_size;
+	binary_header header;
+	double *subjects;
+	float *float_subjects;
+	FILE *input_file, *output_file;
+
+	if(argc < 2)
+		usage(argv[0]);
+
+	initBinaryHeader(&header, 0, 0, 0, 0, 0);
+
+	for(arg_i = 2; arg_i < argc; arg_i++){
+		if(!strcmp(argv[arg_i], "-o") && arg_i + 1 < argc)
+			output_filename = argv[++arg_i];
+		else if(!strcmp(argv[arg_i], "-a") && arg_i + 1 < argc)
+			assign_filename = argv[++arg_i];
+		else if(!strcmp(argv[arg_i], "-f32"))
+			header.flags |= BINARY_FLOAT32;
+		else
+			usage(argv[0]);
+	}
+
+	input_file = fopen(argv[1], "r");
+	if(input_file == NULL){
+		perror(argv[1]);
+		return -1;
+	}
+
+	if(fscanf(input_file, "%d %d %d", &header.num_cabs, &header.num_docs, &header.num_subs) != 3){
+		fprintf(stderr, "%s: invalid header\n", argv[1]);
+		return -1;
+	}
+	header.stride = PADDED(header.num_subs);
+	value_size = (header.flags & BINARY_FLOAT32) ? sizeof(float) : sizeof(double);
+
+	if(output_filename == NULL){
+		size_t name_len = strlen(argv[1]);
+
+		if(name_len > 3 && !strcmp(argv[1] + name_len - 3, ".in"))
+			name_len -= 3;
+		if(name_len + 5 > FILENAME_BUFFER){
+			fprintf(stderr, "%s: file name too long\n", argv[1]);
+			return -1;
+		}
+		memcpy(default_filename, argv[1], name_len);
+		strcpy(default_filename + name_len, ".bin");
+		output_filename = default_filename;
+	}
+
+	if(assign_filename != NULL){
+		assignment = readAssignment(assign_filename, header.num_docs, header.num_cabs);
+		header.flags |= BINARY_ASSIGNED;
+	}
+
+	output_file = fopen(output_filename, "wb");
+	if(output_file == NULL){
+		perror(output_filename);
+		return -1;
+	}
+	fwrite(&header, sizeof(header), 1, output_file);
+
+	subjects = (double*) calloc(header.stride, sizeof(double));
+	float_subjects = (float*) calloc(header.stride, sizeof(float));
+	for(doc_i = 0; doc_i < header.num_docs; doc_i++){
+		if(fscanf(input_file, "%d", &doc_id) != 1 || doc_id < 0 || doc_id >= header.num_docs){
+			fprintf(stderr, "%s: invalid document line %d\n", argv[1], doc_i + 2);
+			return -1;
+		}
+		for(sub_i = 0; sub_i < header.num_subs; sub_i++){
+			if(fscanf(input_file, "%lf", &subjects[sub_i]) != 1){
+				fprintf(stderr, "%s: missing subjects for document %d\n", argv[1], doc_id);
+				return -1;
+			}
+		}
+
+		/* Documents are normally listed in order, seek only when they are not */
+		if(doc_id != next_doc)
+			fseek(output_file, BINARY_HEADER + (long) doc_id * header.stride * value_size, SEEK_SET);
+		next_doc = doc_id + 1;
+
+		if(header.flags & BINARY_FLOAT32){
+			for(sub_i = 0; sub_i < header.num_subs; sub_i++)
+				float_subjects[sub_i] = (float) subjects[sub_i];
+			fwrite(float_subjects, sizeof(float), header.stride, output_file);
+		}
+		else
+			fwrite(subjects, sizeof(double), header.stride, output_file);
+	}
+
+	if(assignment != NULL){
+		fseek(output_file, BINARY_HEADER + (long) header.num_docs * header.stride * value_size, SEEK_SET);
+		fwrite(assignment, sizeof(int), header.num_docs, output_file);
+		free(assignment);
+	}
+
+	free(subjects);
+	free(float_subjects);
+	fclose(input_file);
+	if(fclose(output_file) != 0){
+		perror(output_filename);
+		return -1;
+	}
+
+	printf("%s: %d cabinets, %d documents, %d subjects\n", output_filename, header.num_cabs, header.num_docs, header.num_subs);
+	return 0;
+}
@@ -1,371 +1,3150 @@
+#define _POSIX_C_SOURCE 200112L		/* mmap and friends under -ansi */
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <float.h>
+#include <math.h>
 #include <time.h>
 #include <mpi.h>
 #include <omp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "docs-common.h"
 
-#define BUFFER_SIZE 20000
-#define CHAR_BUFFER 20
 #define FILENAME_BUFFER 500
+#define LINE_CHARS 24			/* Longest output line: two ints, a space and a newline */
+#define IO_BLOCK 1073741824		/* Largest read or write of a single MPI-IO call */
+#define OVERHANG_BLOCK 65536		/* Bytes read at a time to finish the last line of a slice */
+
+#define ASSIGN_NAIVE 0			/* Exact distances to every cabinet */
+#define ASSIGN_GEMM 1			/* Blocked ||x||^2 - 2x.c + ||c||^2 expansion */
+#define ASSIGN_HAMERLY 2		/* Exact distances pruned with Hamerly's bounds */
+#define ASSIGN_YINYANG 3		/* Exact distances pruned with Yinyang's group bounds */
+#define DOC_TILE 64			/* Documents per tile in the blocked mode */
+#define TILE_BYTES 262144		/* Bytes of averages per cabinet block in the blocked mode */
+#define TIE_TOLERANCE 1e-9		/* Relative gap under which the blocked mode uses exact distances */
+#define GROUP_ROUNDS 5			/* K-means rounds used to group the cabinets in the Yinyang mode */
+#define BOUND_SLACK 1e-12		/* Relative margin that keeps the pruning bounds safe from rounding */
+#define FLOAT_SLACK 1e-5		/* Same margin for distances calculated in single precision */
+#define CODE_LEVELS 255			/* Largest 8 bit code of a subject */
+#define SPARSE_SLACK 1e-9		/* Margin of the bounds for sparse distances, expanded around ||c||^2 */
+#define MINI_ITERATIONS 100		/* Mini-batch iterations when -mi is not given */
+#define RANDOM_SEED 2463534242UL	/* Seed of the random numbers when -seed is not given */
+#define SEED_MODULO 0			/* Document doc_id starts in cabinet doc_id % num_cabs */
+#define SEED_RANDOM 1			/* Cabinets start from documents drawn uniformly */
+#define SEED_PLUSPLUS 2			/* Cabinets start from documents drawn with k-means++ */
+#define SEED_SCALABLE 3			/* Cabinets start from documents drawn with k-means|| */
+#define SEED_ROUNDS 5			/* Oversampling rounds of k-means|| */
+#define SEED_OVERSAMPLE 2		/* Candidates drawn per round of k-means||, in cabinets */
+
+#define CHECKPOINT_MAGIC "CABCKPT"	/* Start of the checkpoint files */
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_HEADER 64		/* Bytes before the averages of a checkpoint */
+#define SAVE_LINES 4096			/* Documents saved by each MPI-IO call of the first checkpoint */
+
+/* Macro that yields the 8 bit codes of a line of a quantized matrix */
+#define CODE_ROW(codes, line_i) ((codes) + (size_t)(line_i) * code_stride)
+
+/* Macro that yields a subject of a document as a double, whichever
+   precision the documents are stored in                           */
+#define SUBJECT(doc_i, sub_i) (single_precision ? (double) ROW(doc_floats, doc_i)[sub_i] : ROW(doc_subjects, doc_i)[sub_i])
+
 #define ROOT 0
-#define CHUNK_MSG 1
-#define DOC_SUBS_RESULT 2
-#define CHUNK_SIZE_MSG 3
+#define REBALANCE_GAIN 0.1		/* Imbalance between processes under which no documents move */
+#define REBALANCE_PERIODS 3		/* Rebalance periods in a row the imbalance has to last */
+#define PROGRESS_DOCS 1024		/* Documents between two progress calls of the overlapped reduction */
 
 /* Macro that yields 1 if a process has an extra doc */
 #define HAS_EXTRA(proc, num_procs, num_docs) ((proc%num_procs >= num_procs - num_docs%num_procs) ? 1 : 0)
 
+typedef struct checkpoint_header{
+	char magic[8];
+	int version;
+	int num_cabs;
+	int num_docs;
+	int num_subs;
+	int iterations;			/* Iterations done when the checkpoint was written */
+	int moved;			/* Documents moved by the last of them */
+	char reserved[CHECKPOINT_HEADER - 32];
+} checkpoint_header;
+
 /* Global Variables */
-int num_subs, num_cabs, num_docs, my_docs, num_procs, rank;
-double *averages, *new_averages, *temp_new_averages;
-double **distance, **doc_subjects;
-int *doc_index, *cab_docs, *new_num_docs, *temp_cab_docs;
-char *doc_chunk;
+int num_cabs, num_docs, my_docs, num_procs, rank;
+double *averages, *new_averages;
+double *new_num_docs;			/* Lines of new_averages after the sums: counts, then the moved flag */
+double *doc_subjects;
+int *doc_index, *cab_docs, count_lines;
+int single_precision = 0;		/* Documents stored and compared as floats */
+float *doc_floats, *float_averages;	/* Documents and averages of the single precision mode */
+double bound_slack = BOUND_SLACK;
+char *validate_filename = NULL;		/* Assignment the result is compared with */
+char *warm_filename = NULL;		/* Previous run the cabinets start from, set with -warm */
+int warm_averages = 0;			/* warm_filename holds averages instead of a .out file */
+char *averages_filename = NULL;		/* Where the final averages are written, set with -write-averages */
+int parse_only = 0;			/* Stop once the documents are read, set with -parse-only */
+int quantized = 0;			/* Documents searched through 8 bit codes */
+unsigned char *doc_codes;		/* Code of every subject of every document, in lines of code_stride */
+double *quant_min, *quant_scale;	/* Subject of code 0 and step between two codes, for every subject */
+double *doc_errors;			/* Distance between each document and the subjects of its codes */
+double *cab_offsets;			/* Averages of the cabinets minus quant_min */
+double *approx_distances;		/* Distances between the codes of a document and of every cabinet */
+double exact_distances = 0;		/* Exact distances measured by the quantized search */
+int sparse = 0;				/* Documents stored as their nonzero subjects only */
+int *sparse_starts;			/* First nonzero of each document, and the end of the last one (CSR) */
+int *sparse_subs, sparse_count = 0, sparse_capacity = 0;	/* Subject of every nonzero */
+double *sparse_values;			/* Value of every nonzero */
+int batch_size = 0, mini_iterations = MINI_ITERATIONS;	/* Documents sampled per mini-batch iteration, 0 runs the full algorithm */
+double learning_rate = 0;		/* Rate of the mini-batch updates, 0 follows the sampled counts */
+int mini_refine = 0;			/* Carry on with the full algorithm after the mini-batch */
+unsigned long random_state = RANDOM_SEED;	/* State of the generator shared by every process */
+int seed_mode = SEED_MODULO;		/* How the cabinets start, set with -init */
+char *seed_names[] = {"modulo", "random", "kmeans++", "kmeans||"};
+int checkpoint_every = 0;		/* Iterations between two checkpoints, 0 for none */
+double checkpoint_time = 0;		/* Seconds between two checkpoints, 0 for none */
+int checkpoint_iteration = 0;		/* Iterations done at the last checkpoint */
+double checkpoint_clock;		/* When the last checkpoint was written */
+int saved_documents = 0;		/* The documents can be read again without parsing the text */
+int resume = 0;				/* Start from the last checkpoint instead of the input */
+double *resumed_averages = NULL;	/* Averages of the checkpoint resumed from */
+int *resumed_index = NULL;		/* Cabinet of every document in that checkpoint */
+int resumed_moved;			/* Documents moved by its last iteration */
+int max_iterations = 0, iterations = 0;	/* Iteration limit, 0 for none, and iterations done */
+double stop_moved = 0, stop_shift = 0, stop_inertia = 0, time_limit = 0;	/* Stopping rules, 0 when unused */
+double *cab_shift;			/* Squared distance each cabinet average moved in its last update */
+double prev_inertia = -1;		/* Inertia of the last iteration, -1 before the first */
+int binary_output = 0;			/* Cabinets written as ints instead of text */
+int assign_mode = ASSIGN_NAIVE, cab_tile, assign_passes = 0;
+int *closest_cabs;			/* Closest cabinet of each document in the current iteration */
+double *doc_norms, *cab_norms, max_cab_norm;
+double *cab_packed;			/* Cabinet averages packed for the blocked mode */
+double *upper_bounds, *lower_bounds;	/* Distance bounds of each document in the pruned mode */
+double *prev_averages, *cab_drift, *cab_half_gap, max_drift, second_drift;
+int max_drift_cab;
+int num_groups, *cab_group, *group_cabs, *group_start;	/* Cabinet groups of the Yinyang mode */
+double *group_bounds, *group_drift;
+char digit_pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";	/* Two digit numbers for formatInt */
+int binary_input = 0;			/* Documents come from a binary file */
+int header_bytes;			/* Bytes of the header line of a text file */
+int *proc_docs;				/* Documents of every process */
 
+int overlap_blocks = 0;			/* Cabinet blocks reduced with MPI_Iallreduce, 0 reduces them at once */
+int next_block;				/* First block whose reduction was not applied yet */
+MPI_Request flag_request, *block_requests;	/* Moved flag, then sums and counts of every block */
+double *block_min, *current_distances;	/* Closest other cabinet and current cabinet of each document */
+int verbose = 0;			/* Print the timeline of every iteration */
+double post_time, flag_wait;		/* When the reductions started and how long the flag took */
+double *block_ready, *block_waits, *block_times;	/* Timeline of every block */
+int node_reduce = 0;			/* Add up the changes of each node in shared memory before reducing between nodes */
+MPI_Comm node_comm, leader_comm = MPI_COMM_NULL;	/* Processes of this node, and the leaders of every node */
+int node_rank, node_size;
+MPI_Win node_win;			/* Shared memory of the node */
+double **node_sums;			/* Sums, counts and moved flag of every process of the node */
+double *node_reduced;			/* Same layout, added up over the node and then over every node */
+int rebalance_every = 0;		/* Iterations between two rebalances of the documents, 0 never rebalances */
+int nonzero_split = 0;			/* Split the documents by their nonzero subjects */
+double work_time = 0;			/* Time spent on the documents since the last rebalance period */
+int imbalanced_periods = 0;		/* Rebalance periods in a row in which the same process was too slow */
+int slowest_proc;			/* That process */
+double *period_times;			/* Time of every process added up over those periods */
 /* debug */
 double initializeTime;
 
-/* Function that sends three variables from process 0 to the other processes:
-	num_cabs, num_docs, num_subs */
+/* Function that sends five variables from process 0 to the other processes:
+	num_cabs, num_docs, num_subs, binary_input, header_bytes */
 void shareInitializationValues(){
-	int info[3];
+	int info[5];
 	info[0] = num_cabs;
 	info[1] = num_docs;
 	info[2] = num_subs;
+	info[3] = binary_input;
+	info[4] = header_bytes;
 		
-	MPI_Bcast(info, 3, MPI_INT, ROOT, MPI_COMM_WORLD);
+	MPI_Bcast(info, 5, MPI_INT, ROOT, MPI_COMM_WORLD);
 }
 
-/* Function that receives three variables from process:
-	num_cabs, num_docs, num_subs */
+/* Function that receives five variables from process:
+	num_cabs, num_docs, num_subs, binary_input, header_bytes */
 void receiveInitializationValues(){
-	int info[3];
-	MPI_Bcast(info, 3, MPI_INT, ROOT, MPI_COMM_WORLD);
+	int info[5];
+	MPI_Bcast(info, 5, MPI_INT, ROOT, MPI_COMM_WORLD);
 		
 	num_cabs = info[0];
 	num_docs = info[1];
 	num_subs = info[2];
+	binary_input = info[3];
+	header_bytes = info[4];
 }
 
-/* Function that allocates a matrix of doubles */
-double **allocateDoubleMatrix(int num_lines, int num_columns){
-	int line_i;	
-	double **matrix = (double**) malloc(sizeof(double*)*num_lines);
-	
-	for(line_i = 0; line_i < num_lines; line_i++)
-		matrix[line_i] = calloc(num_columns, sizeof(double));
+/* Function that makes what the processes of the node wrote to the
+   shared window visible to each other                              */
+void syncNode(){
+	MPI_Win_sync(node_win);
+	MPI_Barrier(node_comm);
+	MPI_Win_sync(node_win);
+}
 
-	return matrix;
+/* Function that places the buffers of the node reduction in an MPI
+   shared memory window. Every process owns its sums, counts and moved
+   flag, while the node leader also holds the node totals and the only
+   copy of the averages and cabinet sizes, read in place by the rest */
+void allocateNodeStructures(){
+	MPI_Aint sums_bytes = (MPI_Aint)(num_cabs + count_lines) * sub_stride * sizeof(double);
+	MPI_Aint leader_bytes = sums_bytes + (MPI_Aint) num_cabs * sub_stride * sizeof(double) + 
+		PADDED(num_cabs) * sizeof(int);
+	MPI_Aint own_bytes, size;
+	int proc_i, disp_unit;
+	char *block;
+	
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+	MPI_Comm_rank(node_comm, &node_rank);
+	MPI_Comm_size(node_comm, &node_size);
+	MPI_Comm_split(MPI_COMM_WORLD, (node_rank == 0) ? 0 : MPI_UNDEFINED, rank, &leader_comm);
+	
+	/* The segments are not cache aligned, so each one gets room to align itself */
+	own_bytes = ((node_rank == 0) ? sums_bytes + leader_bytes : sums_bytes) + ALIGNMENT;
+	MPI_Win_allocate_shared(own_bytes, 1, MPI_INFO_NULL, node_comm, &block, &node_win);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, node_win);
+	memset(block, 0, own_bytes);
+	
+	node_sums = (double**) malloc(sizeof(double*) * node_size);
+	for(proc_i = 0; proc_i < node_size; proc_i++){
+		MPI_Win_shared_query(node_win, proc_i, &size, &disp_unit, &block);
+		node_sums[proc_i] = (double*)(block + (ALIGNMENT - (size_t) block % ALIGNMENT) % ALIGNMENT);
+	}
+	
+	new_averages = node_sums[node_rank];
+	node_reduced = ROW(node_sums[0], num_cabs + count_lines);
+	averages = ROW(node_reduced, num_cabs + count_lines);
+	cab_docs = (int*) ROW(averages, num_cabs);
+	syncNode();
 }
 
 /* Function that allocates and initializes the data structures	*/
 void initializeStructures(){
-	averages = (double*) calloc(num_subs * num_cabs, sizeof(double));
-	new_averages = (double*) calloc(num_subs * num_cabs, sizeof(double));
-	new_num_docs = (int*) calloc(num_cabs, sizeof(int));
+	sub_stride = PADDED(num_subs);
+	count_lines = (num_cabs + sub_stride) / sub_stride;
+	if(node_reduce)
+		allocateNodeStructures();
+	else {
+		averages = allocateDoubleMatrix(num_cabs, sub_stride);
+		new_averages = allocateDoubleMatrix(num_cabs + count_lines, sub_stride);
+		cab_docs = (int*) calloc(num_cabs, sizeof(int));
+	}
+	new_num_docs = ROW(new_averages, num_cabs);
+	cab_shift = (double*) calloc(num_cabs, sizeof(double));
 	
-	my_docs = num_docs/num_procs + HAS_EXTRA(rank, num_procs, num_docs);
 	doc_index = (int*) calloc(my_docs, sizeof(int));
-	distance = allocateDoubleMatrix(my_docs, num_cabs);
-	doc_subjects = allocateDoubleMatrix(my_docs, num_subs);
+	closest_cabs = (int*) calloc(my_docs, sizeof(int));
+	if(!binary_input && single_precision)
+		doc_floats = allocateFloatMatrix(my_docs);
+	else if(!binary_input && !sparse)
+		doc_subjects = allocateDoubleMatrix(my_docs, sub_stride);
+	if(sparse){
+		sparse_starts = (int*) calloc(my_docs + 1, sizeof(int));
+		cab_norms = (double*) malloc(sizeof(double) * num_cabs);
+	}
+	if(single_precision)
+		float_averages = allocateFloatMatrix(num_cabs);
 	
-	if(rank == ROOT){
-		/* NOTE: adding one more doc -> worst case while distributing docs */
-		doc_chunk = (char*) malloc((my_docs+1)*num_subs*CHAR_BUFFER);		
-		temp_cab_docs = (int*) calloc(num_cabs, sizeof(int));
-		temp_new_averages = (double*) calloc(num_cabs * num_subs, sizeof(double));
-		cab_docs = (int*) calloc(num_cabs , sizeof(int));
-	} 
+	if(assign_mode == ASSIGN_GEMM){
+		doc_norms = (double*) malloc(sizeof(double) * my_docs);
+		cab_norms = (double*) malloc(sizeof(double) * num_cabs);
+	}
+	
+	if(assign_mode == ASSIGN_HAMERLY || assign_mode == ASSIGN_YINYANG){
+		int doc_i;
+		
+		upper_bounds = (double*) malloc(sizeof(double) * my_docs);
+		for(doc_i = 0; doc_i < my_docs; doc_i++)
+			upper_bounds[doc_i] = DBL_MAX;
+		prev_averages = allocateDoubleMatrix(num_cabs, sub_stride);
+		cab_drift = (double*) malloc(sizeof(double) * num_cabs);
+	}
+	
+	if(assign_mode == ASSIGN_HAMERLY){
+		lower_bounds = (double*) calloc(my_docs, sizeof(double));
+		cab_half_gap = (double*) malloc(sizeof(double) * num_cabs);
+	}
+	
+	if(assign_mode == ASSIGN_YINYANG){
+		if(num_groups <= 0)
+			num_groups = (num_cabs + 9) / 10;
+		if(num_groups > num_cabs)
+			num_groups = num_cabs;
+		group_bounds = (double*) calloc((size_t) my_docs * num_groups, sizeof(double));
+	}
+	
+	if(overlap_blocks > 0){
+		if(overlap_blocks > num_cabs)
+			overlap_blocks = num_cabs;
+		block_requests = (MPI_Request*) malloc(sizeof(MPI_Request) * 2 * overlap_blocks);
+		block_ready = (double*) calloc(overlap_blocks, sizeof(double));
+		block_waits = (double*) calloc(overlap_blocks, sizeof(double));
+		block_times = (double*) calloc(overlap_blocks, sizeof(double));
+		block_min = (double*) malloc(sizeof(double) * my_docs);
+		current_distances = (double*) malloc(sizeof(double) * my_docs);
+		next_block = overlap_blocks;
+	}
 }
 
-/* Function that reads from the file and sends the information to every
-	process */
-void sendFileChunks(FILE *input_file){
-	int proc_i, doc_i, proc_docs, offset, param_len;
-	int chunk = num_docs/num_procs;
-	char parameters[BUFFER_SIZE];
+/* Function that yields the first document of a process. The file is split
+   in the same order as writeToFile: process 1 takes the first chunk
+   and process 0 the last one                                        */
+int firstDoc(int proc){
+	int proc_i, start = 0;
+	int last = (proc == ROOT) ? num_procs : proc;
 	
-	for(proc_i = 1; proc_i < num_procs+1; proc_i++){
-		offset = 0;
-		proc_docs = chunk + HAS_EXTRA(proc_i, num_procs, num_docs);
-		for(doc_i = 0; doc_i < proc_docs; doc_i++){
-			fgets(parameters, sizeof(parameters), input_file);
-			param_len = strlen(parameters);
-			memcpy(doc_chunk + offset, parameters, param_len);
-			offset += param_len;
-		}
-		if(proc_i != num_procs){
-			MPI_Send(&offset, 1, MPI_INT, proc_i, CHUNK_SIZE_MSG, MPI_COMM_WORLD);
-			MPI_Send(doc_chunk, offset, MPI_CHAR, proc_i, CHUNK_MSG, MPI_COMM_WORLD);
+	for(proc_i = 1; proc_i < last; proc_i++)
+		start += proc_docs[proc_i];
+	return start;
+}
+
+/* Function that adds a nonzero subject to the sparse arrays of the
+   documents, growing them as needed                              */
+void appendNonzero(int sub_i, double value){
+	if(sparse_count == sparse_capacity){
+		sparse_capacity = 2 * sparse_capacity + 1024;
+		sparse_subs = (int*) realloc(sparse_subs, sizeof(int) * sparse_capacity);
+		sparse_values = (double*) realloc(sparse_values, sizeof(double) * sparse_capacity);
+	}
+	sparse_subs[sparse_count] = sub_i;
+	sparse_values[sparse_count++] = value;
+}
+
+/* Function that keeps the nonzero subjects of count documents of a
+   binary file, from first_doc on, in the sparse arrays          */
+void storeSparseLines(binary_header *header, int first_doc, int count){
+	char *payload = (char*) mapped_file + BINARY_HEADER;
+	int doc_i, sub_i;
+	
+	for(doc_i = 0; doc_i < count; doc_i++){
+		size_t offset = (size_t) (first_doc + doc_i) * header->stride;
+		
+		sparse_starts[doc_i] = sparse_count;
+		for(sub_i = 0; sub_i < num_subs; sub_i++){
+			double value = (header->flags & BINARY_FLOAT32) ? ((float*) payload)[offset + sub_i] : ((double*) payload)[offset + sub_i];
+			
+			if(value != 0)
+				appendNonzero(sub_i, value);
 		}
 	}
+	sparse_starts[count] = sparse_count;
+}
+
+/* Function that adds the nonzero subjects of every sparse document to
+   the sums of its cabinet, each subject in the order of the documents */
+void addSparseDocuments(){
+	int doc_i, nz_i;
 	
-	fclose(input_file);
+	for(doc_i = 0; doc_i < my_docs; doc_i++)
+		for(nz_i = sparse_starts[doc_i]; nz_i < sparse_starts[doc_i + 1]; nz_i++)
+			ROW(new_averages, doc_index[doc_i])[sparse_subs[nz_i]] += sparse_values[nz_i];
 }
 
-/* Function that reads information received from process 0 and stores 
-	it in its proper structures                                             */
-void readAndStore(char *doc_chunk){
-	int doc_i;
-	char *line, *line_tok;
+/* Function that stores the documents of this process from a binary file.
+   Every process maps the file itself, so nothing is sent by process 0.
+   Double subjects padded like doc_subjects are used straight from the
+   mapping, other layouts are copied and the file is unmapped        */
+void mapBinaryDocuments(char *input_filename){
+	binary_header *header = mapBinaryFile(input_filename);
+	char *payload = (char*) mapped_file + BINARY_HEADER;
+	size_t value_size;
+	int doc_i, sub_i, first_doc = firstDoc(rank), *assignment = NULL, in_place;
+	
+	if(header == NULL)
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	value_size = (header->flags & BINARY_FLOAT32) ? sizeof(float) : sizeof(double);
+	in_place = !sparse && header->stride == sub_stride && (header->flags & BINARY_FLOAT32) == (single_precision ? BINARY_FLOAT32 : 0);
+	
+	if(resumed_index != NULL)
+		assignment = resumed_index;
+	else if((header->flags & BINARY_ASSIGNED) && header->num_cabs == num_cabs)
+		assignment = (int*) (payload + (size_t) num_docs * header->stride * value_size);
+	
+	/* Lines already in the precision and padding of the documents are used in place */
+	if(in_place){
+		if(single_precision)
+			doc_floats = (float*) payload + (size_t) first_doc * sub_stride;
+		else
+			doc_subjects = (double*) payload + (size_t) first_doc * sub_stride;
+	}
+	else if(sparse)
+		storeSparseLines(header, first_doc, my_docs);
+	else {
+		if(single_precision)
+			doc_floats = allocateFloatMatrix(my_docs);
+		else
+			doc_subjects = allocateDoubleMatrix(my_docs, sub_stride);
+		for(doc_i = 0; doc_i < my_docs; doc_i++){
+			size_t offset = (size_t) (first_doc + doc_i) * header->stride;
+			
+			for(sub_i = 0; sub_i < num_subs; sub_i++){
+				double value = (header->flags & BINARY_FLOAT32) ? ((float*) payload)[offset + sub_i] : ((double*) payload)[offset + sub_i];
+				
+				if(single_precision)
+					ROW(doc_floats, doc_i)[sub_i] = (float) value;
+				else
+					ROW(doc_subjects, doc_i)[sub_i] = value;
+			}
+		}
+	}
 	
-	line = strtok_r(doc_chunk, "\n", &line_tok);
 	for(doc_i = 0; doc_i < my_docs; doc_i++){
-		int sub_i, doc_id, cab_id, offset;
-		char *token, *token_tok;
-		
-		token = strtok_r(line, " ", &token_tok);
+		int doc_id = first_doc + doc_i;
+		int cab_id = (assignment != NULL) ? assignment[doc_id] : doc_id%num_cabs;
 		
-		doc_id = atoi(token);
-		cab_id = doc_id%num_cabs;
 		doc_index[doc_i] = cab_id;
-		offset = num_subs * cab_id;
+		if(!sparse)
+			for(sub_i = 0; sub_i < num_subs; sub_i++)
+				ROW(new_averages, cab_id)[sub_i] += SUBJECT(doc_i, sub_i);
+		new_num_docs[cab_id]++;
+	}
+	if(sparse)
+		addSparseDocuments();
+	
+	if(!in_place){
+		munmap(mapped_file, mapped_size);
+		mapped_file = NULL;
+	}
+}
+
+/* Function that parses the nonzero subjects of a document line into the
+   sparse arrays and yields the start of the next line. Subjects are
+   written as sub:value pairs, numbered from 0 in increasing order; a
+   value without a subject is the one after the previous subject, so
+   dense lines are read as well                                    */
+char *parseSparseSubjects(char *text){
+	int sub_i = 0;
+	
+	for(;;){
+		char *start;
+		double value;
 		
-		for(sub_i = 0; sub_i < num_subs; sub_i++){
-			token = strtok_r(NULL, " ", &token_tok);
-			doc_subjects[doc_i][sub_i] = atof(token);
-			new_averages[offset++] += doc_subjects[doc_i][sub_i];
+		while(*text == ' ' || *text == '\t')
+			text++;
+		if(*text == '\r' || *text == '\n' || *text == '\0')
+			break;
+		
+		start = text;
+		value = parseDouble(&text);
+		if(*text == ':'){
+			sub_i = (int) value;
+			text++;
+			value = parseDouble(&text);
 		}
+		if(text == start)
+			break;
+		
+		if(value != 0 && sub_i >= 0 && sub_i < num_subs)
+			appendNonzero(sub_i, value);
+		sub_i++;
+	}
+	return nextLine(text);
+}
 
-		new_num_docs[cab_id]++;
-		line = strtok_r(NULL, "\n", &line_tok);
+/* Function that reads count bytes of a file at offset. MPI-IO counts are
+   ints, so big slices are read in several blocks                    */
+void readFileAt(MPI_File file, MPI_Offset offset, char *buffer, MPI_Offset count){
+	MPI_Status status;
+	
+	while(count > 0){
+		int block = (count > IO_BLOCK) ? IO_BLOCK : (int) count;
+		
+		MPI_File_read_at(file, offset, buffer, block, MPI_CHAR, &status);
+		offset += block;
+		buffer += block;
+		count -= block;
 	}
+}
+
+/* Function that reads the documents of this process straight from the
+   file with MPI-IO. The text after the header is split in equal byte
+   ranges, in the order used by writeToFile (process 1 first, process 0
+   last), and each process takes the lines that start in its range.
+   Yields those lines as a string and gathers the number of documents
+   of every process in proc_docs                                     */
+char *readFileSlice(char *input_filename){
+	MPI_File file;
+	MPI_Offset file_size, begin, end, length, first, last, searched;
+	int proc_i, total_docs = 0, part = (rank == ROOT) ? num_procs - 1 : rank - 1;
+	char *slice, *line, *newline = NULL;
 	
-	free(doc_chunk);	
+	if(MPI_File_open(MPI_COMM_WORLD, input_filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS){
+		if(rank == ROOT)
+			fprintf(stderr, "%s: MPI-IO could not open the file\n", input_filename);
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+	MPI_File_get_size(file, &file_size);
+	
+	/* One byte before the range tells whether a line starts on its first byte */
+	begin = header_bytes + (file_size - header_bytes) / num_procs * part - (part > 0);
+	end = (part == num_procs - 1) ? file_size : header_bytes + (file_size - header_bytes) / num_procs * (part + 1);
+	length = end - begin;
+	slice = (char*) malloc((size_t) length + 1);
+	readFileAt(file, begin, slice, length);
+	
+	for(first = (part > 0); first > 0 && first < length && slice[first - 1] != '\n'; first++);
+	last = first;
+	
+	/* The last line that starts in the range is read up to its end */
+	if(first < length){
+		for(searched = length - 1; (newline = memchr(slice + searched, '\n', length - searched)) == NULL && end < file_size; end += length - searched){
+			MPI_Offset block = (file_size - end > OVERHANG_BLOCK) ? OVERHANG_BLOCK : file_size - end;
+			
+			slice = (char*) realloc(slice, (size_t) (length + block + 1));
+			readFileAt(file, end, slice + length, block);
+			searched = length;
+			length += block;
+		}
+		last = (newline != NULL) ? newline - slice + 1 : length;
+	}
+	MPI_File_close(&file);
+	
+	/* Blank lines at the end of the file are not documents */
+	while(last > first && (slice[last - 1] == '\n' || slice[last - 1] == '\r' || slice[last - 1] == ' ' || slice[last - 1] == '\t'))
+		last--;
+	memmove(slice, slice + first, (size_t) (last - first));
+	slice[last - first] = '\0';
+	
+	for(my_docs = 0, line = slice; *line != '\0'; line = nextLine(line))
+		my_docs++;
+	
+	MPI_Allgather(&my_docs, 1, MPI_INT, proc_docs, 1, MPI_INT, MPI_COMM_WORLD);
+	for(proc_i = 0; proc_i < num_procs; proc_i++)
+		total_docs += proc_docs[proc_i];
+	if(total_docs != num_docs){
+		if(rank == ROOT)
+			fprintf(stderr, "%s: found %d documents instead of %d\n", input_filename, total_docs, num_docs);
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+	
+	return slice;
 }
 
-/* Function that updates the cabinets */
-void updateAverages(){
-	int cab_i, sub_i, prev_num_docs, new_cab_docs;
+/* Function that parses the documents read by this process and stores 
+	them in its proper structures                        */
+void readAndStore(char *doc_chunk, char *input_filename){
+	int doc_i, sub_i;
+	char *line = doc_chunk;
+	size_t size = strlen(doc_chunk);
+	double parse_time = MPI_Wtime(), bytes = (double) size;
+	
+	for(doc_i = 0; doc_i < my_docs; doc_i++){
+		char *cursor;
+		int doc_id = (int) strtol(line, &cursor, 10);
+		
+		doc_index[doc_i] = doc_id % num_cabs;
+		if(sparse){
+			sparse_starts[doc_i] = sparse_count;
+			line = parseSparseSubjects(cursor);
+		}
+		else
+			line = single_precision ? parseFloatSubjects(cursor, ROW(doc_floats, doc_i)) : parseSubjects(cursor, ROW(doc_subjects, doc_i));
+		if(line == NULL){
+			fprintf(stderr, "%s: missing subjects for document %d\n", input_filename, doc_id);
+			MPI_Abort(MPI_COMM_WORLD, -1);
+		}
+	}
+	
+	if(sparse)
+		sparse_starts[my_docs] = sparse_count;
 	
-	MPI_Reduce(new_num_docs, temp_cab_docs, num_cabs, MPI_INT, MPI_SUM , ROOT, MPI_COMM_WORLD);
-	MPI_Reduce(new_averages, temp_new_averages, num_cabs * num_subs, MPI_DOUBLE, MPI_SUM, ROOT, MPI_COMM_WORLD);
+	/* Column by column, so the sums follow the order of the documents */
+	if(sparse)
+		addSparseDocuments();
+	else {
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			for(doc_i = 0; doc_i < my_docs; doc_i++)
+				ROW(new_averages, doc_index[doc_i])[sub_i] += SUBJECT(doc_i, sub_i);
+	}
+	for(doc_i = 0; doc_i < my_docs; doc_i++)
+		new_num_docs[doc_index[doc_i]]++;
 	
+	/* Printed once, for the slowest process and the bytes of all of them */
+	parse_time = MPI_Wtime() - parse_time;
+	MPI_Reduce(rank == ROOT ? MPI_IN_PLACE : &parse_time, &parse_time, 1, MPI_DOUBLE, MPI_MAX, ROOT, MPI_COMM_WORLD);
+	MPI_Reduce(rank == ROOT ? MPI_IN_PLACE : &bytes, &bytes, 1, MPI_DOUBLE, MPI_SUM, ROOT, MPI_COMM_WORLD);
+	if(rank == ROOT)
+		printf("Parse Time: %f (%.2f GB/s)\n", parse_time, bytes / parse_time / 1e9);
+	free(doc_chunk);	
+}
 
-	if(rank == ROOT){
-		for(cab_i = 0; cab_i < num_cabs; cab_i++){	
-			int offset = cab_i * num_subs;
-			prev_num_docs = cab_docs[cab_i];
-			new_cab_docs = prev_num_docs + temp_cab_docs[cab_i];
-			
-			for(sub_i = 0; sub_i < num_subs; sub_i++){
-				if(new_cab_docs == 0)
-					averages[offset++] = 0;
-				else {				
-					averages[offset] *= prev_num_docs;
-					averages[offset] += temp_new_averages[offset];
-					averages[offset++] /= new_cab_docs;
-				}
-			}
+/* Function that recomputes the average of a cabinet from the reduced
+   sums and counts of the documents that moved in or out of it, laid
+   out as in new_averages                                            */
+void updateCabinet(int cab_i, double *sums){
+	int sub_i, prev_num_docs = cab_docs[cab_i];
+	int new_cab_docs = prev_num_docs + (int) ROW(sums, num_cabs)[cab_i];
+	double shift = 0;
+	
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		double previous = ROW(averages, cab_i)[sub_i];
 		
-			cab_docs[cab_i] = new_cab_docs;
-		}	
+		if(new_cab_docs == 0)
+			ROW(averages, cab_i)[sub_i] = 0;
+		else {				
+			ROW(averages, cab_i)[sub_i] *= prev_num_docs;
+			ROW(averages, cab_i)[sub_i] += ROW(sums, cab_i)[sub_i];
+			ROW(averages, cab_i)[sub_i] /= new_cab_docs;
+		}
+		shift += (ROW(averages, cab_i)[sub_i] - previous) * (ROW(averages, cab_i)[sub_i] - previous);
 	}
+	
+	cab_docs[cab_i] = new_cab_docs;
+	cab_shift[cab_i] = shift;
+}
+
+/* Function that yields the first cabinet of a block of the overlapped
+   reduction, block overlap_blocks being the end of the last one   */
+int blockStart(int block_i){
+	return (int) ((long) num_cabs * block_i / overlap_blocks);
+}
 
-	memset(new_num_docs, 0, sizeof(int) * num_cabs);
-	memset(new_averages, 0, sizeof(double) * num_cabs * num_subs);
+/* Function that waits for the reductions of the blocks before block_end
+   and updates their averages. The sums and counts of those blocks are
+   zeroed for the next iteration                                     */
+void waitBlocks(int block_end){
+	for(; next_block < block_end; next_block++){
+		int cab_i, start = blockStart(next_block), end = blockStart(next_block + 1);
+		double wait_start = MPI_Wtime();
+		
+		MPI_Waitall(2, block_requests + 2 * next_block, MPI_STATUSES_IGNORE);
+		block_ready[next_block] = MPI_Wtime() - post_time;
+		block_waits[next_block] = MPI_Wtime() - wait_start;
+		
+		for(cab_i = start; cab_i < end; cab_i++)
+			updateCabinet(cab_i, new_averages);
+		memset(ROW(new_averages, start), 0, sizeof(double) * (end - start) * sub_stride);
+		memset(new_num_docs + start, 0, sizeof(double) * (end - start));
+	}
+}
 
-	MPI_Bcast(averages, num_cabs * num_subs, MPI_DOUBLE, ROOT, MPI_COMM_WORLD);	
+/* Function that lets MPI progress the reductions still in flight while
+   the distances of the blocks that already arrived are calculated */
+void progressBlocks(){
+	int done;
+	
+	if(next_block < overlap_blocks)
+		MPI_Testall(2 * (overlap_blocks - next_block), block_requests + 2 * next_block, &done, MPI_STATUSES_IGNORE);
 }
 
-/* Function that calculates the distance between a document and a cabinet */
-double calculateDistance(double *subjects, double *averages){
-	int sub_i;
-	double current_distance = 0;
+/* Function that starts the reduction of the moved flag and of every
+   cabinet block with MPI_Iallreduce, and only waits for the flag. The
+   blocks are applied by waitBlocks as the distances need them. Yields
+   whether any process moved a document                              */
+int postAverages(int moved_flag){
+	int block_i;
 	
-	for(sub_i = 0; sub_i < num_subs; sub_i++){
-		double subtract = subjects[sub_i] - averages[sub_i];
-		current_distance += (subtract * subtract);
+	new_num_docs[num_cabs] = moved_flag;
+	post_time = MPI_Wtime();
+	MPI_Iallreduce(MPI_IN_PLACE, new_num_docs + num_cabs, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD, &flag_request);
+	for(block_i = 0; block_i < overlap_blocks; block_i++){
+		int start = blockStart(block_i), end = blockStart(block_i + 1);
+		
+		MPI_Iallreduce(MPI_IN_PLACE, ROW(new_averages, start), (end - start) * sub_stride, MPI_DOUBLE, MPI_SUM, 
+			MPI_COMM_WORLD, &block_requests[2 * block_i]);
+		MPI_Iallreduce(MPI_IN_PLACE, new_num_docs + start, end - start, MPI_DOUBLE, MPI_SUM, 
+			MPI_COMM_WORLD, &block_requests[2 * block_i + 1]);
 	}
+	next_block = 0;
+	
+	MPI_Wait(&flag_request, MPI_STATUS_IGNORE);
+	flag_wait = MPI_Wtime() - post_time;
+	moved_flag = (int) new_num_docs[num_cabs];
+	new_num_docs[num_cabs] = 0;
+	
+	/* Nothing moved, the sums are all zero but the requests still have to complete */
+	if(!moved_flag)
+		waitBlocks(overlap_blocks);
+	return moved_flag;
+}
+
+/* Function that updates the cabinets through the shared window of the
+   node. Every process adds up its share of the buffers of the node,
+   the node leaders reduce the totals between nodes, and then every
+   process updates its share of the shared averages. Yields whether
+   any process moved a document                                      */
+int updateAveragesNode(int moved_flag){
+	size_t total = (size_t)(num_cabs + count_lines) * sub_stride, elem_i;
+	size_t first = total * node_rank / node_size, last = total * (node_rank + 1) / node_size;
+	int proc_i, cab_i;
+	
+	new_num_docs[num_cabs] = moved_flag;
+	syncNode();
+	
+	memcpy(node_reduced + first, node_sums[0] + first, sizeof(double) * (last - first));
+	for(proc_i = 1; proc_i < node_size; proc_i++)
+		for(elem_i = first; elem_i < last; elem_i++)
+			node_reduced[elem_i] += node_sums[proc_i][elem_i];
+	syncNode();
+	
+	/* Nobody reads the changes of this process anymore */
+	memset(new_averages, 0, sizeof(double) * total);
+	if(leader_comm != MPI_COMM_NULL)
+		MPI_Allreduce(MPI_IN_PLACE, node_reduced, total, MPI_DOUBLE, MPI_SUM, leader_comm);
+	syncNode();
+	
+	moved_flag = (int) ROW(node_reduced, num_cabs)[num_cabs];
+	if(moved_flag == 0)
+		return 0;
+	
+	for(cab_i = num_cabs * node_rank / node_size; cab_i < num_cabs * (node_rank + 1) / node_size; cab_i++)
+		updateCabinet(cab_i, node_reduced);
+	syncNode();
+	return moved_flag;
+}
+
+/* Function that updates the cabinets. The sums and counts of the moved
+   documents and the moved flag of every process are added up with a
+   single MPI_Allreduce, then every process recomputes the averages.
+   Yields how many documents moved over every process                 */
+int updateAverages(int moved_flag){
+	int cab_i;
+	
+	if(node_reduce)
+		return updateAveragesNode(moved_flag);
+	if(overlap_blocks > 0)
+		return postAverages(moved_flag);
+	
+	new_num_docs[num_cabs] = moved_flag;
+	MPI_Allreduce(MPI_IN_PLACE, new_averages, (num_cabs + count_lines) * sub_stride, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	
+	/* Nothing moved anywhere, so every sum and count is still zero */
+	moved_flag = (int) new_num_docs[num_cabs];
+	if(moved_flag == 0)
+		return 0;
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++)
+		updateCabinet(cab_i, new_averages);
 
-	return current_distance;
+	memset(new_averages, 0, sizeof(double) * (num_cabs + count_lines) * sub_stride);
+	return moved_flag;
 }
 
-/* Function that calculates all the distances between documents and cabinets */
-void calculateDistances(){
-	int cab_i, doc_i;
+/* Function that calculates the distance between a sparse document and
+   a cabinet as ||c||^2 plus x(x - 2c) over the nonzero subjects of
+   the document, so only those subjects of the cabinet are read    */
+double sparseDistance(int doc_i, int cab_i){
+	int first = sparse_starts[doc_i];
+	double distance = cab_norms[cab_i] + calculateSparseDistance(sparse_subs + first, sparse_values + first, 
+		sparse_starts[doc_i + 1] - first, ROW(averages, cab_i));
+	
+	return (distance > 0) ? distance : 0;
+}
 
-	for(doc_i = 0; doc_i < my_docs; doc_i++){
-		for(cab_i = 0; cab_i < num_cabs; cab_i++){
-			distance[doc_i][cab_i] = calculateDistance(doc_subjects[doc_i], &averages[cab_i * num_subs]);
-		}
+/* Function that calculates the distance between a document and a
+   cabinet in the precision the documents are stored in            */
+double docDistance(int doc_i, int cab_i){
+	if(sparse)
+		return sparseDistance(doc_i, cab_i);
+	if(single_precision)
+		return calculateFloatDistance(ROW(doc_floats, doc_i), ROW(float_averages, cab_i));
+	return calculateDistance(ROW(doc_subjects, doc_i), ROW(averages, cab_i));
+}
+
+/* Function that calculates the squared norm of every cabinet average
+   for the sparse distances                                        */
+void calculateSparseNorms(){
+	int cab_i, sub_i;
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		double *cabinet = ROW(averages, cab_i), norm = 0;
+		
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			norm += cabinet[sub_i] * cabinet[sub_i];
+		cab_norms[cab_i] = norm;
 	}
 }
 
-/* Function that finds the minimum distance between a document 
-   and a cabinet.                                                   */
-int findMinDistance(double* distances, int cabinet_id){
-	int cab_i;
-	double min_distance = distances[cabinet_id];
+/* Function that rounds the averages of the cabinets first_cab to
+   last_cab - 1 to floats for the single precision mode            */
+void convertAverages(int first_cab, int last_cab){
+	int cab_i, sub_i;
+	
+	for(cab_i = first_cab; cab_i < last_cab; cab_i++)
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			ROW(float_averages, cab_i)[sub_i] = (float) ROW(averages, cab_i)[sub_i];
+}
+
+/* Function that finds the closest cabinet to a document, calculating the
+   distances on the fly so that no distance matrix has to be kept. If
+   min_distances is not NULL it gets the smallest and the second 
+   smallest distance                                                */
+int findMinDistance(int doc_i, int cabinet_id, double *min_distances){
+	int cab_i, current_cab = cabinet_id;
+	double min_distance = docDistance(doc_i, cabinet_id);
+	double second = DBL_MAX;
 
 	for(cab_i = 0; cab_i < num_cabs; cab_i++){
-		double current_distance = distances[cab_i];
+		double current_distance;
+		
+		if(cab_i == current_cab)
+			continue;
 		
+		current_distance = docDistance(doc_i, cab_i);
 		if(current_distance < min_distance){
+			second = min_distance;
 			min_distance = current_distance;
 			cabinet_id = cab_i;
 		}
+		else if(current_distance < second)
+			second = current_distance;
+	}
+	
+	if(min_distances != NULL){
+		min_distances[0] = min_distance;
+		min_distances[1] = second;
 	}
 	
 	return cabinet_id;
 }
 
-/* Function that moves documents from one cabinet to another */
-int changeDocuments(){
-	int doc_i, moved_flag_aux = 0, moved_flag = 0;	
+/* Function that rounds a subject to the nearest 8 bit code of its scale
+   and yields the squared difference between the subject and its code */
+double quantizeSubject(double value, int sub_i, unsigned char *code){
+	double level = (quant_scale[sub_i] > 0) ? floor((value - quant_min[sub_i]) / quant_scale[sub_i] + 0.5) : 0;
+	
+	level = (level < 0) ? 0 : (level > CODE_LEVELS) ? CODE_LEVELS : level;
+	*code = (unsigned char) level;
+	value -= quant_min[sub_i] + quant_scale[sub_i] * level;
+	return value * value;
+}
 
+/* Function that quantizes the subjects of every document to 8 bit codes.
+   Every subject has a scale of its own, from its smallest to its
+   largest value over the documents of every process, and each
+   document keeps how far it is from the subjects of its codes      */
+void quantizeDocuments(){
+	int doc_i, sub_i;
+	
+	quant_min = allocateDoubleMatrix(1, sub_stride);
+	quant_scale = allocateDoubleMatrix(1, sub_stride);
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		quant_min[sub_i] = DBL_MAX;
+		quant_scale[sub_i] = -DBL_MAX;
+	}
+	
+	/* quant_scale holds the largest value of each subject until the steps are known */
 	for(doc_i = 0; doc_i < my_docs; doc_i++){
-		int current_cab = doc_index[doc_i];
-		int closest_cab = findMinDistance(distance[doc_i], current_cab);
-		int cur_cab_offset = current_cab*num_subs;
-		int clo_cab_offset = closest_cab*num_subs;
-		
-		if(current_cab != closest_cab){
-			int sub_i;
-			moved_flag_aux = 1;
+		for(sub_i = 0; sub_i < num_subs; sub_i++){
+			double value = SUBJECT(doc_i, sub_i);
 			
-			for(sub_i = 0; sub_i < num_subs; sub_i++){
-				new_averages[cur_cab_offset++] -= doc_subjects[doc_i][sub_i];
-				new_averages[clo_cab_offset++] += doc_subjects[doc_i][sub_i];
-			}
-
-			new_num_docs[current_cab]--;
-			new_num_docs[closest_cab]++;
-			doc_index[doc_i] = closest_cab;
+			quant_min[sub_i] = (value < quant_min[sub_i]) ? value : quant_min[sub_i];
+			quant_scale[sub_i] = (value > quant_scale[sub_i]) ? value : quant_scale[sub_i];
 		}
 	}
+	MPI_Allreduce(MPI_IN_PLACE, quant_min, num_subs, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+	MPI_Allreduce(MPI_IN_PLACE, quant_scale, num_subs, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		if(quant_scale[sub_i] < quant_min[sub_i])
+			quant_min[sub_i] = quant_scale[sub_i] = 0;
+		else
+			quant_scale[sub_i] = (quant_scale[sub_i] - quant_min[sub_i]) / CODE_LEVELS;
+	}
 	
-	MPI_Allreduce(&moved_flag_aux, &moved_flag, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD );
-
-	return moved_flag;
+	code_stride = sub_stride;
+	doc_codes = (unsigned char*) allocateDoubleMatrix(my_docs, code_stride / sizeof(double));
+	doc_errors = (double*) malloc(sizeof(double) * (my_docs > 0 ? my_docs : 1));
+	cab_offsets = allocateDoubleMatrix(num_cabs, sub_stride);
+	approx_distances = (double*) malloc(sizeof(double) * num_cabs);
+	
+	for(doc_i = 0; doc_i < my_docs; doc_i++){
+		double error = 0;
+		
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			error += quantizeSubject(SUBJECT(doc_i, sub_i), sub_i, CODE_ROW(doc_codes, doc_i) + sub_i);
+		doc_errors[doc_i] = sqrt(error);
+	}
 }
 
-
-/* Function that writes the position of each document to a file */
-void writeToFile(char *input_filename){
-	int doc_i, proc_i;
-	FILE *output_file;
-	MPI_Status status;
-	int startDoc = 0;
-	char output_filename[FILENAME_BUFFER];
-	int chunk = num_docs/num_procs;
-	int *temp_doc_index = malloc(sizeof(int) * (my_docs+1));
+/* Function that writes the averages of every cabinet as offsets from
+   the subjects of code 0, which the codes of the documents are
+   compared with                                                    */
+void offsetCabinets(){
+	int cab_i, sub_i;
 	
-	memcpy(output_filename, input_filename, strlen(input_filename) - 3);
-	output_filename[strlen(input_filename) - 3] = '\0';
-
-	strcat(output_filename, ".out");
-	output_file = fopen(output_filename, "w+");
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		for(sub_i = 0; sub_i < num_subs; sub_i++){
+			double value = single_precision ? ROW(float_averages, cab_i)[sub_i] : ROW(averages, cab_i)[sub_i];
+			
+			ROW(cab_offsets, cab_i)[sub_i] = value - quant_min[sub_i];
+		}
+	}
+}
 
-	for(proc_i = 1; proc_i < num_procs; proc_i++){
-		int proc_docs = chunk + HAS_EXTRA(proc_i, num_procs, num_docs);
+/* Function that finds the closest cabinet to a document from its codes.
+   The distance between the document rebuilt from its codes and a
+   cabinet, widened by how far the document is from its codes, bounds
+   their exact distance. Only the cabinets whose lower bound is below
+   the smallest upper bound can be the closest, so only those are
+   measured exactly, with the ties of findMinDistance, reading just
+   those lines of the exact subjects. approx is scratch space for
+   num_cabs distances and measured gets the exact distances taken   */
+int findMinDistanceQuantized(int doc_i, int cabinet_id, double *approx, int *measured){
+	int cab_i, current_cab = cabinet_id;
+	unsigned char *codes = CODE_ROW(doc_codes, doc_i);
+	double best_upper = DBL_MAX, error = doc_errors[doc_i], min_distance;
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		approx[cab_i] = sqrt(calculateCodeDistance(codes, quant_scale, ROW(cab_offsets, cab_i)));
+		if(approx[cab_i] < best_upper)
+			best_upper = approx[cab_i];
+	}
+	best_upper = (best_upper + error) * (1 + bound_slack);
+	
+	min_distance = docDistance(doc_i, current_cab);
+	*measured = 1;
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		double current_distance;
 		
-		MPI_Recv(temp_doc_index, proc_docs , MPI_INT, proc_i, DOC_SUBS_RESULT, MPI_COMM_WORLD, &status);
-		for(doc_i = 0; doc_i < proc_docs; doc_i++)
-			fprintf(output_file, "%d %d\n", startDoc++, temp_doc_index[doc_i]);
-			
+		if(cab_i == current_cab || approx[cab_i] - error > best_upper)
+			continue;
+		
+		current_distance = docDistance(doc_i, cab_i);
+		(*measured)++;
+		if(current_distance < min_distance){
+			min_distance = current_distance;
+			cabinet_id = cab_i;
+		}
 	}
 	
-	for(doc_i = 0; doc_i < my_docs; doc_i++)
-		fprintf(output_file, "%d %d\n", startDoc++, doc_index[doc_i]);
-
-	free(temp_doc_index);
-	fclose(output_file);
+	return cabinet_id;
 }
 
-/* Function that frees a matrix of doubles */
-void freeDoubleMatrix(double **matrix, int num_lines){
-	int line_i;	
+/* Function that finds the closest cabinet of every document from the 8
+   bit codes, counting the exact distances that were needed         */
+void findClosestCabinetsQuantized(){
+	int doc_i;
+	double exact = 0;
 	
-	for(line_i = 0; line_i < num_lines; line_i++)
-		free(matrix[line_i]);
-
-	free(matrix);
+	offsetCabinets();
+	for(doc_i = 0; doc_i < my_docs; doc_i++){
+		int measured;
+		
+		closest_cabs[doc_i] = findMinDistanceQuantized(doc_i, doc_index[doc_i], approx_distances, &measured);
+		exact += measured;
+	}
+	exact_distances += exact;
 }
 
-/* Function that frees the allocated structures along the execution of the program */
-void cleanup(){
-	if(rank == ROOT){		
-		free(temp_cab_docs);
-		free(temp_new_averages);
-		free(cab_docs);
-	} 
+/* Function that calculates the squared norm of every document */
+void calculateDocumentNorms(){
+	int doc_i;
 	
-	freeDoubleMatrix(distance, my_docs);
-	freeDoubleMatrix(doc_subjects, my_docs);
+	for(doc_i = 0; doc_i < my_docs; doc_i++){
+		int sub_i;
+		double *subjects = ROW(doc_subjects, doc_i), norm = 0;
 		
-	free(averages);
-	free(new_averages);
-	free(new_num_docs);
-	free(doc_index);
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			norm += subjects[sub_i] * subjects[sub_i];
+		doc_norms[doc_i] = norm;
+	}
 }
 
-int main(int argc, char *argv[]){
-	int temp_cabs;
-	FILE *input_file;
-	MPI_Status status;
-	char *input_filename = (char*) malloc(sizeof(char)*(strlen(argv[1])+2));
+/* Function that calculates the squared norm of every cabinet average and
+   packs the averages in groups of PACK_CABS cabinets, subject by
+   subject, so the cross products can be vectorized across cabinets */
+void calculateCabinetNorms(){
+	int cab_i, sub_i, num_groups = (num_cabs + PACK_CABS - 1) / PACK_CABS;
 	
-	MPI_Init (&argc, &argv);
-	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
-	MPI_Comm_size (MPI_COMM_WORLD, &num_procs);
+	if(cab_packed == NULL)
+		cab_packed = allocateDoubleMatrix(num_groups * num_subs, PACK_CABS);
 	
-	initializeTime = MPI_Wtime();
-
-	if(rank == ROOT){
-		strcpy(input_filename, argv[1]); 
-		input_file = fopen(input_filename, "r");
+	max_cab_norm = 0;
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		double *cabinet = ROW(averages, cab_i), norm = 0;
+		double *packed = cab_packed + (size_t)(cab_i / PACK_CABS) * num_subs * PACK_CABS + cab_i % PACK_CABS;
 		
-		if(input_file == NULL){
-			printf("ERROR reading file!");
-			perror(input_filename);
-			MPI_Finalize();
-			return -1;
+		for(sub_i = 0; sub_i < num_subs; sub_i++){
+			norm += cabinet[sub_i] * cabinet[sub_i];
+			packed[sub_i * PACK_CABS] = cabinet[sub_i];
 		}
-		
-		fscanf(input_file, "%d %d %d\n", &temp_cabs, &num_docs, &num_subs);
-		num_cabs = (argv[2] != NULL) ? atoi(argv[2]) : temp_cabs;
-			
-		shareInitializationValues();
+		cab_norms[cab_i] = norm;
+		if(norm > max_cab_norm)
+			max_cab_norm = norm;
 	}
-	else 
-		receiveInitializationValues();
-		
-	initializeStructures();
-
-	if(rank == ROOT)
-		sendFileChunks(input_file);
-	else {
-		int docChunkSize;
-		MPI_Recv(&docChunkSize, 1, MPI_INT, ROOT, CHUNK_SIZE_MSG, MPI_COMM_WORLD, &status);
-		doc_chunk = (char*) malloc(docChunkSize);	
-		MPI_Recv(doc_chunk, docChunkSize, MPI_CHAR, ROOT, CHUNK_MSG, MPI_COMM_WORLD, &status);
-	}	
+	
+	cab_tile = TILE_BYTES / (num_subs * PACK_CABS * sizeof(double));
+	cab_tile = (cab_tile < 1 ? 1 : cab_tile) * PACK_CABS;
+}
 
-	readAndStore(doc_chunk);	
+/* Function that finds the closest cabinet of a tile of documents. The
+   distances are expanded as ||x||^2 - 2x.c + ||c||^2 and the cross
+   terms are calculated a block of cabinets at a time, so each block is
+   reused by every document of the tile while it is still in cache. 
+   Documents whose two best cabinets are too close to be told apart by
+   the expansion are decided with exact distances.                   */
+void findClosestCabinetsTile(int doc_start, int tile_docs){
+	double best[DOC_TILE], second[DOC_TILE], cross[4 * PACK_CABS];
+	int best_cab[DOC_TILE];
+	int doc_i, cab_i, cab_start;
 	
- 	printf("Initialization ended after :%f\n", MPI_Wtime() - initializeTime);
+	for(doc_i = 0; doc_i < tile_docs; doc_i++){
+		best[doc_i] = second[doc_i] = DBL_MAX;
+		best_cab[doc_i] = doc_index[doc_start + doc_i];
+	}
 	
-	while(1){
-		updateAverages();
+	for(cab_start = 0; cab_start < num_cabs; cab_start += cab_tile){
+		int cab_end = cab_start + cab_tile < num_cabs ? cab_start + cab_tile : num_cabs;
 		
-		calculateDistances();	
-		
-		if(!changeDocuments())
-			break;
+		for(doc_i = 0; doc_i < tile_docs; doc_i += 4){
+			double *docs[4];
+			int doc_k, quad_docs = tile_docs - doc_i < 4 ? tile_docs - doc_i : 4;
+			
+			for(doc_k = 0; doc_k < 4; doc_k++)
+				docs[doc_k] = ROW(doc_subjects, doc_start + doc_i + (doc_k < quad_docs ? doc_k : 0));
+			
+			for(cab_i = cab_start; cab_i < cab_end; cab_i += PACK_CABS){
+				double *packed = cab_packed + (size_t)(cab_i / PACK_CABS) * num_subs * PACK_CABS;
+				
+				calculateCrossProducts(docs, packed, cross);
+				
+				for(doc_k = 0; doc_k < quad_docs; doc_k++){
+					int cab_k, doc_t = doc_i + doc_k;
+					double doc_norm = doc_norms[doc_start + doc_t];
+					
+					for(cab_k = 0; cab_k < PACK_CABS && cab_i + cab_k < cab_end; cab_k++){
+						double current_distance = doc_norm - 2 * cross[doc_k * PACK_CABS + cab_k] + cab_norms[cab_i + cab_k];
+						
+						if(current_distance < second[doc_t]){
+							if(current_distance < best[doc_t]){
+								second[doc_t] = best[doc_t];
+								best[doc_t] = current_distance;
+								best_cab[doc_t] = cab_i + cab_k;
+							}
+							else
+								second[doc_t] = current_distance;
+						}
+					}
+				}
+			}
+		}
 	}
+	
+	for(doc_i = 0; doc_i < tile_docs; doc_i++){
+		int doc_id = doc_start + doc_i;
+		double tolerance = TIE_TOLERANCE * (doc_norms[doc_id] + max_cab_norm);
 		
-	if(rank == ROOT)
-		writeToFile(input_filename);
-	else
-		MPI_Send(doc_index, my_docs, MPI_INT, ROOT, DOC_SUBS_RESULT, MPI_COMM_WORLD);
+		if(second[doc_i] - best[doc_i] <= tolerance)
+			closest_cabs[doc_id] = findMinDistance(doc_id, doc_index[doc_id], NULL);
+		else
+			closest_cabs[doc_id] = best_cab[doc_i];
+	}
+}
+
+/* Function that measures how far each cabinet moved in the last update,
+   which bounds how much the distances of the documents can change  */
+void updateCabinetDrift(){
+	int cab_i;
+	
+	max_drift = second_drift = 0;
+	max_drift_cab = -1;
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		double drift = sqrt(calculateDistance(ROW(averages, cab_i), ROW(prev_averages, cab_i)));
+		
+		memcpy(ROW(prev_averages, cab_i), ROW(averages, cab_i), sizeof(double) * sub_stride);
+		cab_drift[cab_i] = drift;
+		if(drift > max_drift){
+			second_drift = max_drift;
+			max_drift = drift;
+			max_drift_cab = cab_i;
+		}
+		else if(drift > second_drift)
+			second_drift = drift;
+	}
+
+}
+
+/* Function that calculates half the distance from each cabinet to its
+   nearest neighbour */
+void updateCabinetGaps(){
+	int cab_i;
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		int cab_j;
+		double min_gap = DBL_MAX;
+		
+		for(cab_j = 0; cab_j < num_cabs; cab_j++){
+			if(cab_j != cab_i){
+				double gap = calculateDistance(ROW(averages, cab_i), ROW(averages, cab_j));
+				if(gap < min_gap)
+					min_gap = gap;
+			}
+		}
+		cab_half_gap[cab_i] = 0.5 * sqrt(min_gap);
+	}
+}
+
+/* Function that finds the closest cabinet of every document keeping, for
+   each document, an upper bound on the distance to its cabinet and a 
+   lower bound on the distance to any other cabinet (Hamerly). Documents
+   whose upper bound is below the lower bound, or below half the gap to
+   the nearest cabinet, cannot move and their distances are skipped */
+void findClosestCabinetsPruned(){
+	int doc_i;
+	
+	updateCabinetDrift();
+	updateCabinetGaps();
+	
+	for(doc_i = 0; doc_i < my_docs; doc_i++){
+		int cab_id = doc_index[doc_i];
+		double bound, distances[2];
+		
+		upper_bounds[doc_i] += cab_drift[cab_id];
+		lower_bounds[doc_i] -= (cab_id == max_drift_cab) ? second_drift : max_drift;
+		bound = lower_bounds[doc_i] > cab_half_gap[cab_id] ? lower_bounds[doc_i] : cab_half_gap[cab_id];
+		closest_cabs[doc_i] = cab_id;
+		
+		if(upper_bounds[doc_i] * (1 + bound_slack) < bound)
+			continue;
+		
+		upper_bounds[doc_i] = sqrt(docDistance(doc_i, cab_id));
+		if(upper_bounds[doc_i] * (1 + bound_slack) < bound)
+			continue;
+		
+		closest_cabs[doc_i] = findMinDistance(doc_i, cab_id, distances);
+		upper_bounds[doc_i] = sqrt(distances[0]);
+		lower_bounds[doc_i] = sqrt(distances[1]);
+	}
+}
+
+/* Function that clusters the cabinets into num_groups groups with a few
+   rounds of k-means over their averages. The cabinets of each group are
+   stored contiguously in group_cabs, in ascending order            */
+void groupCabinets(){
+	int cab_i, group_i, round;
+	double *centers = allocateDoubleMatrix(num_groups, sub_stride);
+	int *counts = (int*) calloc(num_groups + 1, sizeof(int));
+	
+	cab_group = (int*) malloc(sizeof(int) * num_cabs);
+	group_cabs = (int*) malloc(sizeof(int) * num_cabs);
+	group_start = (int*) calloc(num_groups + 1, sizeof(int));
+	group_drift = (double*) malloc(sizeof(double) * num_groups);
+	
+	for(group_i = 0; group_i < num_groups; group_i++)
+		memcpy(ROW(centers, group_i), ROW(averages, (int)((double) group_i * num_cabs / num_groups)), sizeof(double) * sub_stride);
+	
+	for(round = 0; round < GROUP_ROUNDS; round++){
+		for(cab_i = 0; cab_i < num_cabs; cab_i++){
+			double min_distance = DBL_MAX;
+			for(group_i = 0; group_i < num_groups; group_i++){
+				double current_distance = calculateDistance(ROW(averages, cab_i), ROW(centers, group_i));
+				if(current_distance < min_distance){
+					min_distance = current_distance;
+					cab_group[cab_i] = group_i;
+				}
+			}
+		}
+		
+		memset(centers, 0, sizeof(double) * num_groups * sub_stride);
+		memset(counts, 0, sizeof(int) * num_groups);
+		for(cab_i = 0; cab_i < num_cabs; cab_i++){
+			int sub_i;
+			double *center = ROW(centers, cab_group[cab_i]);
+			
+			for(sub_i = 0; sub_i < num_subs; sub_i++)
+				center[sub_i] += ROW(averages, cab_i)[sub_i];
+			counts[cab_group[cab_i]]++;
+		}
+		for(group_i = 0; group_i < num_groups; group_i++){
+			int sub_i;
+			for(sub_i = 0; sub_i < num_subs && counts[group_i] > 0; sub_i++)
+				ROW(centers, group_i)[sub_i] /= counts[group_i];
+		}
+	}
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++)
+		group_start[cab_group[cab_i] + 1]++;
+	for(group_i = 0; group_i < num_groups; group_i++){
+		group_start[group_i + 1] += group_start[group_i];
+		counts[group_i] = group_start[group_i];
+	}
+	for(cab_i = 0; cab_i < num_cabs; cab_i++)
+		group_cabs[counts[cab_group[cab_i]]++] = cab_i;
+	
+	freeDoubleMatrix(centers);
+	free(counts);
+}
+
+/* Function that finds the closest cabinet of a document with Yinyang's
+   group filter: the document keeps an upper bound on the distance to
+   its cabinet and one lower bound per group of cabinets, and only the
+   groups whose lower bound is below the best distance found so far are
+   searched. group_min and group_arg are scratch space for two distances
+   and one cabinet per group                                        */
+void findClosestCabinetYinyang(int doc_i, double *group_min, int *group_arg){
+	int group_i, cab_id = doc_index[doc_i], best_cab = cab_id;
+	double *bounds = group_bounds + (size_t) doc_i * num_groups;
+	double global_bound = DBL_MAX, best_distance, best_squared;
+	
+	upper_bounds[doc_i] += cab_drift[cab_id];
+	for(group_i = 0; group_i < num_groups; group_i++){
+		bounds[group_i] -= group_drift[group_i];
+		if(bounds[group_i] < global_bound)
+			global_bound = bounds[group_i];
+	}
+	
+	closest_cabs[doc_i] = cab_id;
+	if(upper_bounds[doc_i] * (1 + bound_slack) < global_bound)
+		return;
+	
+	best_squared = docDistance(doc_i, cab_id);
+	best_distance = upper_bounds[doc_i] = sqrt(best_squared);
+	if(upper_bounds[doc_i] * (1 + bound_slack) < global_bound)
+		return;
+	
+	for(group_i = 0; group_i < num_groups; group_i++){
+		int cab_k, min_cab = num_cabs;
+		double prev_bound = bounds[group_i] + group_drift[group_i], min1 = DBL_MAX, min2 = DBL_MAX;
+		
+		group_arg[group_i] = -1;
+		if(bounds[group_i] > best_distance * (1 + bound_slack))
+			continue;
+		
+		for(cab_k = group_start[group_i]; cab_k < group_start[group_i + 1]; cab_k++){
+			int cab_i = group_cabs[cab_k];
+			double current_squared, cab_bound = prev_bound - cab_drift[cab_i];
+			
+			if(cab_i == cab_id)
+				continue;
+			
+			/* A cabinet whose own bound is above the best distance is
+			   skipped and its bound used in place of the distance.
+			   Otherwise ties are broken as in findMinDistance: the
+			   current cabinet wins, then the lowest cabinet id. The
+			   group minimums are kept squared to save square roots */
+			if(cab_bound <= best_distance * (1 + bound_slack)){
+				current_squared = docDistance(doc_i, cab_i);
+				if(current_squared < best_squared || (current_squared == best_squared && best_cab != cab_id && cab_i < best_cab)){
+					best_squared = current_squared;
+					best_distance = sqrt(current_squared);
+					best_cab = cab_i;
+				}
+			}
+			else
+				current_squared = cab_bound * cab_bound;
+			
+			if(current_squared < min1){
+				min2 = min1;
+				min1 = current_squared;
+				min_cab = cab_i;
+			}
+			else if(current_squared < min2)
+				min2 = current_squared;
+		}
+		
+		group_min[2 * group_i] = min1;
+		group_min[2 * group_i + 1] = min2;
+		group_arg[group_i] = min_cab;
+	}
+	
+	for(group_i = 0; group_i < num_groups; group_i++){
+		if(group_arg[group_i] != -1)
+			bounds[group_i] = sqrt(group_min[2 * group_i + (group_arg[group_i] == best_cab ? 1 : 0)]);
+	}
+	
+	if(best_cab != cab_id && upper_bounds[doc_i] < bounds[cab_group[cab_id]])
+		bounds[cab_group[cab_id]] = upper_bounds[doc_i];
+	
+	upper_bounds[doc_i] = best_distance;
+	closest_cabs[doc_i] = best_cab;
+}
+
+/* Function that finds the closest cabinet of every document with the
+   Yinyang group filter */
+void findClosestCabinetsGrouped(){
+	int group_i, cab_k, doc_i, *group_arg;
+	double *group_min;
+	
+	if(group_cabs == NULL)
+		groupCabinets();
+	
+	updateCabinetDrift();
+	for(group_i = 0; group_i < num_groups; group_i++){
+		group_drift[group_i] = 0;
+		for(cab_k = group_start[group_i]; cab_k < group_start[group_i + 1]; cab_k++)
+			if(cab_drift[group_cabs[cab_k]] > group_drift[group_i])
+				group_drift[group_i] = cab_drift[group_cabs[cab_k]];
+	}
+	
+	group_min = (double*) malloc(sizeof(double) * 2 * num_groups);
+	group_arg = (int*) malloc(sizeof(int) * num_groups);
+	for(doc_i = 0; doc_i < my_docs; doc_i++)
+		findClosestCabinetYinyang(doc_i, group_min, group_arg);
+	
+	free(group_min);
+	free(group_arg);
+}
+
+/* Function that prints how long each block of the overlapped reduction
+   took to arrive, how long the process waited for it and how long its
+   distances took. What was not spent waiting was hidden behind them */
+void printTimeline(){
+	int block_i;
+	double waited = flag_wait, span = block_ready[overlap_blocks - 1];
+	
+	printf("Iteration %d: moved flag after %f\n", assign_passes, flag_wait);
+	for(block_i = 0; block_i < overlap_blocks; block_i++){
+		printf("  block %d (cabinets %d-%d): ready after %f, waited %f, distances %f\n", block_i, 
+			blockStart(block_i), blockStart(block_i + 1) - 1, block_ready[block_i], block_waits[block_i], block_times[block_i]);
+		waited += block_waits[block_i];
+	}
+	printf("  reduction %f, waited %f, overlapped %.0f%%\n", span, waited, 
+		span > 0 && waited < span ? 100 * (span - waited) / span : 0.0);
+}
+
+/* Function that finds the closest cabinet of every document one block of
+   cabinets at a time, so that the distances to a block are calculated
+   while the averages of the next ones are still being reduced. As in
+   findMinDistance, a document only leaves its cabinet for one that is
+   strictly closer, the lowest id winning a tie                     */
+void findClosestCabinetsOverlapped(){
+	int block_i, doc_i;
+	
+	for(doc_i = 0; doc_i < my_docs; doc_i++){
+		block_min[doc_i] = DBL_MAX;
+		closest_cabs[doc_i] = doc_index[doc_i];
+	}
+	
+	for(block_i = 0; block_i < overlap_blocks; block_i++){
+		int start = blockStart(block_i), end = blockStart(block_i + 1);
+		double pass_start;
+		
+		waitBlocks(block_i + 1);
+		if(single_precision)
+			convertAverages(start, end);
+		pass_start = MPI_Wtime();
+		
+		for(doc_i = 0; doc_i < my_docs; doc_i += PROGRESS_DOCS){
+			int doc_k, cab_i, last_doc = (my_docs - doc_i < PROGRESS_DOCS) ? my_docs : doc_i + PROGRESS_DOCS;
+			
+			progressBlocks();
+			for(doc_k = doc_i; doc_k < last_doc; doc_k++){
+				for(cab_i = start; cab_i < end; cab_i++){
+					double distance = docDistance(doc_k, cab_i);
+					
+					if(cab_i == doc_index[doc_k])
+						current_distances[doc_k] = distance;
+					else if(distance < block_min[doc_k]){
+						block_min[doc_k] = distance;
+						closest_cabs[doc_k] = cab_i;
+					}
+				}
+			}
+		}
+		block_times[block_i] = MPI_Wtime() - pass_start;
+	}
+	
+	for(doc_i = 0; doc_i < my_docs; doc_i++)
+		if(current_distances[doc_i] <= block_min[doc_i])
+			closest_cabs[doc_i] = doc_index[doc_i];
+	
+	if(verbose && rank == ROOT)
+		printTimeline();
+}
+
+/* Function that finds the closest cabinet of every document */
+void findClosestCabinets(){
+	int doc_i;
+	
+	assign_passes++;
+	if(overlap_blocks > 0 && assign_mode == ASSIGN_NAIVE && !quantized && !sparse){
+		findClosestCabinetsOverlapped();
+		return;
+	}
+	
+	/* The other modes need every average before they start */
+	if(overlap_blocks > 0)
+		waitBlocks(overlap_blocks);
+	if(single_precision)
+		convertAverages(0, num_cabs);
+	if(sparse)
+		calculateSparseNorms();
+	
+	if(assign_mode == ASSIGN_GEMM){
+		calculateCabinetNorms();
+		
+		for(doc_i = 0; doc_i < my_docs; doc_i += DOC_TILE)
+			findClosestCabinetsTile(doc_i, my_docs - doc_i < DOC_TILE ? my_docs - doc_i : DOC_TILE);
+		return;
+	}
+	
+	if(assign_mode == ASSIGN_HAMERLY){
+		findClosestCabinetsPruned();
+		return;
+	}
+	
+	/* The first averages all come from doc_id%num_cabs and are nearly
+	   the same, so the Yinyang mode searches every cabinet in the first
+	   pass and groups the cabinets with the averages of the second  */
+	if(assign_mode == ASSIGN_YINYANG && assign_passes > 1){
+		findClosestCabinetsGrouped();
+		return;
+	}
+	else if(assign_mode == ASSIGN_YINYANG)
+		updateCabinetDrift();
+	
+	if(quantized){
+		findClosestCabinetsQuantized();
+		return;
+	}
+	
+	for(doc_i = 0; doc_i < my_docs; doc_i++)
+		closest_cabs[doc_i] = findMinDistance(doc_i, doc_index[doc_i], NULL);
+}
+
+/* Function that moves documents from one cabinet to another and yields
+   how many moved                                                  */
+int changeDocuments(){
+	int doc_i, moved_flag = 0;	
+
+	for(doc_i = 0; doc_i < my_docs; doc_i++){
+		int current_cab = doc_index[doc_i];
+		int closest_cab = closest_cabs[doc_i];
+		int cur_cab_offset = current_cab*sub_stride;
+		int clo_cab_offset = closest_cab*sub_stride;
+		
+		if(current_cab != closest_cab){
+			int sub_i, nz_i;
+			moved_flag++;
+			
+			if(sparse){
+				for(nz_i = sparse_starts[doc_i]; nz_i < sparse_starts[doc_i + 1]; nz_i++){
+					new_averages[cur_cab_offset + sparse_subs[nz_i]] -= sparse_values[nz_i];
+					new_averages[clo_cab_offset + sparse_subs[nz_i]] += sparse_values[nz_i];
+				}
+			}
+			else {
+				for(sub_i = 0; sub_i < num_subs; sub_i++){
+					new_averages[cur_cab_offset++] -= SUBJECT(doc_i, sub_i);
+					new_averages[clo_cab_offset++] += SUBJECT(doc_i, sub_i);
+				}
+			}
+
+			new_num_docs[current_cab]--;
+			new_num_docs[closest_cab]++;
+			doc_index[doc_i] = closest_cab;
+		}
+	}
+	
+	return moved_flag;
+}
+
+
+/* Function that yields the place of a process in the order of the
+   documents, process 1 coming first and ROOT last                 */
+int procOrder(int proc){
+	return (proc == ROOT) ? num_procs - 1 : proc - 1;
+}
+
+/* Function that yields how many of the documents first_a to first_a +
+   count_a - 1 are also in first_b to first_b + count_b - 1, and the
+   first of them in start                                           */
+int overlapDocs(int first_a, int count_a, int first_b, int count_b, int *start){
+	int end = (first_a + count_a < first_b + count_b) ? first_a + count_a : first_b + count_b;
+	
+	*start = (first_a > first_b) ? first_a : first_b;
+	return (end > *start) ? end - *start : 0;
+}
+
+/* Function that sends the lines of a per document array to the
+   processes that own them after a migration, counts holding the send
+   counts, send displacements, receive counts and receive displacements
+   of every process. Yields the new array                           */
+void *migrateLines(void *lines, size_t line_bytes, MPI_Datatype line_type, int *counts, int new_docs){
+	void *new_lines = malloc(line_bytes * (new_docs > 0 ? new_docs : 1));
+	
+	MPI_Alltoallv(lines, counts, counts + num_procs, line_type, new_lines, 
+		counts + 2 * num_procs, counts + 3 * num_procs, line_type, MPI_COMM_WORLD);
+	free(lines);
+	return new_lines;
+}
+
+/* Function that sends the nonzero subjects of the sparse documents to
+   the processes that own them after a migration. counts holds the
+   documents sent and received as in migrateDocuments, from which the
+   nonzeros sent to and received from every process are worked out */
+void migrateSparse(int *counts, int new_count){
+	int proc_i, doc_i, *nz_counts = (int*) malloc(sizeof(int) * 4 * num_procs);
+	int *lengths = (int*) malloc(sizeof(int) * (my_docs > 0 ? my_docs : 1));
+	int *new_starts = (int*) malloc(sizeof(int) * (new_count + 1)), *new_subs;
+	double *new_values;
+	
+	for(doc_i = 0; doc_i < my_docs; doc_i++)
+		lengths[doc_i] = sparse_starts[doc_i + 1] - sparse_starts[doc_i];
+	lengths = (int*) migrateLines(lengths, sizeof(int), MPI_INT, counts, new_count);
+	new_starts[0] = 0;
+	for(doc_i = 0; doc_i < new_count; doc_i++)
+		new_starts[doc_i + 1] = new_starts[doc_i] + lengths[doc_i];
+	
+	for(proc_i = 0; proc_i < num_procs; proc_i++){
+		nz_counts[num_procs + proc_i] = sparse_starts[counts[num_procs + proc_i]];
+		nz_counts[proc_i] = sparse_starts[counts[num_procs + proc_i] + counts[proc_i]] - nz_counts[num_procs + proc_i];
+		nz_counts[3 * num_procs + proc_i] = new_starts[counts[3 * num_procs + proc_i]];
+	}
+	MPI_Alltoall(nz_counts, 1, MPI_INT, nz_counts + 2 * num_procs, 1, MPI_INT, MPI_COMM_WORLD);
+	
+	new_subs = (int*) malloc(sizeof(int) * (new_starts[new_count] > 0 ? new_starts[new_count] : 1));
+	new_values = (double*) malloc(sizeof(double) * (new_starts[new_count] > 0 ? new_starts[new_count] : 1));
+	MPI_Alltoallv(sparse_subs, nz_counts, nz_counts + num_procs, MPI_INT, new_subs, 
+		nz_counts + 2 * num_procs, nz_counts + 3 * num_procs, MPI_INT, MPI_COMM_WORLD);
+	MPI_Alltoallv(sparse_values, nz_counts, nz_counts + num_procs, MPI_DOUBLE, new_values, 
+		nz_counts + 2 * num_procs, nz_counts + 3 * num_procs, MPI_DOUBLE, MPI_COMM_WORLD);
+	
+	free(sparse_starts);
+	free(sparse_subs);
+	free(sparse_values);
+	sparse_starts = new_starts;
+	sparse_subs = new_subs;
+	sparse_values = new_values;
+	sparse_count = sparse_capacity = new_starts[new_count];
+	free(lengths);
+	free(nz_counts);
+}
+
+/* Function that moves the documents to the processes that own them
+   once every process gets new_docs[proc] documents. The documents stay
+   in the order of their ids, so each process sends every other one the
+   part of its old range that falls in the new range of the other    */
+void migrateDocuments(int *new_docs){
+	int proc_i, start, new_count = new_docs[rank];
+	int *old_starts = (int*) malloc(sizeof(int) * num_procs);
+	int *old_docs = (int*) malloc(sizeof(int) * num_procs);
+	int *new_starts = (int*) malloc(sizeof(int) * num_procs);
+	int *counts = (int*) malloc(sizeof(int) * 4 * num_procs);
+	MPI_Datatype line_type;
+	
+	for(proc_i = 0; proc_i < num_procs; proc_i++)
+		old_starts[proc_i] = firstDoc(proc_i);
+	memcpy(old_docs, proc_docs, sizeof(int) * num_procs);
+	memcpy(proc_docs, new_docs, sizeof(int) * num_procs);
+	for(proc_i = 0; proc_i < num_procs; proc_i++)
+		new_starts[proc_i] = firstDoc(proc_i);
+	
+	for(proc_i = 0; proc_i < num_procs; proc_i++){
+		counts[proc_i] = overlapDocs(old_starts[rank], old_docs[rank], new_starts[proc_i], new_docs[proc_i], &start);
+		counts[num_procs + proc_i] = counts[proc_i] ? start - old_starts[rank] : 0;
+		counts[2 * num_procs + proc_i] = overlapDocs(old_starts[proc_i], old_docs[proc_i], new_starts[rank], new_count, &start);
+		counts[3 * num_procs + proc_i] = counts[2 * num_procs + proc_i] ? start - new_starts[rank] : 0;
+	}
+	
+	/* Documents used in place from the mapped file only need to be found */
+	if(sparse)
+		migrateSparse(counts, new_count);
+	else if(mapped_file != NULL && single_precision)
+		doc_floats = (float*) ((char*) mapped_file + BINARY_HEADER) + (size_t) new_starts[rank] * sub_stride;
+	else if(mapped_file != NULL)
+		doc_subjects = (double*) ((char*) mapped_file + BINARY_HEADER) + (size_t) new_starts[rank] * sub_stride;
+	else {
+		double *old_lines = single_precision ? (double*) doc_floats : doc_subjects;
+		double *new_lines = single_precision ? (double*) allocateFloatMatrix(new_count) : allocateDoubleMatrix(new_count, sub_stride);
+		
+		MPI_Type_contiguous(sub_stride, single_precision ? MPI_FLOAT : MPI_DOUBLE, &line_type);
+		MPI_Type_commit(&line_type);
+		MPI_Alltoallv(old_lines, counts, counts + num_procs, line_type, new_lines, 
+			counts + 2 * num_procs, counts + 3 * num_procs, line_type, MPI_COMM_WORLD);
+		MPI_Type_free(&line_type);
+		freeDoubleMatrix(old_lines);
+		if(single_precision)
+			doc_floats = (float*) new_lines;
+		else
+			doc_subjects = new_lines;
+	}
+	
+	doc_index = (int*) migrateLines(doc_index, sizeof(int), MPI_INT, counts, new_count);
+	if(doc_codes != NULL){
+		unsigned char *new_codes = (unsigned char*) allocateDoubleMatrix(new_count, code_stride / sizeof(double));
+		
+		MPI_Type_contiguous(code_stride, MPI_UNSIGNED_CHAR, &line_type);
+		MPI_Type_commit(&line_type);
+		MPI_Alltoallv(doc_codes, counts, counts + num_procs, line_type, new_codes, 
+			counts + 2 * num_procs, counts + 3 * num_procs, line_type, MPI_COMM_WORLD);
+		MPI_Type_free(&line_type);
+		freeDoubleMatrix((double*) doc_codes);
+		doc_codes = new_codes;
+		doc_errors = (double*) migrateLines(doc_errors, sizeof(double), MPI_DOUBLE, counts, new_count);
+	}
+	if(doc_norms != NULL)
+		doc_norms = (double*) migrateLines(doc_norms, sizeof(double), MPI_DOUBLE, counts, new_count);
+	if(upper_bounds != NULL)
+		upper_bounds = (double*) migrateLines(upper_bounds, sizeof(double), MPI_DOUBLE, counts, new_count);
+	if(lower_bounds != NULL)
+		lower_bounds = (double*) migrateLines(lower_bounds, sizeof(double), MPI_DOUBLE, counts, new_count);
+	if(group_bounds != NULL){
+		MPI_Type_contiguous(num_groups, MPI_DOUBLE, &line_type);
+		MPI_Type_commit(&line_type);
+		group_bounds = (double*) migrateLines(group_bounds, sizeof(double) * num_groups, line_type, counts, new_count);
+		MPI_Type_free(&line_type);
+	}
+	
+	/* Scratch arrays only need the new size */
+	free(closest_cabs);
+	closest_cabs = (int*) calloc(new_count > 0 ? new_count : 1, sizeof(int));
+	if(block_min != NULL){
+		free(block_min);
+		free(current_distances);
+		block_min = (double*) malloc(sizeof(double) * (new_count > 0 ? new_count : 1));
+		current_distances = (double*) malloc(sizeof(double) * (new_count > 0 ? new_count : 1));
+	}
+	my_docs = new_count;
+	
+	free(old_starts);
+	free(old_docs);
+	free(new_starts);
+	free(counts);
+}
+
+/* Function that prints how many documents every process has */
+void printDistribution(char *reason){
+	int proc_i;
+	
+	printf("%s:", reason);
+	for(proc_i = 0; proc_i < num_procs; proc_i++)
+		printf(" %d", proc_docs[proc_i]);
+	printf("\n");
+}
+
+/* Function that yields the number of nonzero subjects of a document */
+int docNonzeros(int doc_i){
+	int sub_i, nonzeros = 0;
+	
+	if(sparse)
+		return sparse_starts[doc_i + 1] - sparse_starts[doc_i];
+	for(sub_i = 0; sub_i < num_subs; sub_i++)
+		nonzeros += (SUBJECT(doc_i, sub_i) != 0);
+	return nonzeros;
+}
+
+/* Function that splits the documents by their nonzero subjects rather
+   than by their bytes or their number. Every process counts the
+   nonzeros of its documents and finds the cuts that fall among them */
+void splitByNonzeros(){
+	double *proc_weights = (double*) malloc(sizeof(double) * num_procs);
+	double my_weight = 0, before = 0, total = 0, weight = 0;
+	int *cuts = (int*) calloc(num_procs + 1, sizeof(int)), *new_docs = (int*) malloc(sizeof(int) * num_procs);
+	int proc_i, doc_i, cut_i, first_doc = firstDoc(rank);
+	
+	for(doc_i = 0; doc_i < my_docs; doc_i++)
+		my_weight += docNonzeros(doc_i);
+	MPI_Allgather(&my_weight, 1, MPI_DOUBLE, proc_weights, 1, MPI_DOUBLE, MPI_COMM_WORLD);
+	for(proc_i = 0; proc_i < num_procs; proc_i++){
+		total += proc_weights[proc_i];
+		if(procOrder(proc_i) < procOrder(rank))
+			before += proc_weights[proc_i];
+	}
+	
+	/* Cut cut_i starts at the first document past cut_i/num_procs of the weight */
+	cut_i = 1;
+	while(cut_i < num_procs && total * cut_i / num_procs < before)
+		cut_i++;
+	weight = before;
+	for(doc_i = 0; doc_i < my_docs && cut_i < num_procs; doc_i++){
+		weight += docNonzeros(doc_i);
+		while(cut_i < num_procs && weight > total * cut_i / num_procs)
+			cuts[cut_i++] = first_doc + doc_i;
+	}
+	MPI_Allreduce(MPI_IN_PLACE, cuts, num_procs + 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+	cuts[num_procs] = num_docs;
+	
+	if(total > 0){
+		for(proc_i = 0; proc_i < num_procs; proc_i++)
+			new_docs[proc_i] = cuts[procOrder(proc_i) + 1] - cuts[procOrder(proc_i)];
+		migrateDocuments(new_docs);
+	}
+	if(verbose && rank == ROOT)
+		printDistribution("Documents per process (nonzeros)");
+	
+	free(proc_weights);
+	free(cuts);
+	free(new_docs);
+}
+
+/* Function that yields the slowest process when its time is more than
+   REBALANCE_GAIN above the average of the times of the processes,
+   or -1 when they are in balance                                   */
+int outOfBalance(double *proc_times){
+	double mean_time = 0;
+	int proc_i, slowest = 0;
+	
+	for(proc_i = 0; proc_i < num_procs; proc_i++){
+		mean_time += proc_times[proc_i] / num_procs;
+		slowest = (proc_times[proc_i] > proc_times[slowest]) ? proc_i : slowest;
+	}
+	return (proc_times[slowest] > mean_time * (1 + REBALANCE_GAIN)) ? slowest : -1;
+}
+
+/* Function that moves documents from the slow processes to the fast
+   ones. Every process timed its part of the last rebalance period.
+   A single period is too noisy to go by, so documents only move once
+   the same process was the slow one for REBALANCE_PERIODS periods in
+   a row, and still is over the times of those periods added up.
+   Each process then gets a share of the documents proportional to
+   the documents it went through per second in those periods        */
+void rebalanceDocuments(){
+	double *proc_times = (double*) malloc(sizeof(double) * num_procs);
+	double *proc_rates = (double*) malloc(sizeof(double) * num_procs);
+	double rate_sum = 0, known_rate = 0;
+	int *new_docs = (int*) malloc(sizeof(int) * num_procs);
+	int proc_i, assigned = 0, known = 0, slow_proc;
+	
+	MPI_Allgather(&work_time, 1, MPI_DOUBLE, proc_times, 1, MPI_DOUBLE, MPI_COMM_WORLD);
+	work_time = 0;
+	if(period_times == NULL)
+		period_times = (double*) malloc(sizeof(double) * num_procs);
+	
+	slow_proc = outOfBalance(proc_times);
+	if(slow_proc < 0 || slow_proc != slowest_proc)
+		imbalanced_periods = 0;
+	if(slow_proc >= 0){
+		for(proc_i = 0; proc_i < num_procs; proc_i++)
+			period_times[proc_i] = (imbalanced_periods > 0 ? period_times[proc_i] : 0) + proc_times[proc_i];
+		slowest_proc = slow_proc;
+		imbalanced_periods++;
+	}
+	
+	if(imbalanced_periods >= REBALANCE_PERIODS){
+		imbalanced_periods = 0;
+		for(proc_i = 0; proc_i < num_procs; proc_i++){
+			proc_rates[proc_i] = (proc_docs[proc_i] > 0 && period_times[proc_i] > 0) ? proc_docs[proc_i] / period_times[proc_i] : 0;
+			if(proc_rates[proc_i] > 0){
+				known_rate += proc_rates[proc_i];
+				known++;
+			}
+		}
+	}
+	
+	if(known > 0 && outOfBalance(period_times) >= 0){
+		/* Processes without documents are assumed to be average */
+		for(proc_i = 0; proc_i < num_procs; proc_i++){
+			if(proc_rates[proc_i] == 0)
+				proc_rates[proc_i] = known_rate / known;
+			rate_sum += proc_rates[proc_i];
+		}
+		for(proc_i = 0; proc_i < num_procs; proc_i++){
+			new_docs[proc_i] = (int) (num_docs * (proc_rates[proc_i] / rate_sum));
+			assigned += new_docs[proc_i];
+		}
+		for(proc_i = 0; assigned < num_docs; proc_i = (proc_i + 1) % num_procs, assigned++)
+			new_docs[proc_i]++;
+		
+		migrateDocuments(new_docs);
+		if(verbose && rank == ROOT)
+			printDistribution("Documents per process (rebalanced)");
+	}
+	
+	free(proc_times);
+	free(proc_rates);
+	free(new_docs);
+}
+
+/* Function that moves a 32 bit xorshift generator, which gives the same
+   numbers everywhere, to its next state and yields it             */
+unsigned long nextRandom(unsigned long *state){
+	*state ^= (*state << 13) & 0xffffffffUL;
+	*state ^= *state >> 17;
+	*state ^= (*state << 5) & 0xffffffffUL;
+	return *state;
+}
+
+/* Function that yields a pseudo random number below limit */
+int randomBelow(int limit){
+	return (int) (nextRandom(&random_state) % (unsigned long) limit);
+}
+
+/* Function that yields a pseudo random number in [0, 1) */
+double randomUnit(unsigned long *state){
+	return nextRandom(state) / 4294967296.0;
+}
+
+/* Function that adds the subjects of a document to a line of sums */
+void addDocument(double *sums, int doc_i){
+	int sub_i, nz_i;
+	
+	if(sparse){
+		for(nz_i = sparse_starts[doc_i]; nz_i < sparse_starts[doc_i + 1]; nz_i++)
+			sums[sparse_subs[nz_i]] += sparse_values[nz_i];
+	}
+	else {
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			sums[sub_i] += SUBJECT(doc_i, sub_i);
+	}
+}
+
+/* Function that runs the mini-batch mode. Every iteration each process
+   samples its share of batch_size documents at random and finds their
+   closest cabinets, and the sums and counts of the samples are added
+   up over every process with one MPI_Allreduce. Each cabinet then
+   moves towards the mean of the documents it got, by the share of all
+   its sampled documents that came in this batch, or by
+   learning_rate/(1 + iteration) when a rate is given. With -n every
+   process of a node moves its share of the shared averages        */
+void miniBatch(){
+	int iter_i, sample_i, cab_i, sub_i;
+	int local_batch = (my_docs > 0) ? (int) ((double) batch_size * my_docs / num_docs + 0.5) : 0;
+	int first_cab = node_reduce ? num_cabs * node_rank / node_size : 0;
+	int last_cab = node_reduce ? num_cabs * (node_rank + 1) / node_size : num_cabs;
+	int *batch = (int*) malloc(sizeof(int) * (local_batch > 0 ? local_batch : 1));
+	int *batch_cabs = (int*) malloc(sizeof(int) * (local_batch > 0 ? local_batch : 1));
+	double *cab_seen = (double*) calloc(num_cabs, sizeof(double));
+	double mini_time = MPI_Wtime();
+	
+	random_state = (random_state + 2654435761UL * rank) & 0xffffffffUL;
+	if(overlap_blocks > 0)
+		waitBlocks(overlap_blocks);
+	
+	for(iter_i = 0; iter_i < mini_iterations; iter_i++){
+		for(sample_i = 0; sample_i < local_batch; sample_i++)
+			batch[sample_i] = randomBelow(my_docs);
+		if(single_precision)
+			convertAverages(0, num_cabs);
+		if(sparse)
+			calculateSparseNorms();
+		
+		for(sample_i = 0; sample_i < local_batch; sample_i++)
+			batch_cabs[sample_i] = findMinDistance(batch[sample_i], doc_index[batch[sample_i]], NULL);
+		
+		for(sample_i = 0; sample_i < local_batch; sample_i++){
+			addDocument(ROW(new_averages, batch_cabs[sample_i]), batch[sample_i]);
+			new_num_docs[batch_cabs[sample_i]]++;
+		}
+		MPI_Allreduce(MPI_IN_PLACE, new_averages, (num_cabs + count_lines) * sub_stride, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+		
+		for(cab_i = 0; cab_i < num_cabs; cab_i++){
+			double count = new_num_docs[cab_i], rate;
+			
+			if(count == 0)
+				continue;
+			
+			cab_seen[cab_i] += count;
+			rate = (learning_rate > 0) ? learning_rate / (1 + iter_i) : count / cab_seen[cab_i];
+			rate = (rate < 1) ? rate : 1;
+			if(cab_i >= first_cab && cab_i < last_cab)
+				for(sub_i = 0; sub_i < num_subs; sub_i++)
+					ROW(averages, cab_i)[sub_i] += rate * (ROW(new_averages, cab_i)[sub_i] / count - ROW(averages, cab_i)[sub_i]);
+		}
+		memset(new_averages, 0, sizeof(double) * (num_cabs + count_lines) * sub_stride);
+		if(node_reduce)
+			syncNode();
+	}
+	
+	if(rank == ROOT)
+		printf("Mini-batch Time: %f (%d iterations of %d documents)\n", MPI_Wtime() - mini_time, mini_iterations, batch_size);
+	free(batch);
+	free(batch_cabs);
+	free(cab_seen);
+}
+
+/* Function that ends the mini-batch mode with a full pass that puts
+   every document in its closest cabinet. That is the result, unless
+   the full algorithm carries on with -mf, for which the sums of every
+   cabinet are rebuilt as when the documents were read and reduced
+   again. Yields whether the full algorithm carries on             */
+int finishMiniBatch(){
+	int doc_i, cab_i;
+	int first_cab = node_reduce ? num_cabs * node_rank / node_size : 0;
+	int last_cab = node_reduce ? num_cabs * (node_rank + 1) / node_size : num_cabs;
+	
+	findClosestCabinets();
+	memcpy(doc_index, closest_cabs, sizeof(int) * my_docs);
+	if(!mini_refine)
+		return 0;
+	
+	/* The other processes of the node may still be reading the averages */
+	if(node_reduce)
+		syncNode();
+	for(cab_i = first_cab; cab_i < last_cab; cab_i++){
+		memset(ROW(averages, cab_i), 0, sizeof(double) * sub_stride);
+		cab_docs[cab_i] = 0;
+	}
+	for(doc_i = 0; doc_i < my_docs; doc_i++){
+		addDocument(ROW(new_averages, doc_index[doc_i]), doc_i);
+		new_num_docs[doc_index[doc_i]]++;
+	}
+	if(node_reduce)
+		syncNode();
+	return updateAverages(1);
+}
+
+/* Function that copies a document into a line of dense subjects */
+void copyDocument(double *line, int doc_i){
+	int sub_i, nz_i;
+	
+	memset(line, 0, sizeof(double) * sub_stride);
+	if(sparse){
+		for(nz_i = sparse_starts[doc_i]; nz_i < sparse_starts[doc_i + 1]; nz_i++)
+			line[sparse_subs[nz_i]] = sparse_values[nz_i];
+	}
+	else {
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			line[sub_i] = SUBJECT(doc_i, sub_i);
+	}
+}
+
+/* Function that yields the squared norm of a line of subjects */
+double lineNorm(double *line){
+	int sub_i;
+	double norm = 0;
+	
+	for(sub_i = 0; sub_i < num_subs; sub_i++)
+		norm += line[sub_i] * line[sub_i];
+	return norm;
+}
+
+/* Function that calculates the distance between a document and a seed,
+   a line of dense subjects whose squared norm is norm             */
+double seedDistance(int doc_i, double *line, double norm){
+	int sub_i;
+	double distance = 0;
+	
+	if(sparse){
+		int first = sparse_starts[doc_i];
+		
+		distance = norm + calculateSparseDistance(sparse_subs + first, sparse_values + first, 
+			sparse_starts[doc_i + 1] - first, line);
+		return (distance > 0) ? distance : 0;
+	}
+	if(!single_precision)
+		return calculateDistance(ROW(doc_subjects, doc_i), line);
+	
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		double subtract = SUBJECT(doc_i, sub_i) - line[sub_i];
+		distance += subtract * subtract;
+	}
+	return distance;
+}
+
+/* Function that checks every document against the seeds first_seed to
+   last_seed - 1, keeping in distances and nearest the closest seed
+   found so far                                                    */
+void nearestSeeds(double *seeds, double *norms, int first_seed, int last_seed, double *distances, int *nearest){
+	int doc_i, seed_i;
+	
+	for(doc_i = 0; doc_i < my_docs; doc_i++){
+		for(seed_i = first_seed; seed_i < last_seed; seed_i++){
+			double distance = seedDistance(doc_i, ROW(seeds, seed_i), norms[seed_i]);
+			
+			if(distance < distances[doc_i]){
+				distances[doc_i] = distance;
+				nearest[doc_i] = seed_i;
+			}
+		}
+	}
+}
+
+/* Function that picks one of count items with a probability
+   proportional to its weight, or uniformly when weights is NULL or
+   every weight is 0                                               */
+int pickWeighted(double *weights, int count){
+	int item_i, last = count - 1;
+	double total = 0, target;
+	
+	if(weights != NULL)
+		for(item_i = 0; item_i < count; item_i++)
+			total += weights[item_i];
+	if(total <= 0)
+		return (int) (randomUnit(&random_state) * count);
+	
+	target = randomUnit(&random_state) * total;
+	for(item_i = 0; item_i < count; item_i++){
+		if(weights[item_i] > 0){
+			last = item_i;
+			target -= weights[item_i];
+			if(target < 0)
+				return item_i;
+		}
+	}
+	
+	/* Rounding left part of the total, the last weighted item takes it */
+	return last;
+}
+
+/* Function that picks the seeds among the candidates of k-means|| with
+   k-means++, each candidate weighing as much as the documents that
+   are closest to it                                               */
+void reduceCandidates(double *candidates, double *cand_norms, double *weights, int num_cands, double *seeds, double *norms){
+	int cab_i, cand_i, picked;
+	double *cand_distances = (double*) malloc(sizeof(double) * num_cands);
+	double *chances = (double*) malloc(sizeof(double) * num_cands);
+	
+	for(cand_i = 0; cand_i < num_cands; cand_i++)
+		cand_distances[cand_i] = DBL_MAX;
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		for(cand_i = 0; cand_i < num_cands; cand_i++)
+			chances[cand_i] = (cab_i == 0) ? weights[cand_i] : weights[cand_i] * cand_distances[cand_i];
+		picked = pickWeighted(chances, num_cands);
+		memcpy(ROW(seeds, cab_i), ROW(candidates, picked), sizeof(double) * sub_stride);
+		norms[cab_i] = cand_norms[picked];
+		
+		for(cand_i = 0; cand_i < num_cands; cand_i++){
+			double distance = calculateDistance(ROW(candidates, cand_i), ROW(seeds, cab_i));
+			
+			if(distance < cand_distances[cand_i])
+				cand_distances[cand_i] = distance;
+		}
+	}
+	
+	free(cand_distances);
+	free(chances);
+}
+
+/* Function that picks a document of any process with a probability
+   proportional to its weight, or uniformly when weights is NULL, and
+   copies it into line on every process. Every process draws the same
+   number from the shared generator, and the processes are walked in
+   the order of firstDoc so that the picks follow the documents of the
+   file whatever the number of processes. Yields the position of the
+   document in the file for the uniform picks                      */
+int pickDocument(double *weights, double *line){
+	int proc_i, step, doc_i, owner = 0, position = 0, picked = 0;
+	double local = 0, total = 0, target;
+	double *totals = (double*) malloc(sizeof(double) * num_procs);
+	
+	if(weights == NULL)
+		local = my_docs;
+	else
+		for(doc_i = 0; doc_i < my_docs; doc_i++)
+			local += weights[doc_i];
+	MPI_Allgather(&local, 1, MPI_DOUBLE, totals, 1, MPI_DOUBLE, MPI_COMM_WORLD);
+	for(step = 0; step < num_procs; step++)
+		total += totals[(step + 1) % num_procs];
+	if(total <= 0){
+		free(totals);
+		return pickDocument(NULL, line);
+	}
+	
+	target = randomUnit(&random_state) * total;
+	for(step = 0; step < num_procs; step++){
+		proc_i = (step + 1) % num_procs;
+		if(totals[proc_i] > 0){
+			owner = proc_i;
+			if(target < totals[proc_i])
+				break;
+			target -= totals[proc_i];
+			position += (int) totals[proc_i];
+		}
+	}
+	
+	if(weights == NULL){
+		picked = (target < totals[owner]) ? (int) target : (int) totals[owner] - 1;
+		position += picked;
+	}
+	else if(rank == owner){
+		for(doc_i = 0; doc_i < my_docs; doc_i++){
+			if(weights[doc_i] > 0){
+				picked = doc_i;
+				target -= weights[doc_i];
+				if(target < 0)
+					break;
+			}
+		}
+	}
+	
+	if(rank == owner)
+		copyDocument(line, picked);
+	MPI_Bcast(line, sub_stride, MPI_DOUBLE, owner, MPI_COMM_WORLD);
+	free(totals);
+	return position;
+}
+
+/* Function that draws the candidates of k-means||: SEED_ROUNDS rounds
+   keep every document with a probability proportional to its
+   distance to the closest candidate so far, SEED_OVERSAMPLE *
+   num_cabs documents per round on average. Every process draws its
+   own documents and the candidates are gathered on every process,
+   which then picks the same seeds among them                      */
+void seedScalable(double *seeds, double *norms, double *distances){
+	int capacity = 1 + SEED_ROUNDS * SEED_OVERSAMPLE * num_cabs;
+	int round_i, doc_i, proc_i, first, num_cands = 1;
+	int *nearest = (int*) malloc(sizeof(int) * (my_docs > 0 ? my_docs : 1));
+	int *drawn = (int*) malloc(sizeof(int) * (my_docs > 0 ? my_docs : 1));
+	int *counts = (int*) malloc(sizeof(int) * num_procs);
+	int *displs = (int*) malloc(sizeof(int) * num_procs);
+	double *candidates = allocateDoubleMatrix(capacity, sub_stride);
+	double *cand_norms = (double*) malloc(sizeof(double) * capacity);
+	double *weights = (double*) calloc(capacity, sizeof(double));
+	
+	pickDocument(NULL, candidates);
+	cand_norms[0] = lineNorm(candidates);
+	nearestSeeds(candidates, cand_norms, 0, 1, distances, nearest);
+	
+	for(round_i = 0; round_i < SEED_ROUNDS; round_i++){
+		int num_drawn = 0, room = capacity - num_cands;
+		double cost = 0, *drawn_lines;
+		unsigned long draw_state = (nextRandom(&random_state) + 2654435761UL * rank) & 0xffffffffUL;
+		
+		for(doc_i = 0; doc_i < my_docs; doc_i++)
+			cost += distances[doc_i];
+		MPI_Allreduce(MPI_IN_PLACE, &cost, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+		
+		if(draw_state == 0)
+			draw_state = RANDOM_SEED;
+		for(doc_i = 0; doc_i < my_docs; doc_i++)
+			if(randomUnit(&draw_state) * cost < (double) SEED_OVERSAMPLE * num_cabs * distances[doc_i])
+				drawn[num_drawn++] = doc_i;
+		
+		/* Past the capacity the candidates of the last processes are dropped */
+		MPI_Allgather(&num_drawn, 1, MPI_INT, counts, 1, MPI_INT, MPI_COMM_WORLD);
+		for(proc_i = 0; proc_i < num_procs; proc_i++){
+			counts[proc_i] = (counts[proc_i] < room) ? counts[proc_i] : room;
+			room -= counts[proc_i];
+		}
+		num_drawn = counts[rank];
+		
+		drawn_lines = allocateDoubleMatrix(num_drawn > 0 ? num_drawn : 1, sub_stride);
+		for(doc_i = 0; doc_i < num_drawn; doc_i++)
+			copyDocument(ROW(drawn_lines, doc_i), drawn[doc_i]);
+		for(proc_i = 0; proc_i < num_procs; proc_i++){
+			counts[proc_i] *= sub_stride;
+			displs[proc_i] = (proc_i == 0) ? 0 : displs[proc_i - 1] + counts[proc_i - 1];
+		}
+		MPI_Allgatherv(drawn_lines, num_drawn * sub_stride, MPI_DOUBLE, ROW(candidates, num_cands), counts, displs, 
+			MPI_DOUBLE, MPI_COMM_WORLD);
+		freeDoubleMatrix(drawn_lines);
+		
+		first = num_cands;
+		num_cands += (displs[num_procs - 1] + counts[num_procs - 1]) / sub_stride;
+		for(doc_i = first; doc_i < num_cands; doc_i++)
+			cand_norms[doc_i] = lineNorm(ROW(candidates, doc_i));
+		nearestSeeds(candidates, cand_norms, first, num_cands, distances, nearest);
+	}
+	
+	for(doc_i = 0; doc_i < my_docs; doc_i++)
+		weights[nearest[doc_i]]++;
+	MPI_Allreduce(MPI_IN_PLACE, weights, num_cands, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	reduceCandidates(candidates, cand_norms, weights, num_cands, seeds, norms);
+	
+	free(nearest);
+	free(drawn);
+	free(counts);
+	free(displs);
+	freeDoubleMatrix(candidates);
+	free(cand_norms);
+	free(weights);
+}
+
+/* Function that picks the first averages of the cabinets among the
+   documents of every process, with the -init strategy, and puts every
+   document in the cabinet of its closest seed instead of cabinet
+   doc_id % num_cabs. The sums of the cabinets are then rebuilt as
+   when the documents were read                                    */
+void seedCabinets(){
+	int cab_i, doc_i, seed_i;
+	double *seeds = allocateDoubleMatrix(num_cabs, sub_stride);
+	double *norms = (double*) malloc(sizeof(double) * num_cabs);
+	double *distances = (double*) malloc(sizeof(double) * (my_docs > 0 ? my_docs : 1));
+	double seed_time = MPI_Wtime();
+	
+	for(doc_i = 0; doc_i < my_docs; doc_i++)
+		distances[doc_i] = DBL_MAX;
+	
+	if(seed_mode == SEED_RANDOM){
+		int *picked = (int*) malloc(sizeof(int) * num_cabs);
+		
+		for(cab_i = 0; cab_i < num_cabs; cab_i++){
+			picked[cab_i] = pickDocument(NULL, ROW(seeds, cab_i));
+			
+			/* Draw again documents already picked, while there are enough documents */
+			for(seed_i = 0; seed_i < cab_i && cab_i < num_docs; seed_i++){
+				if(picked[seed_i] == picked[cab_i]){
+					picked[cab_i] = pickDocument(NULL, ROW(seeds, cab_i));
+					seed_i = -1;
+				}
+			}
+			norms[cab_i] = lineNorm(ROW(seeds, cab_i));
+		}
+		free(picked);
+	}
+	else if(seed_mode == SEED_PLUSPLUS){
+		for(cab_i = 0; cab_i < num_cabs; cab_i++){
+			pickDocument((cab_i == 0) ? NULL : distances, ROW(seeds, cab_i));
+			norms[cab_i] = lineNorm(ROW(seeds, cab_i));
+			nearestSeeds(seeds, norms, cab_i, cab_i + 1, distances, doc_index);
+		}
+	}
+	else {
+		seedScalable(seeds, norms, distances);
+		for(doc_i = 0; doc_i < my_docs; doc_i++)
+			distances[doc_i] = DBL_MAX;
+	}
+	
+	/* k-means++ already knows the closest seed of every document */
+	if(seed_mode != SEED_PLUSPLUS)
+		nearestSeeds(seeds, norms, 0, num_cabs, distances, doc_index);
+	
+	memset(new_averages, 0, sizeof(double) * (num_cabs + count_lines) * sub_stride);
+	for(doc_i = 0; doc_i < my_docs; doc_i++){
+		addDocument(ROW(new_averages, doc_index[doc_i]), doc_i);
+		new_num_docs[doc_index[doc_i]]++;
+	}
+	
+	if(rank == ROOT)
+		printf("Seeding Time: %f (%s)\n", MPI_Wtime() - seed_time, seed_names[seed_mode]);
+	freeDoubleMatrix(seeds);
+	free(norms);
+	free(distances);
+}
+
+/* Function that reads the averages written with -write-averages into
+   seeds, which must hold as many cabinets and subjects. Every process
+   reads the whole file                                            */
+void readAverages(char *seeds_filename, double *seeds){
+	int file_cabs, file_subs, cab_id, cab_i, sub_i, valid;
+	FILE *averages_file = fopen(seeds_filename, "r");
+	
+	if(averages_file == NULL){
+		if(rank == ROOT)
+			perror(seeds_filename);
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+	valid = fscanf(averages_file, "%d %d", &file_cabs, &file_subs) == 2 && file_cabs == num_cabs && file_subs == num_subs;
+	for(cab_i = 0; valid && cab_i < num_cabs; cab_i++){
+		valid = fscanf(averages_file, "%d", &cab_id) == 1 && cab_id == cab_i;
+		for(sub_i = 0; valid && sub_i < num_subs; sub_i++)
+			valid = fscanf(averages_file, "%lf", ROW(seeds, cab_i) + sub_i) == 1;
+	}
+	fclose(averages_file);
+	if(!valid){
+		if(rank == ROOT)
+			fprintf(stderr, "%s: not the averages of %d cabinets and %d subjects\n", seeds_filename, num_cabs, num_subs);
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+}
+
+/* Function that reads the cabinets of a .out file into assigned for
+   the documents of this process, -1 for the ones it does not list,
+   such as the ones added since. Yields how many documents of this
+   process it lists                                                 */
+int readWarmAssignment(int *assigned){
+	int doc_id, cab_id, doc_i, listed = 0, first_doc = firstDoc(rank);
+	FILE *warm_file = fopen(warm_filename, "r");
+	
+	if(warm_file == NULL){
+		if(rank == ROOT)
+			perror(warm_filename);
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+	for(doc_i = 0; doc_i < my_docs; doc_i++)
+		assigned[doc_i] = -1;
+	while(fscanf(warm_file, "%d %d", &doc_id, &cab_id) == 2){
+		if(cab_id < 0 || cab_id >= num_cabs){
+			if(rank == ROOT)
+				fprintf(stderr, "%s: cabinet %d of document %d out of range\n", warm_filename, cab_id, doc_id);
+			MPI_Abort(MPI_COMM_WORLD, -1);
+		}
+		if(doc_id >= first_doc && doc_id < first_doc + my_docs && assigned[doc_id - first_doc] < 0){
+			assigned[doc_id - first_doc] = cab_id;
+			listed++;
+		}
+	}
+	fclose(warm_file);
+	return listed;
+}
+
+/* Function that starts from a previous run instead of cabinet
+   doc_id % num_cabs. With -warm-averages every document starts in the
+   closest of the given averages. With a .out file the documents it
+   lists keep their cabinet and the others start in the closest of the
+   averages of the listed ones, added up over every process. The sums
+   of the cabinets are then rebuilt as when the documents were read */
+void warmStart(){
+	int cab_i, doc_i, sub_i, listed = 0;
+	double *seeds = allocateDoubleMatrix(num_cabs, sub_stride);
+	double *norms = (double*) malloc(sizeof(double) * num_cabs);
+	double *distances = (double*) malloc(sizeof(double) * (my_docs > 0 ? my_docs : 1));
+	int *assigned = (int*) malloc(sizeof(int) * (my_docs > 0 ? my_docs : 1));
+	double seed_time = MPI_Wtime();
+	
+	if(warm_averages)
+		readAverages(warm_filename, seeds);
+	else {
+		int *counts = (int*) calloc(num_cabs, sizeof(int));
+		
+		listed = readWarmAssignment(assigned);
+		for(doc_i = 0; doc_i < my_docs; doc_i++){
+			if(assigned[doc_i] >= 0){
+				addDocument(ROW(seeds, assigned[doc_i]), doc_i);
+				counts[assigned[doc_i]]++;
+			}
+		}
+		MPI_Allreduce(MPI_IN_PLACE, seeds, num_cabs * sub_stride, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+		MPI_Allreduce(MPI_IN_PLACE, counts, num_cabs, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+		MPI_Allreduce(MPI_IN_PLACE, &listed, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+		
+		/* A cabinet the file leaves empty starts from a random document */
+		for(cab_i = 0; cab_i < num_cabs; cab_i++){
+			if(counts[cab_i] == 0)
+				pickDocument(NULL, ROW(seeds, cab_i));
+			else
+				for(sub_i = 0; sub_i < num_subs; sub_i++)
+					ROW(seeds, cab_i)[sub_i] /= counts[cab_i];
+		}
+		free(counts);
+	}
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++)
+		norms[cab_i] = lineNorm(ROW(seeds, cab_i));
+	for(doc_i = 0; doc_i < my_docs; doc_i++)
+		distances[doc_i] = DBL_MAX;
+	if(listed < num_docs)
+		nearestSeeds(seeds, norms, 0, num_cabs, distances, doc_index);
+	if(!warm_averages)
+		for(doc_i = 0; doc_i < my_docs; doc_i++)
+			if(assigned[doc_i] >= 0)
+				doc_index[doc_i] = assigned[doc_i];
+	
+	memset(new_averages, 0, sizeof(double) * (num_cabs + count_lines) * sub_stride);
+	for(doc_i = 0; doc_i < my_docs; doc_i++){
+		addDocument(ROW(new_averages, doc_index[doc_i]), doc_i);
+		new_num_docs[doc_index[doc_i]]++;
+	}
+	
+	if(rank == ROOT && warm_averages)
+		printf("Seeding Time: %f (warm start from %s)\n", MPI_Wtime() - seed_time, warm_filename);
+	else if(rank == ROOT)
+		printf("Seeding Time: %f (warm start, %d of %d documents from %s)\n", MPI_Wtime() - seed_time, listed, num_docs, warm_filename);
+	freeDoubleMatrix(seeds);
+	free(norms);
+	free(distances);
+	free(assigned);
+}
+
+/* Function that yields the inertia, the sum over the documents of every
+   process of the squared distance to the average of their cabinet,
+   each distance summed on its own so that no large terms cancel out */
+double totalInertia(){
+	int doc_i, sub_i;
+	double inertia = 0;
+	
+	if(sparse)
+		calculateSparseNorms();
+	for(doc_i = 0; doc_i < my_docs; doc_i++){
+		double *cabinet = ROW(averages, doc_index[doc_i]);
+		
+		if(sparse)
+			inertia += sparseDistance(doc_i, doc_index[doc_i]);
+		else {
+			for(sub_i = 0; sub_i < num_subs; sub_i++)
+				inertia += (SUBJECT(doc_i, sub_i) - cabinet[sub_i]) * (SUBJECT(doc_i, sub_i) - cabinet[sub_i]);
+		}
+	}
+	MPI_Allreduce(MPI_IN_PLACE, &inertia, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	
+	return inertia;
+}
+
+/* Function that yields the largest distance a cabinet average moved in
+   the last update                                                 */
+double maxShift(){
+	int cab_i;
+	double shift = 0;
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++)
+		shift = (cab_shift[cab_i] > shift) ? cab_shift[cab_i] : shift;
+	return sqrt(shift);
+}
+
+/* Function that checks the stopping rules once the averages of an
+   iteration are updated, moved being the documents that changed
+   cabinet and elapsed the seconds the run has taken so far. Yields
+   why the run stops, or NULL to carry on. Every process takes the
+   same decision, the shift and the time being the largest of every
+   process                                                          */
+char *stopReason(int moved, double elapsed){
+	double inertia, shift = 0;
+	
+	if(max_iterations > 0 && iterations >= max_iterations)
+		return "iteration limit";
+	if(stop_moved > 0 && moved <= stop_moved * num_docs)
+		return "moved documents";
+	
+	/* The shifts and the inertia need every block of the overlapped reduction */
+	if(overlap_blocks > 0 && (stop_shift > 0 || stop_inertia > 0))
+		waitBlocks(overlap_blocks);
+	if(stop_shift > 0 || time_limit > 0){
+		double limits[2];
+		
+		limits[0] = maxShift();
+		limits[1] = elapsed;
+		MPI_Allreduce(MPI_IN_PLACE, limits, 2, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+		shift = limits[0];
+		elapsed = limits[1];
+	}
+	if(stop_shift > 0 && shift <= stop_shift)
+		return "cabinet shift";
+	if(stop_inertia > 0){
+		inertia = totalInertia();
+		if(prev_inertia >= 0 && fabs(prev_inertia - inertia) <= stop_inertia * prev_inertia)
+			return "inertia change";
+		prev_inertia = inertia;
+	}
+	if(time_limit > 0 && elapsed >= time_limit)
+		return "time limit";
+	
+	return NULL;
+}
+
+/* Function that writes in name the input file name without its .in or
+   .bin extension, followed by suffix                              */
+void checkpointName(char *name, char *input_filename, char *suffix){
+	size_t name_len = strlen(input_filename);
+	
+	if(name_len > 4 && !strcmp(input_filename + name_len - 4, ".bin"))
+		name_len -= 4;
+	else if(name_len > 3 && !strcmp(input_filename + name_len - 3, ".in"))
+		name_len -= 3;
+	if(name_len + strlen(suffix) >= FILENAME_BUFFER){
+		fprintf(stderr, "%s: file name too long\n", input_filename);
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+	memcpy(name, input_filename, name_len);
+	strcpy(name + name_len, suffix);
+}
+
+/* Function that yields the file a resumed run reads its documents from:
+   the input itself when it is binary, else the documents saved with
+   the first checkpoint, written in saved_name                     */
+char *resumeDocuments(char *input_filename, char *saved_name){
+	binary_header header;
+	FILE *input_file = fopen(input_filename, "r");
+	int binary = (input_file != NULL) && readBinaryHeader(input_file, &header);
+	
+	if(input_file != NULL)
+		fclose(input_file);
+	if(binary)
+		return input_filename;
+	checkpointName(saved_name, input_filename, ".ckpt.bin");
+	input_file = fopen(saved_name, "r");
+	if(input_file == NULL){
+		if(rank == ROOT)
+			perror(saved_name);
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+	fclose(input_file);
+	return saved_name;
+}
+
+/* Function that reads the checkpoint of the run to resume: the averages
+   of the cabinets, put back by restoreAverages, and the cabinet of
+   every document, which mapBinaryDocuments uses as the assignment. Every process reads the whole file */
+void readCheckpoint(char *input_filename){
+	char name[FILENAME_BUFFER];
+	checkpoint_header header;
+	size_t num_values = (size_t) num_cabs * num_subs;
+	int doc_i, valid;
+	FILE *file;
+	
+	checkpointName(name, input_filename, ".ckpt");
+	file = fopen(name, "rb");
+	if(file == NULL){
+		if(rank == ROOT)
+			perror(name);
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+	
+	resumed_averages = (double*) malloc(sizeof(double) * num_values);
+	resumed_index = (int*) malloc(sizeof(int) * num_docs);
+	valid = fread(&header, sizeof(header), 1, file) == 1 && !memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC))
+		&& header.version == CHECKPOINT_VERSION && header.num_cabs == num_cabs && header.num_docs == num_docs && header.num_subs == num_subs
+		&& fread(resumed_averages, sizeof(double), num_values, file) == num_values
+		&& fread(resumed_index, sizeof(int), num_docs, file) == (size_t) num_docs;
+	fclose(file);
+	for(doc_i = 0; valid && doc_i < num_docs; doc_i++)
+		valid = resumed_index[doc_i] >= 0 && resumed_index[doc_i] < num_cabs;
+	if(!valid){
+		if(rank == ROOT)
+			fprintf(stderr, "%s: not a checkpoint of %d cabinets, %d documents and %d subjects\n", name, num_cabs, num_docs, num_subs);
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+	
+	iterations = header.iterations;
+	resumed_moved = header.moved;
+	checkpoint_iteration = iterations;
+}
+
+/* Function that writes the documents to docs_filename in the binary
+   format of docs-convert. Every process writes its own documents
+   where firstDoc puts them                                        */
+void writeDocuments(char *docs_filename){
+	int doc_i, line_i, block_i, my_blocks, num_blocks;
+	size_t value_size = single_precision ? sizeof(float) : sizeof(double);
+	double *lines = sparse ? allocateDoubleMatrix(SAVE_LINES, sub_stride) : NULL;
+	MPI_Offset offset = BINARY_HEADER + (MPI_Offset) firstDoc(rank) * sub_stride * value_size;
+	MPI_File docs_file;
+	MPI_Status status;
+	
+	if(MPI_File_open(MPI_COMM_WORLD, docs_filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &docs_file) != MPI_SUCCESS){
+		if(rank == ROOT)
+			fprintf(stderr, "%s: MPI-IO could not create the file\n", docs_filename);
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+	MPI_File_set_size(docs_file, 0);
+	
+	if(rank == ROOT){
+		binary_header header;
+		
+		initBinaryHeader(&header, single_precision ? BINARY_FLOAT32 : 0, num_cabs, num_docs, num_subs, sub_stride);
+		MPI_File_write_at(docs_file, 0, &header, sizeof(header), MPI_BYTE, &status);
+	}
+	
+	/* Collective writes take the same number of calls on every process */
+	my_blocks = (my_docs + SAVE_LINES - 1) / SAVE_LINES;
+	MPI_Allreduce(&my_blocks, &num_blocks, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+	for(block_i = 0; block_i < num_blocks; block_i++){
+		int first = block_i * SAVE_LINES;
+		int count = (my_docs <= first) ? 0 : (my_docs - first > SAVE_LINES) ? SAVE_LINES : my_docs - first;
+		void *block = NULL;
+		
+		if(count > 0 && sparse){
+			for(line_i = 0, doc_i = first; line_i < count; line_i++, doc_i++)
+				copyDocument(ROW(lines, line_i), doc_i);
+			block = lines;
+		}
+		else if(count > 0)
+			block = single_precision ? (void*) ROW(doc_floats, first) : (void*) ROW(doc_subjects, first);
+		MPI_File_write_at_all(docs_file, offset + (MPI_Offset) first * sub_stride * value_size, block, count * sub_stride, 
+			single_precision ? MPI_FLOAT : MPI_DOUBLE, &status);
+	}
+	MPI_File_close(&docs_file);
+	
+	freeDoubleMatrix(lines);
+}
+
+/* Function that saves the documents once, in the binary format of
+   docs-convert, so that a resumed run does not parse the text again */
+void saveDocuments(char *input_filename){
+	char docs_filename[FILENAME_BUFFER];
+	
+	checkpointName(docs_filename, input_filename, ".ckpt.bin");
+	writeDocuments(docs_filename);
+	saved_documents = 1;
+}
+
+/* Function that takes the exact subjects of the documents out of memory
+   once they are quantized. Every process writes its documents to one
+   file next to the input and maps all of it, like a binary input, so
+   the few lines the quantized search measures are read through the
+   page cache, which can drop the others. The file is removed once
+   every process has mapped it                                      */
+void spillDocuments(char *input_filename){
+	char docs_filename[FILENAME_BUFFER], *payload;
+	
+	checkpointName(docs_filename, input_filename, ".q8.bin");
+	writeDocuments(docs_filename);
+	if(mapBinaryFile(docs_filename) == NULL)
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	MPI_Barrier(MPI_COMM_WORLD);
+	if(rank == ROOT)
+		unlink(docs_filename);
+	
+	payload = (char*) mapped_file + BINARY_HEADER;
+	if(single_precision){
+		freeDoubleMatrix((double*) doc_floats);
+		doc_floats = (float*) payload + (size_t) firstDoc(rank) * sub_stride;
+	}
+	else {
+		freeDoubleMatrix(doc_subjects);
+		doc_subjects = (double*) payload + (size_t) firstDoc(rank) * sub_stride;
+	}
+}
+
+/* Function that writes a checkpoint: the averages of the cabinets and
+   the cabinet of every document after the iteration just done. The
+   averages are written by process 0 and the cabinets by every process
+   at the place of its documents. The file is written beside the last
+   checkpoint and renamed over it, so a run killed while writing still
+   leaves the previous one                                         */
+void writeCheckpoint(char *input_filename, int moved){
+	char name[FILENAME_BUFFER], temp_name[FILENAME_BUFFER];
+	MPI_Offset index_offset = CHECKPOINT_HEADER + (MPI_Offset) num_cabs * num_subs * sizeof(double);
+	double write_time = MPI_Wtime();
+	MPI_File file;
+	MPI_Status status;
+	
+	if(!saved_documents)
+		saveDocuments(input_filename);
+	if(overlap_blocks > 0)
+		waitBlocks(overlap_blocks);
+	
+	checkpointName(name, input_filename, ".ckpt");
+	checkpointName(temp_name, input_filename, ".ckpt.tmp");
+	if(MPI_File_open(MPI_COMM_WORLD, temp_name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS){
+		if(rank == ROOT)
+			fprintf(stderr, "%s: MPI-IO could not create the file\n", temp_name);
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+	MPI_File_set_size(file, 0);
+	
+	if(rank == ROOT){
+		checkpoint_header header;
+		double *packed = (double*) malloc(sizeof(double) * num_cabs * num_subs);
+		int cab_i;
+		
+		memset(&header, 0, sizeof(header));
+		strcpy(header.magic, CHECKPOINT_MAGIC);
+		header.version = CHECKPOINT_VERSION;
+		header.num_cabs = num_cabs;
+		header.num_docs = num_docs;
+		header.num_subs = num_subs;
+		header.iterations = iterations;
+		header.moved = moved;
+		for(cab_i = 0; cab_i < num_cabs; cab_i++)
+			memcpy(packed + (size_t) cab_i * num_subs, ROW(averages, cab_i), sizeof(double) * num_subs);
+		MPI_File_write_at(file, 0, &header, sizeof(header), MPI_BYTE, &status);
+		MPI_File_write_at(file, CHECKPOINT_HEADER, packed, num_cabs * num_subs, MPI_DOUBLE, &status);
+		free(packed);
+	}
+	MPI_File_write_at_all(file, index_offset + (MPI_Offset) firstDoc(rank) * sizeof(int), doc_index, my_docs, MPI_INT, &status);
+	MPI_File_close(&file);
+	
+	if(rank == ROOT && rename(temp_name, name) != 0){
+		perror(name);
+		MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+	
+	checkpoint_iteration = iterations;
+	checkpoint_clock = MPI_Wtime();
+	if(rank == ROOT)
+		printf("Checkpoint after %d iterations: %f\n", iterations, checkpoint_clock - write_time);
+}
+
+/* Function that tells whether a checkpoint is due after the iteration
+   just done. Every process takes the same decision, the time being
+   the longest of every process                                   */
+int checkpointDue(){
+	double elapsed;
+	
+	if(checkpoint_every > 0 && iterations - checkpoint_iteration >= checkpoint_every)
+		return 1;
+	if(checkpoint_time <= 0)
+		return 0;
+	
+	elapsed = MPI_Wtime() - checkpoint_clock;
+	MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+	return elapsed >= checkpoint_time;
+}
+
+/* Function that puts back the averages of the checkpoint resumed from,
+   over the ones rebuilt from its cabinets, so that the run carries on
+   exactly where it stopped. Yields the documents moved by the last
+   iteration before the checkpoint                                */
+int restoreAverages(){
+	int cab_i;
+	int first_cab = node_reduce ? num_cabs * node_rank / node_size : 0;
+	int last_cab = node_reduce ? num_cabs * (node_rank + 1) / node_size : num_cabs;
+	
+	if(overlap_blocks > 0)
+		waitBlocks(overlap_blocks);
+	for(cab_i = first_cab; cab_i < last_cab; cab_i++)
+		memcpy(ROW(averages, cab_i), resumed_averages + (size_t) cab_i * num_subs, sizeof(double) * num_subs);
+	if(node_reduce)
+		syncNode();
+	
+	free(resumed_averages);
+	free(resumed_index);
+	resumed_averages = NULL;
+	resumed_index = NULL;
+	return resumed_moved;
+}
+
+/* Function that writes the decimal digits of a non negative value ending
+   right before end, two at a time, and yields where they start      */
+char *formatInt(char *end, int value){
+	while(value >= 100){
+		end -= 2;
+		memcpy(end, digit_pairs + 2 * (value % 100), 2);
+		value /= 100;
+	}
+	if(value >= 10){
+		end -= 2;
+		memcpy(end, digit_pairs + 2 * value, 2);
+	}
+	else
+		*--end = '0' + value;
+	return end;
+}
+
+/* Function that writes the output line of a document at text, with the
+   digits worked out by hand instead of fprintf. Yields its length   */
+int formatLine(char *text, int doc_id, int cab_id){
+	char digits[LINE_CHARS], *end = digits + LINE_CHARS, *start;
+	
+	*--end = '\n';
+	start = formatInt(end, cab_id);
+	*--start = ' ';
+	start = formatInt(start, doc_id);
+	memcpy(text, start, digits + LINE_CHARS - start);
+	return digits + LINE_CHARS - start;
+}
+
+/* Function that formats the output lines of count documents, the first
+   one being first_doc, and yields the length of the text            */
+size_t formatLines(char *text, int first_doc, int *cabs, int count){
+	char *cursor = text;
+	int doc_i;
+	
+	for(doc_i = 0; doc_i < count; doc_i++)
+		cursor += formatLine(cursor, first_doc + doc_i, cabs[doc_i]);
+	return cursor - text;
+}
+
+/* Function that writes the cabinet of each document to a file. Every
+   process formats its own documents and writes them with collective
+   MPI-IO at the offset that follows the processes before it         */
+void writeToFile(char *input_filename){
+	size_t name_len;
+	int proc_i, block_i, my_blocks, num_blocks, last = (rank == ROOT) ? num_procs : rank;
+	long length, offset = 0, *proc_lengths = (long*) malloc(sizeof(long) * num_procs);
+	char output_filename[FILENAME_BUFFER], *text;
+	MPI_File output_file;
+	MPI_Status status;
+	
+	/* Binary files end in .bin instead of .in */
+	name_len = strlen(input_filename);
+	name_len -= (name_len > 4 && !strcmp(input_filename + name_len - 4, ".bin")) ? 4 : 3;
+	memcpy(output_filename, input_filename, name_len);
+	output_filename[name_len] = '\0';
+	strcat(output_filename, binary_output ? ".bout" : ".out");
+
+	if(binary_output){
+		text = (char*) doc_index;
+		length = sizeof(int) * my_docs;
+	}
+	else {
+		text = (char*) malloc((size_t) my_docs * LINE_CHARS + 1);
+		length = formatLines(text, firstDoc(rank), doc_index, my_docs);
+	}
+	
+	MPI_Allgather(&length, 1, MPI_LONG, proc_lengths, 1, MPI_LONG, MPI_COMM_WORLD);
+	for(proc_i = 1; proc_i < last; proc_i++)
+		offset += proc_lengths[proc_i];
+	
+	MPI_File_open(MPI_COMM_WORLD, output_filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &output_file);
+	MPI_File_set_size(output_file, 0);
+	
+	/* Collective writes take the same number of calls on every process */
+	my_blocks = (length + IO_BLOCK - 1) / IO_BLOCK;
+	MPI_Allreduce(&my_blocks, &num_blocks, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+	for(block_i = 0; block_i < num_blocks; block_i++){
+		long block_start = (long) block_i * IO_BLOCK;
+		int block = (length <= block_start) ? 0 : (length - block_start > IO_BLOCK) ? IO_BLOCK : (int) (length - block_start);
+		
+		MPI_File_write_at_all(output_file, (MPI_Offset) (offset + block_start), text + (block > 0 ? block_start : 0), block, MPI_CHAR, &status);
+	}
+	MPI_File_close(&output_file);
+
+	if(!binary_output)
+		free(text);
+	free(proc_lengths);
+}
+
+/* Function that writes the averages of the cabinets for -warm-averages:
+   the number of cabinets and subjects, then one line per cabinet.
+   Every process holds them, process 0 writes them                 */
+void writeAverages(){
+	int cab_i, sub_i;
+	FILE *averages_file;
+	
+	if(overlap_blocks > 0)
+		waitBlocks(overlap_blocks);
+	if(rank != ROOT)
+		return;
+	
+	averages_file = fopen(averages_filename, "w");
+	if(averages_file == NULL){
+		perror(averages_filename);
+		return;
+	}
+	fprintf(averages_file, "%d %d\n", num_cabs, num_subs);
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		fprintf(averages_file, "%d", cab_i);
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			fprintf(averages_file, " %.17g", ROW(averages, cab_i)[sub_i]);
+		fprintf(averages_file, "\n");
+	}
+	if(fclose(averages_file) != 0)
+		perror(averages_filename);
+}
+
+/* Function that compares the cabinets found with the ones of a .out
+   file, such as the result of a double precision run, and prints how
+   many documents ended up in another cabinet                       */
+void validateAssignment(){
+	int doc_id, cab_id, first_doc = firstDoc(rank), counts[2] = {0, 0};
+	FILE *validate_file = fopen(validate_filename, "r");
+	
+	if(validate_file != NULL){
+		while(fscanf(validate_file, "%d %d", &doc_id, &cab_id) == 2){
+			if(doc_id >= first_doc && doc_id < first_doc + my_docs){
+				counts[0]++;
+				counts[1] += (doc_index[doc_id - first_doc] != cab_id);
+			}
+		}
+		fclose(validate_file);
+	}
+	else if(rank == ROOT)
+		perror(validate_filename);
+	
+	MPI_Reduce(rank == ROOT ? MPI_IN_PLACE : counts, counts, 2, MPI_INT, MPI_SUM, ROOT, MPI_COMM_WORLD);
+	if(rank == ROOT)
+		printf("Validation: %d of %d documents in another cabinet than in %s\n", counts[1], counts[0], validate_filename);
+}
+
+/* Function that frees the allocated structures along the execution of the program */
+void cleanup(){
+	if(mapped_file != NULL)
+		munmap(mapped_file, mapped_size);
+	else {
+		freeDoubleMatrix(doc_subjects);
+		freeDoubleMatrix((double*) doc_floats);
+	}
+	freeDoubleMatrix((double*) float_averages);
+		
+	if(node_reduce){
+		MPI_Win_unlock_all(node_win);
+		MPI_Win_free(&node_win);
+		free(node_sums);
+		MPI_Comm_free(&node_comm);
+		if(leader_comm != MPI_COMM_NULL)
+			MPI_Comm_free(&leader_comm);
+	}
+	else {
+		freeDoubleMatrix(averages);
+		freeDoubleMatrix(new_averages);
+		free(cab_docs);
+	}
+	free(doc_index);
+	free(closest_cabs);
+	free(doc_norms);
+	free(cab_norms);
+	freeDoubleMatrix(cab_packed);
+	freeDoubleMatrix(prev_averages);
+	free(upper_bounds);
+	free(lower_bounds);
+	free(cab_drift);
+	free(cab_half_gap);
+	free(cab_group);
+	free(group_cabs);
+	free(group_start);
+	free(group_bounds);
+	free(group_drift);
+	freeDoubleMatrix((double*) doc_codes);
+	freeDoubleMatrix(cab_offsets);
+	freeDoubleMatrix(quant_min);
+	freeDoubleMatrix(quant_scale);
+	free(doc_errors);
+	free(cab_shift);
+	free(period_times);
+	free(sparse_starts);
+	free(sparse_subs);
+	free(sparse_values);
+	free(approx_distances);
+	free(block_requests);
+	free(block_ready);
+	free(block_waits);
+	free(block_times);
+	free(block_min);
+	free(current_distances);
+}
+
+/* Function that prints how to call the program and exits */
+void usage(char *program){
+	if(rank == ROOT){
+		printf("Usage: %s <input file> [number of cabinets] [options]\n", program);
+		printf("  -a naive|gemm|hamerly|yinyang  algorithm used to find the closest cabinets\n");
+		printf("  -g <groups>       cabinet groups of the yinyang algorithm (default cabinets/10)\n");
+		printf("  -b                write the cabinets as binary ints to <input>.bout\n");
+		printf("  -f32              store and compare the documents as floats (not with gemm)\n");
+		printf("  -validate <file>  count the documents in another cabinet than in a .out file\n");
+		printf("  -q8               search through 8 bit codes of the subjects (naive only)\n");
+		printf("  -sparse           keep only the nonzero subjects, read as sub:value pairs\n");
+		printf("  -m <documents>    mini-batch mode, sampling this many documents per iteration\n");
+		printf("  -mi <iterations>  mini-batch iterations (default %d)\n", MINI_ITERATIONS);
+		printf("  -lr <rate>        move the cabinets by rate/(1+iteration) in the mini-batch\n");
+		printf("  -mf               carry on with the full algorithm after the mini-batch\n");
+		printf("  -max-iter <n>     stop after this many iterations\n");
+		printf("  -stop-moved <f>   stop once at most this fraction of the documents moves\n");
+		printf("  -stop-shift <d>   stop once no cabinet average moves farther than this\n");
+		printf("  -stop-inertia <r> stop once the inertia changes by at most this fraction\n");
+		printf("  -time <seconds>   stop once the run has taken this long\n");
+		printf("  -init <strategy>  modulo (default), random, kmeans++ or kmeans|| first cabinets\n");
+		printf("  -seed <n>         seed of the random numbers, not 0\n");
+		printf("  -checkpoint <n>   write a checkpoint every n iterations\n");
+		printf("  -checkpoint-time <seconds>  write a checkpoint every few seconds\n");
+		printf("  -resume           carry on from the last checkpoint of the input file\n");
+		printf("  -warm <file>      start from the cabinets of a .out file\n");
+		printf("  -warm-averages <file>  start from the averages of -write-averages\n");
+		printf("  -write-averages <file>  write the averages of the cabinets at the end\n");
+		printf("  -parse-only       stop once the documents are read, to time the reader\n");
+		printf("  -o <blocks>       reduce the averages in blocks that overlap the naive distances\n");
+		printf("  -v                print the timeline of every iteration\n");
+		printf("  -n                add up the changes of each node in shared memory first\n");
+		printf("  -r <iterations>   move documents from slow to fast processes every few iterations\n");
+		printf("  -w                split the documents by their nonzero subjects\n");
+	}
+	MPI_Finalize();
+	exit(-1);
+}
+
+/* Function that reads the optional arguments that follow the input file:
+   the number of cabinets and the flags that tune the algorithm      */
+void parseOptions(int argc, char *argv[]){
+	int arg_i;
+	
+	if(argc < 2)
+		usage(argv[0]);
+	
+	for(arg_i = 2; arg_i < argc; arg_i++){
+		if(strcmp(argv[arg_i], "-a") == 0 && arg_i + 1 < argc){
+			arg_i++;
+			if(strcmp(argv[arg_i], "naive") == 0)
+				assign_mode = ASSIGN_NAIVE;
+			else if(strcmp(argv[arg_i], "gemm") == 0)
+				assign_mode = ASSIGN_GEMM;
+			else if(strcmp(argv[arg_i], "hamerly") == 0)
+				assign_mode = ASSIGN_HAMERLY;
+			else if(strcmp(argv[arg_i], "yinyang") == 0)
+				assign_mode = ASSIGN_YINYANG;
+			else
+				usage(argv[0]);
+		}
+		else if(strcmp(argv[arg_i], "-g") == 0 && arg_i + 1 < argc)
+			num_groups = atoi(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-b") == 0)
+			binary_output = 1;
+		else if(strcmp(argv[arg_i], "-f32") == 0)
+			single_precision = 1;
+		else if(strcmp(argv[arg_i], "-q8") == 0)
+			quantized = 1;
+		else if(strcmp(argv[arg_i], "-sparse") == 0)
+			sparse = 1;
+		else if(strcmp(argv[arg_i], "-m") == 0 && arg_i + 1 < argc)
+			batch_size = atoi(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-mi") == 0 && arg_i + 1 < argc)
+			mini_iterations = atoi(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-lr") == 0 && arg_i + 1 < argc)
+			learning_rate = atof(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-mf") == 0)
+			mini_refine = 1;
+		else if(strcmp(argv[arg_i], "-max-iter") == 0 && arg_i + 1 < argc)
+			max_iterations = atoi(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-stop-moved") == 0 && arg_i + 1 < argc)
+			stop_moved = atof(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-stop-shift") == 0 && arg_i + 1 < argc)
+			stop_shift = atof(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-stop-inertia") == 0 && arg_i + 1 < argc)
+			stop_inertia = atof(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-time") == 0 && arg_i + 1 < argc)
+			time_limit = atof(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-init") == 0 && arg_i + 1 < argc){
+			arg_i++;
+			for(seed_mode = SEED_SCALABLE; seed_mode > SEED_MODULO; seed_mode--)
+				if(strcmp(argv[arg_i], seed_names[seed_mode]) == 0)
+					break;
+			if(strcmp(argv[arg_i], seed_names[seed_mode]) != 0)
+				usage(argv[0]);
+		}
+		else if(strcmp(argv[arg_i], "-checkpoint") == 0 && arg_i + 1 < argc)
+			checkpoint_every = atoi(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-checkpoint-time") == 0 && arg_i + 1 < argc)
+			checkpoint_time = atof(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-resume") == 0)
+			resume = 1;
+		else if(strcmp(argv[arg_i], "-seed") == 0 && arg_i + 1 < argc){
+			random_state = strtoul(argv[++arg_i], NULL, 10) & 0xffffffffUL;
+			if(random_state == 0)
+				usage(argv[0]);
+		}
+		else if(strcmp(argv[arg_i], "-validate") == 0 && arg_i + 1 < argc)
+			validate_filename = argv[++arg_i];
+		else if(strcmp(argv[arg_i], "-warm") == 0 && arg_i + 1 < argc){
+			warm_filename = argv[++arg_i];
+			warm_averages = 0;
+		}
+		else if(strcmp(argv[arg_i], "-warm-averages") == 0 && arg_i + 1 < argc){
+			warm_filename = argv[++arg_i];
+			warm_averages = 1;
+		}
+		else if(strcmp(argv[arg_i], "-write-averages") == 0 && arg_i + 1 < argc)
+			averages_filename = argv[++arg_i];
+		else if(strcmp(argv[arg_i], "-parse-only") == 0)
+			parse_only = 1;
+		else if(strcmp(argv[arg_i], "-o") == 0 && arg_i + 1 < argc)
+			overlap_blocks = atoi(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-v") == 0)
+			verbose = 1;
+		else if(strcmp(argv[arg_i], "-n") == 0)
+			node_reduce = 1;
+		else if(strcmp(argv[arg_i], "-r") == 0 && arg_i + 1 < argc)
+			rebalance_every = atoi(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-w") == 0)
+			nonzero_split = 1;
+		else if(argv[arg_i][0] != '-')
+			num_cabs = atoi(argv[arg_i]);
+		else
+			usage(argv[0]);
+	}
+	
+	/* The blocked mode works on doubles, and float distances need wider bounds */
+	if(single_precision && assign_mode == ASSIGN_GEMM)
+		usage(argv[0]);
+	if(quantized && assign_mode != ASSIGN_NAIVE)
+		usage(argv[0]);
+	if(single_precision)
+		bound_slack = FLOAT_SLACK;
+	
+	/* Sparse documents are kept in double precision with distances of their own */
+	if(sparse && (single_precision || quantized || assign_mode == ASSIGN_GEMM))
+		usage(argv[0]);
+	if(sparse)
+		bound_slack = SPARSE_SLACK;
+	
+	/* The node reduction waits for every cabinet, so it cannot overlap */
+	if(node_reduce)
+		overlap_blocks = 0;
+}
+
+int main(int argc, char *argv[]){
+	int temp_cabs, moved_flag;
+	char *stop_reason = NULL;
+	FILE *input_file;
+	char *input_filename, *docs_filename, saved_name[FILENAME_BUFFER];
+	
+	MPI_Init (&argc, &argv);
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+	MPI_Comm_size (MPI_COMM_WORLD, &num_procs);
+	
+	parseOptions(argc, argv);
+	input_filename = (char*) malloc(sizeof(char)*(strlen(argv[1])+2));
+	
+	initializeTime = MPI_Wtime();
+	selectDistanceKernel();
+
+	strcpy(input_filename, argv[1]); 
+	docs_filename = resume ? resumeDocuments(input_filename, saved_name) : input_filename;
+	if(rank == ROOT){
+		binary_header header;
+		
+		input_file = fopen(docs_filename, "r");
+		
+		if(input_file == NULL){
+			printf("ERROR reading file!");
+			perror(docs_filename);
+			MPI_Finalize();
+			return -1;
+		}
+		
+		binary_input = readBinaryHeader(input_file, &header);
+		if(binary_input){
+			temp_cabs = header.num_cabs;
+			num_docs = header.num_docs;
+			num_subs = header.num_subs;
+			fclose(input_file);
+		}
+		else {
+			fscanf(input_file, "%d %d %d\n", &temp_cabs, &num_docs, &num_subs);
+			header_bytes = ftell(input_file);
+			fclose(input_file);
+		}
+		num_cabs = (num_cabs != 0) ? num_cabs : temp_cabs;
+			
+		shareInitializationValues();
+	}
+	else 
+		receiveInitializationValues();
+		
+	proc_docs = (int*) malloc(sizeof(int) * num_procs);
+	saved_documents = binary_input;
+	if(binary_input){
+		int proc_i;
+		
+		for(proc_i = 0; proc_i < num_procs; proc_i++)
+			proc_docs[proc_i] = num_docs/num_procs + HAS_EXTRA(proc_i, num_procs, num_docs);
+		my_docs = proc_docs[rank];
+		initializeStructures();
+		if(resume)
+			readCheckpoint(input_filename);
+		mapBinaryDocuments(docs_filename);
+	}
+	else {
+		char *doc_chunk = readFileSlice(docs_filename);
+		
+		initializeStructures();
+		readAndStore(doc_chunk, docs_filename);
+	}
+	if(parse_only){
+		MPI_Finalize();
+		return 0;
+	}
+	if(nonzero_split)
+		splitByNonzeros();
+	if(quantized){
+		quantizeDocuments();
+		/* Only the codes stay in memory, the exact subjects are read from a file */
+		if(mapped_file == NULL)
+			spillDocuments(input_filename);
+	}
+	if(assign_mode == ASSIGN_GEMM)
+		calculateDocumentNorms();
+ 	printf("Initialization ended after :%f\n", MPI_Wtime() - initializeTime);
+	
+	if(warm_filename != NULL && !resume)
+		warmStart();
+	else if(seed_mode != SEED_MODULO && !resume)
+		seedCabinets();
+	moved_flag = updateAverages(1);
+	if(resume)
+		moved_flag = restoreAverages();
+	else if(batch_size > 0){
+		miniBatch();
+		moved_flag = finishMiniBatch();
+	}
+	checkpoint_clock = MPI_Wtime();
+	while(moved_flag){
+		double work_start = MPI_Wtime();
+		
+		findClosestCabinets();
+		moved_flag = changeDocuments();
+		work_time += MPI_Wtime() - work_start;
+		
+		moved_flag = updateAverages(moved_flag);
+		iterations++;
+		if(moved_flag && (stop_reason = stopReason(moved_flag, MPI_Wtime() - initializeTime)) != NULL)
+			break;
+		if(moved_flag && rebalance_every > 0 && assign_passes % rebalance_every == 0)
+			rebalanceDocuments();
+		if(moved_flag && checkpointDue())
+			writeCheckpoint(input_filename, moved_flag);
+	}
+		
+	if(stop_reason == NULL)
+		stop_reason = (batch_size > 0 && !mini_refine) ? "end of the mini-batch" : "no document moved";
+	if(rank == ROOT)
+		printf("Stopped after %d iterations: %s\n", iterations, stop_reason);
+	if(quantized){
+		double docs_passes = (double) num_docs * assign_passes;
+		
+		MPI_Reduce(rank == ROOT ? MPI_IN_PLACE : &exact_distances, &exact_distances, 1, MPI_DOUBLE, MPI_SUM, ROOT, MPI_COMM_WORLD);
+		if(rank == ROOT)
+			printf("Exact distances per document: %.2f of %d\n", exact_distances / docs_passes, num_cabs);
+	}
+	if(validate_filename != NULL)
+		validateAssignment();
+	if(averages_filename != NULL)
+		writeAverages();
+	writeToFile(input_filename);
 
 	printf("Program ended after :%f\n", MPI_Wtime() - initializeTime);
 
 	cleanup();	
-	if(rank == ROOT)
-		free(input_filename);
+	free(input_filename);
+	free(proc_docs);
 		
 	MPI_Finalize();
 	return 0;
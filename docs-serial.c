@@ -1,11 +1,65 @@
+#define _POSIX_C_SOURCE 200112L		/* mmap and friends under -ansi */
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <float.h>
+#include <math.h>
 #include <time.h>
 #include <omp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "docs-common.h"
 
 #define BUFFER_SIZE 20000
 #define FILENAME_BUFFER 500
+#define LINE_CHARS 24			/* Longest output line: two ints, a space and a newline */
+
+#define ASSIGN_NAIVE 0			/* Exact distances to every cabinet */
+#define ASSIGN_GEMM 1			/* Blocked ||x||^2 - 2x.c + ||c||^2 expansion */
+#define ASSIGN_HAMERLY 2		/* Exact distances pruned with Hamerly's bounds */
+#define ASSIGN_YINYANG 3		/* Exact distances pruned with Yinyang's group bounds */
+#define DOC_TILE 64			/* Documents per tile in the blocked mode */
+#define TILE_BYTES 262144		/* Bytes of averages per cabinet block in the blocked mode */
+#define TIE_TOLERANCE 1e-9		/* Relative gap under which the blocked mode uses exact distances */
+#define GROUP_ROUNDS 5			/* K-means rounds used to group the cabinets in the Yinyang mode */
+#define BOUND_SLACK 1e-12		/* Relative margin that keeps the pruning bounds safe from rounding */
+#define FLOAT_SLACK 1e-5		/* Same margin for distances calculated in single precision */
+#define CODE_LEVELS 255			/* Largest 8 bit code of a subject */
+#define SPARSE_SLACK 1e-9		/* Margin of the bounds for sparse distances, expanded around ||c||^2 */
+#define MINI_ITERATIONS 100		/* Mini-batch iterations when -mi is not given */
+#define RANDOM_SEED 2463534242UL	/* Seed of the random numbers when -seed is not given */
+#define SEED_MODULO 0			/* Document doc_id starts in cabinet doc_id % num_cabs */
+#define SEED_RANDOM 1			/* Cabinets start from documents drawn uniformly */
+#define SEED_PLUSPLUS 2			/* Cabinets start from documents drawn with k-means++ */
+#define SEED_SCALABLE 3			/* Cabinets start from documents drawn with k-means|| */
+#define SEED_ROUNDS 5			/* Oversampling rounds of k-means|| */
+#define SEED_OVERSAMPLE 2		/* Candidates drawn per round of k-means||, in cabinets */
+
+#define CHECKPOINT_MAGIC "CABCKPT"	/* Start of the checkpoint files */
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_HEADER 64		/* Bytes before the averages of a checkpoint */
+
+/* Macro that yields the 8 bit codes of a line of a quantized matrix */
+#define CODE_ROW(codes, line_i) ((codes) + (size_t)(line_i) * code_stride)
+
+/* Macro that yields a subject of a document as a double, whichever
+   precision the documents are stored in                           */
+#define SUBJECT(doc_i, sub_i) (single_precision ? (double) ROW(doc_floats, doc_i)[sub_i] : ROW(doc_subjects, doc_i)[sub_i])
+
+typedef struct checkpoint_header{
+	char magic[8];
+	int version;
+	int num_cabs;
+	int num_docs;
+	int num_subs;
+	int iterations;			/* Iterations done when the checkpoint was written */
+	int moved;			/* Documents moved by the last of them */
+	char reserved[CHECKPOINT_HEADER - 32];
+} checkpoint_header;
 
 typedef struct cabinet{
 	int prev_num_docs;
@@ -14,12 +68,67 @@ typedef struct cabinet{
 	double *new_averages;
 } cabinet;
 
-int num_subs, num_cabs, num_docs;
-double **distance;
-double **doc_subjects;			/* Matrix that maps the subjects to their documents */
+int num_cabs, num_docs;
+double *doc_subjects;			/* Matrix that maps the subjects to their documents */
+double *cab_averages, *cab_new_averages;	/* Blocks holding the averages of every cabinet */
 cabinet *cabinets;		
 int *doc_index;				/* Structure that keeps track of all documents */
 int *modified;
+int single_precision = 0;		/* Documents stored and compared as floats */
+float *doc_floats, *float_averages;	/* Documents and averages of the single precision mode */
+double bound_slack = BOUND_SLACK;
+char *validate_filename = NULL;		/* Assignment the result is compared with */
+char *warm_filename = NULL;		/* Previous run the cabinets start from, set with -warm */
+int warm_averages = 0;			/* warm_filename holds averages instead of a .out file */
+char *averages_filename = NULL;		/* Where the final averages are written, set with -write-averages */
+int parse_only = 0;			/* Stop once the documents are read, set with -parse-only */
+int serve = 0;				/* Answer requests on the standard input after the run, set with -serve */
+int doc_capacity;			/* Documents the server has room for */
+char *classify_filename = NULL;		/* Averages the documents are classified into, set with -classify */
+int classify_benchmark = 0;		/* Time the classification of batches of documents, set with -bench */
+int quantized = 0;			/* Documents searched through 8 bit codes */
+unsigned char *doc_codes;		/* Code of every subject of every document, in lines of code_stride */
+double *quant_min, *quant_scale;	/* Subject of code 0 and step between two codes, for every subject */
+double *doc_errors;			/* Distance between each document and the subjects of its codes */
+double *cab_offsets;			/* Averages of the cabinets minus quant_min */
+double *approx_distances;		/* Distances between the codes of a document and of every cabinet */
+double exact_distances = 0;		/* Exact distances measured by the quantized search */
+int sparse = 0;				/* Documents stored as their nonzero subjects only */
+int *sparse_starts;			/* First nonzero of each document, and the end of the last one (CSR) */
+int *sparse_subs, sparse_count = 0, sparse_capacity = 0;	/* Subject of every nonzero */
+double *sparse_values;			/* Value of every nonzero */
+int batch_size = 0, mini_iterations = MINI_ITERATIONS;	/* Documents sampled per mini-batch iteration, 0 runs the full algorithm */
+double learning_rate = 0;		/* Rate of the mini-batch updates, 0 follows the sampled counts */
+int mini_refine = 0;			/* Carry on with the full algorithm after the mini-batch */
+unsigned long random_state = RANDOM_SEED;	/* State of randomBelow and randomUnit */
+int seed_mode = SEED_MODULO;		/* How the cabinets start, set with -init */
+char *seed_names[] = {"modulo", "random", "kmeans++", "kmeans||"};
+int checkpoint_every = 0;		/* Iterations between two checkpoints, 0 for none */
+double checkpoint_time = 0;		/* Seconds between two checkpoints, 0 for none */
+int checkpoint_iteration = 0;		/* Iterations done at the last checkpoint */
+double checkpoint_clock;		/* When the last checkpoint was written */
+int saved_documents = 0;		/* The documents can be read again without parsing the text */
+int resume = 0;				/* Start from the last checkpoint instead of the input */
+double *resumed_averages = NULL;	/* Averages of the checkpoint resumed from */
+int *resumed_index = NULL;		/* Cabinet of every document in that checkpoint */
+int resumed_moved;			/* Documents moved by its last iteration */
+int max_iterations = 0, iterations = 0;	/* Iteration limit, 0 for none, and iterations done */
+double stop_moved = 0, stop_shift = 0, stop_inertia = 0, time_limit = 0;	/* Stopping rules, 0 when unused */
+double *cab_shift;			/* Squared distance each cabinet average moved in its last update */
+double prev_inertia = -1;		/* Inertia of the last iteration, -1 before the first */
+int binary_output = 0;			/* Cabinets written as ints instead of text */
+int assign_mode = ASSIGN_NAIVE, cab_tile, assign_passes = 0;
+int *closest_cabs;			/* Closest cabinet of each document in the current iteration */
+double *doc_norms, *cab_norms, max_cab_norm;
+double *cab_packed;			/* Cabinet averages packed for the blocked mode */
+double *upper_bounds, *lower_bounds;	/* Distance bounds of each document in the pruned mode */
+double *prev_averages, *cab_drift, *cab_half_gap, max_drift, second_drift;
+int max_drift_cab;
+int num_groups, *cab_group, *group_cabs, *group_start;	/* Cabinet groups of the Yinyang mode */
+double *group_bounds, *group_drift;
+char digit_pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";	/* Two digit numbers for formatInt */
 
 /* Function that allocates and initializes the cabinets */
 void create_cabinets(){
@@ -27,52 +136,250 @@ void create_cabinets(){
 
 	cabinets = (cabinet*) malloc(sizeof(cabinet) * num_cabs);
 	modified = (int*) calloc(num_cabs, sizeof(int));
+	cab_shift = (double*) calloc(num_cabs, sizeof(double));
+	
+	cab_averages = allocateDoubleMatrix(num_cabs, sub_stride);
+	cab_new_averages = allocateDoubleMatrix(num_cabs, sub_stride);
 	
 	for(cab_i = 0; cab_i < num_cabs; cab_i++){
 		cabinets[cab_i].num_docs = 0;
 		cabinets[cab_i].prev_num_docs = 0;
-		cabinets[cab_i].averages = (double*) calloc(num_subs, sizeof(double));
-		cabinets[cab_i].new_averages = (double*) calloc(num_subs, sizeof(double));	
+		cabinets[cab_i].averages = ROW(cab_averages, cab_i);
+		cabinets[cab_i].new_averages = ROW(cab_new_averages, cab_i);
 		modified[cab_i] = 1;
 	}
 }
 
-/* Function that reads information from the file and stores it in its 
-   proper structures.                                                 */
-void readAndStore(FILE *input_file){
-	int doc_i;
+/* Function that adds a nonzero subject to the sparse arrays of the
+   documents, growing them as needed                              */
+void appendNonzero(int sub_i, double value){
+	if(sparse_count == sparse_capacity){
+		sparse_capacity = 2 * sparse_capacity + 1024;
+		sparse_subs = (int*) realloc(sparse_subs, sizeof(int) * sparse_capacity);
+		sparse_values = (double*) realloc(sparse_values, sizeof(double) * sparse_capacity);
+	}
+	sparse_subs[sparse_count] = sub_i;
+	sparse_values[sparse_count++] = value;
+}
 
-	for(doc_i = 0; doc_i < num_docs; doc_i++){
-		int sub_i, doc_id, cab_id;
-		char *token, parameters[BUFFER_SIZE];
+/* Function that keeps the nonzero subjects of count documents of a
+   binary file, from first_doc on, in the sparse arrays          */
+void storeSparseLines(binary_header *header, int first_doc, int count){
+	char *payload = (char*) mapped_file + BINARY_HEADER;
+	int doc_i, sub_i;
+	
+	for(doc_i = 0; doc_i < count; doc_i++){
+		size_t offset = (size_t) (first_doc + doc_i) * header->stride;
 		
-		fgets(parameters, sizeof(parameters), input_file);
-		token = strtok(parameters, " ");
-		doc_id = atoi(token);
-		cab_id = doc_id%num_cabs;
-		doc_index[doc_id] = cab_id;
+		sparse_starts[doc_i] = sparse_count;
+		for(sub_i = 0; sub_i < num_subs; sub_i++){
+			double value = (header->flags & BINARY_FLOAT32) ? ((float*) payload)[offset + sub_i] : ((double*) payload)[offset + sub_i];
+			
+			if(value != 0)
+				appendNonzero(sub_i, value);
+		}
+	}
+	sparse_starts[count] = sparse_count;
+}
+
+/* Function that stores the documents of a binary file. Double subjects
+   padded like doc_subjects are used straight from the mapping, other
+   layouts are copied and the file is unmapped                       */
+void mapBinaryDocuments(char *input_filename){
+	binary_header *header = mapBinaryFile(input_filename);
+	char *payload = (char*) mapped_file + BINARY_HEADER;
+	size_t value_size;
+	int doc_i, *assignment = NULL;
+	
+	if(header == NULL)
+		exit(-1);
+	value_size = (header->flags & BINARY_FLOAT32) ? sizeof(float) : sizeof(double);
+	if(resumed_index != NULL)
+		assignment = resumed_index;
+	else if((header->flags & BINARY_ASSIGNED) && header->num_cabs == num_cabs)
+		assignment = (int*) (payload + (size_t) num_docs * header->stride * value_size);
+	
+	for(doc_i = 0; doc_i < num_docs; doc_i++){
+		int cab_id = (assignment != NULL) ? assignment[doc_i] : doc_i%num_cabs;
+		doc_index[doc_i] = cab_id;
+		cabinets[cab_id].num_docs++;
+	}
+	
+	if(sparse){
+		storeSparseLines(header, 0, num_docs);
+		munmap(mapped_file, mapped_size);
+		mapped_file = NULL;
+		return;
+	}
+	
+	/* Lines already in the precision and padding of the documents are used in place */
+	if(header->stride == sub_stride && (header->flags & BINARY_FLOAT32) == (single_precision ? BINARY_FLOAT32 : 0)){
+		if(single_precision)
+			doc_floats = (float*) payload;
+		else
+			doc_subjects = (double*) payload;
+		return;
+	}
+	
+	if(single_precision)
+		doc_floats = allocateFloatMatrix(num_docs);
+	else
+		doc_subjects = allocateDoubleMatrix(num_docs, sub_stride);
+	for(doc_i = 0; doc_i < num_docs; doc_i++){
+		int sub_i;
+		size_t offset = (size_t) doc_i * header->stride;
 		
 		for(sub_i = 0; sub_i < num_subs; sub_i++){
-			token = strtok(NULL, " ");
-			doc_subjects[doc_id][sub_i] = atof(token);
+			double value = (header->flags & BINARY_FLOAT32) ? ((float*) payload)[offset + sub_i] : ((double*) payload)[offset + sub_i];
+			
+			if(single_precision)
+				ROW(doc_floats, doc_i)[sub_i] = (float) value;
+			else
+				ROW(doc_subjects, doc_i)[sub_i] = value;
+		}
+	}
+	
+	munmap(mapped_file, mapped_size);
+	mapped_file = NULL;
+}
+
+/* Function that parses the nonzero subjects of a document line into the
+   sparse arrays and yields the start of the next line. Subjects are
+   written as sub:value pairs, numbered from 0 in increasing order; a
+   value without a subject is the one after the previous subject, so
+   dense lines are read as well                                    */
+char *parseSparseSubjects(char *text){
+	int sub_i = 0;
+	
+	for(;;){
+		char *start;
+		double value;
+		
+		while(*text == ' ' || *text == '\t')
+			text++;
+		if(*text == '\r' || *text == '\n' || *text == '\0')
+			break;
+		
+		start = text;
+		value = parseDouble(&text);
+		if(*text == ':'){
+			sub_i = (int) value;
+			text++;
+			value = parseDouble(&text);
 		}
+		if(text == start)
+			break;
 		
-		cabinets[cab_id].num_docs++;
+		if(value != 0 && sub_i >= 0 && sub_i < num_subs)
+			appendNonzero(sub_i, value);
+		sub_i++;
+	}
+	return nextLine(text);
+}
+
+/* Function that lays out the nonzero subjects in the order of the
+   document ids (CSR) once the lines, which may come in any order, are
+   parsed. row_first and row_count hold where the nonzeros of each
+   document were parsed; missing documents have none              */
+void orderSparseDocuments(int *row_first, int *row_count){
+	int doc_i, nz_count = 0, *subs;
+	double *values;
+	
+	for(doc_i = 0; doc_i < num_docs; doc_i++){
+		sparse_starts[doc_i] = nz_count;
+		nz_count += row_count[doc_i];
+	}
+	sparse_starts[num_docs] = nz_count;
+	
+	subs = (int*) malloc(sizeof(int) * (nz_count > 0 ? nz_count : 1));
+	values = (double*) malloc(sizeof(double) * (nz_count > 0 ? nz_count : 1));
+	for(doc_i = 0; doc_i < num_docs; doc_i++){
+		if(row_count[doc_i] > 0){
+			memcpy(subs + sparse_starts[doc_i], sparse_subs + row_first[doc_i], sizeof(int) * row_count[doc_i]);
+			memcpy(values + sparse_starts[doc_i], sparse_values + row_first[doc_i], sizeof(double) * row_count[doc_i]);
+		}
 	}
+	
+	free(sparse_subs);
+	free(sparse_values);
+	sparse_subs = subs;
+	sparse_values = values;
+	sparse_count = sparse_capacity = nz_count;
+}
+
+/* Function that reads the documents of the input file block by block
+   and parses them into their proper structures, so only a block of the
+   text is held in memory at a time                                */
+void readAndStore(FILE *input_file, char *input_filename){
+	text_reader reader;
+	size_t size, total = 0;
+	char *text, *line, *end;
+	int doc_i;
+	int *row_first = NULL, *row_count = NULL;
+	double parse_time;
+	
+	parse_time = omp_get_wtime();
+	if(sparse){
+		row_first = (int*) calloc(num_docs, sizeof(int));
+		row_count = (int*) calloc(num_docs, sizeof(int));
+	}
+	openTextReader(&reader, input_file);
+	while((text = readTextBlock(&reader, &size)) != NULL){
+		total += size;
+		line = text;
+		end = text + size;
+		while(line < end){
+			char *cursor;
+			int doc_id = (int) strtol(line, &cursor, 10);
+			
+			if(cursor == line || doc_id < 0 || doc_id >= num_docs){
+				line = nextLine(cursor);
+				continue;
+			}
+			doc_index[doc_id] = doc_id%num_cabs;
+			if(sparse){
+				row_first[doc_id] = sparse_count;
+				line = parseSparseSubjects(cursor);
+				row_count[doc_id] = sparse_count - row_first[doc_id];
+			}
+			else
+				line = single_precision ? parseFloatSubjects(cursor, ROW(doc_floats, doc_id)) : parseSubjects(cursor, ROW(doc_subjects, doc_id));
+			if(line == NULL){
+				fprintf(stderr, "%s: missing subjects for document %d\n", input_filename, doc_id);
+				exit(-1);
+			}
+		}
+	}
+	closeTextReader(&reader);
 	fclose(input_file);
+	
+	if(sparse){
+		orderSparseDocuments(row_first, row_count);
+		free(row_first);
+		free(row_count);
+	}
+	for(doc_i = 0; doc_i < num_docs; doc_i++)
+		cabinets[doc_index[doc_i]].num_docs++;
+	
+	parse_time = omp_get_wtime() - parse_time;
+	printf("Parse Time: %f (%.2f GB/s)\n", parse_time, total / parse_time / 1e9);
 }
 
 /* Function that initializes the averages for each cabinet */
 void initializeAverages(){
-	int cab_i, sub_i, doc_i, n_docs;
+	int cab_i, sub_i, doc_i, n_docs, nz_i;
 
 	for(doc_i = 0; doc_i < num_docs; doc_i++){
 		cab_i = doc_index[doc_i];
 		n_docs = cabinets[cab_i].num_docs;
 		
-		if(n_docs != 0){
+		if(n_docs != 0 && sparse){
+			for(nz_i = sparse_starts[doc_i]; nz_i < sparse_starts[doc_i + 1]; nz_i++)
+				cabinets[cab_i].averages[sparse_subs[nz_i]] += sparse_values[nz_i] / n_docs;
+		}
+		else if(n_docs != 0){
 			for(sub_i = 0; sub_i < num_subs; sub_i++)
-				cabinets[cab_i].averages[sub_i] += (doc_subjects[doc_i][sub_i] / n_docs);		
+				cabinets[cab_i].averages[sub_i] += (SUBJECT(doc_i, sub_i) / n_docs);		
 		}
 	}
 		
@@ -86,7 +393,11 @@ void updateAverages(){
 		if(modified[cab_i] != 0){
 			int prev_num_docs = cabinets[cab_i].num_docs;
 			int num_docs = prev_num_docs + cabinets[cab_i].prev_num_docs;
+			double shift = 0;
+			
 			for(sub_i = 0; sub_i < num_subs; sub_i++){
+				double previous = cabinets[cab_i].averages[sub_i];
+				
 				if(num_docs == 0)
 					cabinets[cab_i].averages[sub_i] = 0;
 				else{				
@@ -95,180 +406,2202 @@ void updateAverages(){
 					cabinets[cab_i].averages[sub_i] /= num_docs;			
 				}
 
+				shift += (cabinets[cab_i].averages[sub_i] - previous) * (cabinets[cab_i].averages[sub_i] - previous);
 				cabinets[cab_i].new_averages[sub_i] = 0;
 			}
 			cabinets[cab_i].num_docs = num_docs;
 			cabinets[cab_i].prev_num_docs = 0;
+			cab_shift[cab_i] = shift;
+			modified[cab_i] = 0;
 		}
+		else
+			cab_shift[cab_i] = 0;
 	}
 }
 
-/* Function that calculates the distance between a document and a cabinet */
-double calculateDistance(double *subjects, double *averages){
-	int sub_i;
-	double current_distance = 0;
+/* Function that calculates the distance between a sparse document and
+   a cabinet as ||c||^2 plus x(x - 2c) over the nonzero subjects of
+   the document, so only those subjects of the cabinet are read    */
+double sparseDistance(int doc_i, int cab_i){
+	int first = sparse_starts[doc_i];
+	double distance = cab_norms[cab_i] + calculateSparseDistance(sparse_subs + first, sparse_values + first, 
+		sparse_starts[doc_i + 1] - first, ROW(cab_averages, cab_i));
 	
-	for(sub_i = 0; sub_i < num_subs; sub_i++){
-		double subtract = subjects[sub_i] - averages[sub_i];
-		current_distance += (subtract * subtract);
-	}
-
-	return current_distance;
+	return (distance > 0) ? distance : 0;
 }
 
-/* Function that calculates all the distances between documents and cabinets */
-void calculateDistances(double** distance){
-	int cab_i, doc_i;
+/* Function that calculates the distance between a document and a
+   cabinet in the precision the documents are stored in            */
+double docDistance(int doc_i, int cab_i){
+	if(sparse)
+		return sparseDistance(doc_i, cab_i);
+	if(single_precision)
+		return calculateFloatDistance(ROW(doc_floats, doc_i), ROW(float_averages, cab_i));
+	return calculateDistance(ROW(doc_subjects, doc_i), ROW(cab_averages, cab_i));
+}
 
-	for(doc_i = 0; doc_i < num_docs; doc_i++){
-		for(cab_i = 0; cab_i < num_cabs; cab_i++)
-			if(modified[cab_i])
-				distance[doc_i][cab_i] = calculateDistance(doc_subjects[doc_i], cabinets[cab_i].averages);
+/* Function that calculates the squared norm of every cabinet average
+   for the sparse distances                                        */
+void calculateSparseNorms(){
+	int cab_i, sub_i;
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		double *cabinet = ROW(cab_averages, cab_i), norm = 0;
+		
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			norm += cabinet[sub_i] * cabinet[sub_i];
+		cab_norms[cab_i] = norm;
 	}
-	memset(modified, 0 , sizeof(int)*num_cabs);
 }
 
-/* Function that finds the minimum distance between a document 
-   and a cabinet.                                                   */
-int findMinDistance(double* distances, int cabinet_id){
-	int cab_i;
-	double min_distance = distances[cabinet_id];
+/* Function that rounds the averages of the cabinets first_cab to
+   last_cab - 1 to floats for the single precision mode            */
+void convertAverages(int first_cab, int last_cab){
+	int cab_i, sub_i;
 	
+	for(cab_i = first_cab; cab_i < last_cab; cab_i++)
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			ROW(float_averages, cab_i)[sub_i] = (float) ROW(cab_averages, cab_i)[sub_i];
+}
+
+/* Function that finds the closest cabinet to a document, calculating the
+   distances on the fly so that no distance matrix has to be kept. If
+   min_distances is not NULL it gets the smallest and the second 
+   smallest distance                                                */
+int findMinDistance(int doc_i, int cabinet_id, double *min_distances){
+	int cab_i, current_cab = cabinet_id;
+	double min_distance = docDistance(doc_i, cabinet_id);
+	double second = DBL_MAX;
+
 	for(cab_i = 0; cab_i < num_cabs; cab_i++){
-		double current_distance = distances[cab_i];
+		double current_distance;
 		
+		if(cab_i == current_cab)
+			continue;
+		
+		current_distance = docDistance(doc_i, cab_i);
 		if(current_distance < min_distance){
+			second = min_distance;
 			min_distance = current_distance;
 			cabinet_id = cab_i;
 		}
+		else if(current_distance < second)
+			second = current_distance;
+	}
+	
+	if(min_distances != NULL){
+		min_distances[0] = min_distance;
+		min_distances[1] = second;
 	}
 	
 	return cabinet_id;
 }
 
-/* Function that moves documents from one cabinet to another */
-int changeDocuments(){
-	int doc_i, moved_flag = 0;
+/* Function that rounds a subject to the nearest 8 bit code of its scale
+   and yields the squared difference between the subject and its code */
+double quantizeSubject(double value, int sub_i, unsigned char *code){
+	double level = (quant_scale[sub_i] > 0) ? floor((value - quant_min[sub_i]) / quant_scale[sub_i] + 0.5) : 0;
+	
+	level = (level < 0) ? 0 : (level > CODE_LEVELS) ? CODE_LEVELS : level;
+	*code = (unsigned char) level;
+	value -= quant_min[sub_i] + quant_scale[sub_i] * level;
+	return value * value;
+}
+
+/* Function that quantizes the subjects of every document to 8 bit codes.
+   Every subject has a scale of its own, from its smallest to its
+   largest value, and each document keeps how far it is from the
+   subjects of its codes                                           */
+void quantizeDocuments(){
+	int doc_i, sub_i;
+	
+	quant_min = allocateDoubleMatrix(1, sub_stride);
+	quant_scale = allocateDoubleMatrix(1, sub_stride);
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		quant_min[sub_i] = DBL_MAX;
+		quant_scale[sub_i] = -DBL_MAX;
+	}
 	
+	/* quant_scale holds the largest value of each subject until the steps are known */
 	for(doc_i = 0; doc_i < num_docs; doc_i++){
-		int id, cabs_i = doc_index[doc_i];
-		
-		id = findMinDistance(distance[doc_i], cabs_i);
-		
-		if(id != cabs_i){
-			int sub_i;
-			moved_flag = 1;
+		for(sub_i = 0; sub_i < num_subs; sub_i++){
+			double value = SUBJECT(doc_i, sub_i);
 			
-			for(sub_i = 0; sub_i < num_subs; sub_i++){
-				cabinets[cabs_i].new_averages[sub_i] -=	doc_subjects[doc_i][sub_i];
-				cabinets[id].new_averages[sub_i] += doc_subjects[doc_i][sub_i];
-			}
+			quant_min[sub_i] = (value < quant_min[sub_i]) ? value : quant_min[sub_i];
+			quant_scale[sub_i] = (value > quant_scale[sub_i]) ? value : quant_scale[sub_i];
+		}
+	}
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		if(quant_scale[sub_i] < quant_min[sub_i])
+			quant_min[sub_i] = quant_scale[sub_i] = 0;
+		else
+			quant_scale[sub_i] = (quant_scale[sub_i] - quant_min[sub_i]) / CODE_LEVELS;
+	}
+	
+	code_stride = sub_stride;
+	doc_codes = (unsigned char*) allocateDoubleMatrix(num_docs, code_stride / sizeof(double));
+	doc_errors = (double*) malloc(sizeof(double) * (num_docs > 0 ? num_docs : 1));
+	cab_offsets = allocateDoubleMatrix(num_cabs, sub_stride);
+	approx_distances = (double*) malloc(sizeof(double) * num_cabs);
+	
+	for(doc_i = 0; doc_i < num_docs; doc_i++){
+		double error = 0;
+		
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			error += quantizeSubject(SUBJECT(doc_i, sub_i), sub_i, CODE_ROW(doc_codes, doc_i) + sub_i);
+		doc_errors[doc_i] = sqrt(error);
+	}
+}
 
-			cabinets[cabs_i].prev_num_docs--;
-			cabinets[id].prev_num_docs++;
-			modified[cabs_i] = 1;
-			modified[id] = 1;
+/* Function that writes the averages of every cabinet as offsets from
+   the subjects of code 0, which the codes of the documents are
+   compared with                                                    */
+void offsetCabinets(){
+	int cab_i, sub_i;
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		for(sub_i = 0; sub_i < num_subs; sub_i++){
+			double value = single_precision ? ROW(float_averages, cab_i)[sub_i] : ROW(cab_averages, cab_i)[sub_i];
 			
-			doc_index[doc_i] = id;
+			ROW(cab_offsets, cab_i)[sub_i] = value - quant_min[sub_i];
 		}
 	}
+}
+
+/* Function that finds the closest cabinet to a document from its codes.
+   The distance between the document rebuilt from its codes and a
+   cabinet, widened by how far the document is from its codes, bounds
+   their exact distance. Only the cabinets whose lower bound is below
+   the smallest upper bound can be the closest, so only those are
+   measured exactly, with the ties of findMinDistance, reading just
+   those lines of the exact subjects. approx is scratch space for
+   num_cabs distances and measured gets the exact distances taken   */
+int findMinDistanceQuantized(int doc_i, int cabinet_id, double *approx, int *measured){
+	int cab_i, current_cab = cabinet_id;
+	unsigned char *codes = CODE_ROW(doc_codes, doc_i);
+	double best_upper = DBL_MAX, error = doc_errors[doc_i], min_distance;
 	
-	return moved_flag;
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		approx[cab_i] = sqrt(calculateCodeDistance(codes, quant_scale, ROW(cab_offsets, cab_i)));
+		if(approx[cab_i] < best_upper)
+			best_upper = approx[cab_i];
+	}
+	best_upper = (best_upper + error) * (1 + bound_slack);
+	
+	min_distance = docDistance(doc_i, current_cab);
+	*measured = 1;
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		double current_distance;
+		
+		if(cab_i == current_cab || approx[cab_i] - error > best_upper)
+			continue;
+		
+		current_distance = docDistance(doc_i, cab_i);
+		(*measured)++;
+		if(current_distance < min_distance){
+			min_distance = current_distance;
+			cabinet_id = cab_i;
+		}
+	}
+	
+	return cabinet_id;
 }
 
-/* Function that writes the position of each document to a file */
-void writeToFile(char *input_filename){
+/* Function that finds the closest cabinet of every document from the 8
+   bit codes, counting the exact distances that were needed         */
+void findClosestCabinetsQuantized(){
 	int doc_i;
-	FILE *output_file;
+	double exact = 0;
 	
-	char output_filename[FILENAME_BUFFER];
-	memcpy( output_filename, input_filename, strlen(input_filename) - 3 );
-	output_filename[strlen(input_filename) - 3] = '\0';
-
-	strcat(output_filename, ".out");
-	output_file = fopen(output_filename, "w+");
-
-	for(doc_i = 0; doc_i < num_docs; doc_i++)
-		fprintf(output_file, "%d %d\n", doc_i, doc_index[doc_i]);
+	offsetCabinets();
+	for(doc_i = 0; doc_i < num_docs; doc_i++){
+		int measured;
+		
+		closest_cabs[doc_i] = findMinDistanceQuantized(doc_i, doc_index[doc_i], approx_distances, &measured);
+		exact += measured;
+	}
+	exact_distances += exact;
+}
 
-	fclose(output_file);
+/* Function that calculates the squared norm of every document */
+void calculateDocumentNorms(){
+	int doc_i;
+	
+	for(doc_i = 0; doc_i < num_docs; doc_i++){
+		int sub_i;
+		double *subjects = ROW(doc_subjects, doc_i), norm = 0;
+		
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			norm += subjects[sub_i] * subjects[sub_i];
+		doc_norms[doc_i] = norm;
+	}
 }
 
-/* Function that allocates a matrix of doubles */
-double **allocateDoubleMatrix(int num_lines, int num_columns){
-	int line_i;	
-	double **matrix = (double**) malloc(sizeof(double*)*num_lines);
+/* Function that calculates the squared norm of every cabinet average and
+   packs the averages in groups of PACK_CABS cabinets, subject by
+   subject, so the cross products can be vectorized across cabinets */
+void calculateCabinetNorms(){
+	int cab_i, sub_i, num_groups = (num_cabs + PACK_CABS - 1) / PACK_CABS;
+	
+	if(cab_packed == NULL)
+		cab_packed = allocateDoubleMatrix(num_groups * num_subs, PACK_CABS);
+	
+	max_cab_norm = 0;
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		double *cabinet = ROW(cab_averages, cab_i), norm = 0;
+		double *packed = cab_packed + (size_t)(cab_i / PACK_CABS) * num_subs * PACK_CABS + cab_i % PACK_CABS;
+		
+		for(sub_i = 0; sub_i < num_subs; sub_i++){
+			norm += cabinet[sub_i] * cabinet[sub_i];
+			packed[sub_i * PACK_CABS] = cabinet[sub_i];
+		}
+		cab_norms[cab_i] = norm;
+		if(norm > max_cab_norm)
+			max_cab_norm = norm;
+	}
 	
-	for(line_i = 0; line_i < num_lines; line_i++)
-		matrix[line_i] = calloc(num_columns, sizeof(double));
+	cab_tile = TILE_BYTES / (num_subs * PACK_CABS * sizeof(double));
+	cab_tile = (cab_tile < 1 ? 1 : cab_tile) * PACK_CABS;
+}
 
-	return matrix;
+/* Function that finds the closest cabinet of a tile of documents. The
+   distances are expanded as ||x||^2 - 2x.c + ||c||^2 and the cross
+   terms are calculated a block of cabinets at a time, so each block is
+   reused by every document of the tile while it is still in cache. 
+   Documents whose two best cabinets are too close to be told apart by
+   the expansion are decided with exact distances.                   */
+void findClosestCabinetsTile(int doc_start, int tile_docs){
+	double best[DOC_TILE], second[DOC_TILE], cross[4 * PACK_CABS];
+	int best_cab[DOC_TILE];
+	int doc_i, cab_i, cab_start;
+	
+	for(doc_i = 0; doc_i < tile_docs; doc_i++){
+		best[doc_i] = second[doc_i] = DBL_MAX;
+		best_cab[doc_i] = doc_index[doc_start + doc_i];
+	}
+	
+	for(cab_start = 0; cab_start < num_cabs; cab_start += cab_tile){
+		int cab_end = cab_start + cab_tile < num_cabs ? cab_start + cab_tile : num_cabs;
+		
+		for(doc_i = 0; doc_i < tile_docs; doc_i += 4){
+			double *docs[4];
+			int doc_k, quad_docs = tile_docs - doc_i < 4 ? tile_docs - doc_i : 4;
+			
+			for(doc_k = 0; doc_k < 4; doc_k++)
+				docs[doc_k] = ROW(doc_subjects, doc_start + doc_i + (doc_k < quad_docs ? doc_k : 0));
+			
+			for(cab_i = cab_start; cab_i < cab_end; cab_i += PACK_CABS){
+				double *packed = cab_packed + (size_t)(cab_i / PACK_CABS) * num_subs * PACK_CABS;
+				
+				calculateCrossProducts(docs, packed, cross);
+				
+				for(doc_k = 0; doc_k < quad_docs; doc_k++){
+					int cab_k, doc_t = doc_i + doc_k;
+					double doc_norm = doc_norms[doc_start + doc_t];
+					
+					for(cab_k = 0; cab_k < PACK_CABS && cab_i + cab_k < cab_end; cab_k++){
+						double current_distance = doc_norm - 2 * cross[doc_k * PACK_CABS + cab_k] + cab_norms[cab_i + cab_k];
+						
+						if(current_distance < second[doc_t]){
+							if(current_distance < best[doc_t]){
+								second[doc_t] = best[doc_t];
+								best[doc_t] = current_distance;
+								best_cab[doc_t] = cab_i + cab_k;
+							}
+							else
+								second[doc_t] = current_distance;
+						}
+					}
+				}
+			}
+		}
+	}
+	
+	for(doc_i = 0; doc_i < tile_docs; doc_i++){
+		int doc_id = doc_start + doc_i;
+		double tolerance = TIE_TOLERANCE * (doc_norms[doc_id] + max_cab_norm);
+		
+		if(second[doc_i] - best[doc_i] <= tolerance)
+			closest_cabs[doc_id] = findMinDistance(doc_id, doc_index[doc_id], NULL);
+		else
+			closest_cabs[doc_id] = best_cab[doc_i];
+	}
 }
 
-/* Function that frees a matrix of doubles */
-void freeDoubleMatrix(double **matrix, int num_lines){
-	int line_i;	
+/* Function that measures how far each cabinet moved in the last update,
+   which bounds how much the distances of the documents can change  */
+void updateCabinetDrift(){
+	int cab_i;
 	
-	for(line_i = 0; line_i < num_lines; line_i++)
-		free(matrix[line_i]);
+	max_drift = second_drift = 0;
+	max_drift_cab = -1;
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		double drift = sqrt(calculateDistance(ROW(cab_averages, cab_i), ROW(prev_averages, cab_i)));
+		
+		memcpy(ROW(prev_averages, cab_i), ROW(cab_averages, cab_i), sizeof(double) * sub_stride);
+		cab_drift[cab_i] = drift;
+		if(drift > max_drift){
+			second_drift = max_drift;
+			max_drift = drift;
+			max_drift_cab = cab_i;
+		}
+		else if(drift > second_drift)
+			second_drift = drift;
+	}
 
-	free(matrix);
 }
 
-/* Function that frees the allocated structures along the program */
-void cleanup(){
+/* Function that calculates half the distance from each cabinet to its
+   nearest neighbour */
+void updateCabinetGaps(){
 	int cab_i;
-
+	
 	for(cab_i = 0; cab_i < num_cabs; cab_i++){
-		free(cabinets[cab_i].averages);
-		free(cabinets[cab_i].new_averages);
+		int cab_j;
+		double min_gap = DBL_MAX;
+		
+		for(cab_j = 0; cab_j < num_cabs; cab_j++){
+			if(cab_j != cab_i){
+				double gap = calculateDistance(ROW(cab_averages, cab_i), ROW(cab_averages, cab_j));
+				if(gap < min_gap)
+					min_gap = gap;
+			}
+		}
+		cab_half_gap[cab_i] = 0.5 * sqrt(min_gap);
 	}
+}
 
-	free(doc_index);
-	free(modified);
-	free(cabinets);
+/* Function that finds the closest cabinet of every document keeping, for
+   each document, an upper bound on the distance to its cabinet and a 
+   lower bound on the distance to any other cabinet (Hamerly). Documents
+   whose upper bound is below the lower bound, or below half the gap to
+   the nearest cabinet, cannot move and their distances are skipped */
+void findClosestCabinetsPruned(){
+	int doc_i;
+	
+	updateCabinetDrift();
+	updateCabinetGaps();
+	
+	for(doc_i = 0; doc_i < num_docs; doc_i++){
+		int cab_id = doc_index[doc_i];
+		double bound, distances[2];
+		
+		upper_bounds[doc_i] += cab_drift[cab_id];
+		lower_bounds[doc_i] -= (cab_id == max_drift_cab) ? second_drift : max_drift;
+		bound = lower_bounds[doc_i] > cab_half_gap[cab_id] ? lower_bounds[doc_i] : cab_half_gap[cab_id];
+		closest_cabs[doc_i] = cab_id;
+		
+		if(upper_bounds[doc_i] * (1 + bound_slack) < bound)
+			continue;
+		
+		upper_bounds[doc_i] = sqrt(docDistance(doc_i, cab_id));
+		if(upper_bounds[doc_i] * (1 + bound_slack) < bound)
+			continue;
+		
+		closest_cabs[doc_i] = findMinDistance(doc_i, cab_id, distances);
+		upper_bounds[doc_i] = sqrt(distances[0]);
+		lower_bounds[doc_i] = sqrt(distances[1]);
+	}
 }
 
-int main(int argc, char *argv[]){
+/* Function that clusters the cabinets into num_groups groups with a few
+   rounds of k-means over their averages. The cabinets of each group are
+   stored contiguously in group_cabs, in ascending order            */
+void groupCabinets(){
+	int cab_i, group_i, round;
+	double *centers = allocateDoubleMatrix(num_groups, sub_stride);
+	int *counts = (int*) calloc(num_groups + 1, sizeof(int));
 	
+	cab_group = (int*) malloc(sizeof(int) * num_cabs);
+	group_cabs = (int*) malloc(sizeof(int) * num_cabs);
+	group_start = (int*) calloc(num_groups + 1, sizeof(int));
+	group_drift = (double*) malloc(sizeof(double) * num_groups);
 	
-	int temp_cabs, moved_flag = 1;
-	FILE *input_file;
-	char *input_filename = (char*)malloc(sizeof(char)*(strlen(argv[1])+2));
-	double start = omp_get_wtime(), algorithm;
+	for(group_i = 0; group_i < num_groups; group_i++)
+		memcpy(ROW(centers, group_i), ROW(cab_averages, (int)((double) group_i * num_cabs / num_groups)), sizeof(double) * sub_stride);
 	
-	strcpy(input_filename, argv[1]);
-	input_file = fopen(input_filename, "r");
-	fscanf(input_file, "%d %d %d\n", &temp_cabs, &num_docs, &num_subs);
+	for(round = 0; round < GROUP_ROUNDS; round++){
+		for(cab_i = 0; cab_i < num_cabs; cab_i++){
+			double min_distance = DBL_MAX;
+			for(group_i = 0; group_i < num_groups; group_i++){
+				double current_distance = calculateDistance(ROW(cab_averages, cab_i), ROW(centers, group_i));
+				if(current_distance < min_distance){
+					min_distance = current_distance;
+					cab_group[cab_i] = group_i;
+				}
+			}
+		}
+		
+		memset(centers, 0, sizeof(double) * num_groups * sub_stride);
+		memset(counts, 0, sizeof(int) * num_groups);
+		for(cab_i = 0; cab_i < num_cabs; cab_i++){
+			int sub_i;
+			double *center = ROW(centers, cab_group[cab_i]);
+			
+			for(sub_i = 0; sub_i < num_subs; sub_i++)
+				center[sub_i] += ROW(cab_averages, cab_i)[sub_i];
+			counts[cab_group[cab_i]]++;
+		}
+		for(group_i = 0; group_i < num_groups; group_i++){
+			int sub_i;
+			for(sub_i = 0; sub_i < num_subs && counts[group_i] > 0; sub_i++)
+				ROW(centers, group_i)[sub_i] /= counts[group_i];
+		}
+	}
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++)
+		group_start[cab_group[cab_i] + 1]++;
+	for(group_i = 0; group_i < num_groups; group_i++){
+		group_start[group_i + 1] += group_start[group_i];
+		counts[group_i] = group_start[group_i];
+	}
+	for(cab_i = 0; cab_i < num_cabs; cab_i++)
+		group_cabs[counts[cab_group[cab_i]]++] = cab_i;
+	
+	freeDoubleMatrix(centers);
+	free(counts);
+}
 
-	if(argv[2] != NULL)
-		num_cabs = atoi(argv[2]);
-	else 
-		num_cabs = temp_cabs;
+/* Function that finds the closest cabinet of a document with Yinyang's
+   group filter: the document keeps an upper bound on the distance to
+   its cabinet and one lower bound per group of cabinets, and only the
+   groups whose lower bound is below the best distance found so far are
+   searched. group_min and group_arg are scratch space for two distances
+   and one cabinet per group                                        */
+void findClosestCabinetYinyang(int doc_i, double *group_min, int *group_arg){
+	int group_i, cab_id = doc_index[doc_i], best_cab = cab_id;
+	double *bounds = group_bounds + (size_t) doc_i * num_groups;
+	double global_bound = DBL_MAX, best_distance, best_squared;
 	
-	create_cabinets();
-	doc_index = (int*) malloc(sizeof(int)*num_docs);
-	distance = allocateDoubleMatrix(num_docs, num_cabs);
-	doc_subjects = allocateDoubleMatrix(num_docs, num_subs);
+	upper_bounds[doc_i] += cab_drift[cab_id];
+	for(group_i = 0; group_i < num_groups; group_i++){
+		bounds[group_i] -= group_drift[group_i];
+		if(bounds[group_i] < global_bound)
+			global_bound = bounds[group_i];
+	}
+	
+	closest_cabs[doc_i] = cab_id;
+	if(upper_bounds[doc_i] * (1 + bound_slack) < global_bound)
+		return;
+	
+	best_squared = docDistance(doc_i, cab_id);
+	best_distance = upper_bounds[doc_i] = sqrt(best_squared);
+	if(upper_bounds[doc_i] * (1 + bound_slack) < global_bound)
+		return;
+	
+	for(group_i = 0; group_i < num_groups; group_i++){
+		int cab_k, min_cab = num_cabs;
+		double prev_bound = bounds[group_i] + group_drift[group_i], min1 = DBL_MAX, min2 = DBL_MAX;
+		
+		group_arg[group_i] = -1;
+		if(bounds[group_i] > best_distance * (1 + bound_slack))
+			continue;
+		
+		for(cab_k = group_start[group_i]; cab_k < group_start[group_i + 1]; cab_k++){
+			int cab_i = group_cabs[cab_k];
+			double current_squared, cab_bound = prev_bound - cab_drift[cab_i];
+			
+			if(cab_i == cab_id)
+				continue;
+			
+			/* A cabinet whose own bound is above the best distance is
+			   skipped and its bound used in place of the distance.
+			   Otherwise ties are broken as in findMinDistance: the
+			   current cabinet wins, then the lowest cabinet id. The
+			   group minimums are kept squared to save square roots */
+			if(cab_bound <= best_distance * (1 + bound_slack)){
+				current_squared = docDistance(doc_i, cab_i);
+				if(current_squared < best_squared || (current_squared == best_squared && best_cab != cab_id && cab_i < best_cab)){
+					best_squared = current_squared;
+					best_distance = sqrt(current_squared);
+					best_cab = cab_i;
+				}
+			}
+			else
+				current_squared = cab_bound * cab_bound;
+			
+			if(current_squared < min1){
+				min2 = min1;
+				min1 = current_squared;
+				min_cab = cab_i;
+			}
+			else if(current_squared < min2)
+				min2 = current_squared;
+		}
+		
+		group_min[2 * group_i] = min1;
+		group_min[2 * group_i + 1] = min2;
+		group_arg[group_i] = min_cab;
+	}
+	
+	for(group_i = 0; group_i < num_groups; group_i++){
+		if(group_arg[group_i] != -1)
+			bounds[group_i] = sqrt(group_min[2 * group_i + (group_arg[group_i] == best_cab ? 1 : 0)]);
+	}
+	
+	if(best_cab != cab_id && upper_bounds[doc_i] < bounds[cab_group[cab_id]])
+		bounds[cab_group[cab_id]] = upper_bounds[doc_i];
+	
+	upper_bounds[doc_i] = best_distance;
+	closest_cabs[doc_i] = best_cab;
+}
 
-	if(input_file != NULL)
-		readAndStore(input_file);
-	else 
-		perror(input_filename);
+/* Function that finds the closest cabinet of every document with the
+   Yinyang group filter */
+void findClosestCabinetsGrouped(){
+	int group_i, cab_k, doc_i, *group_arg;
+	double *group_min;
 	
-	algorithm = omp_get_wtime();	
-	initializeAverages();
+	if(group_cabs == NULL)
+		groupCabinets();
+	
+	updateCabinetDrift();
+	for(group_i = 0; group_i < num_groups; group_i++){
+		group_drift[group_i] = 0;
+		for(cab_k = group_start[group_i]; cab_k < group_start[group_i + 1]; cab_k++)
+			if(cab_drift[group_cabs[cab_k]] > group_drift[group_i])
+				group_drift[group_i] = cab_drift[group_cabs[cab_k]];
+	}
+	
+	group_min = (double*) malloc(sizeof(double) * 2 * num_groups);
+	group_arg = (int*) malloc(sizeof(int) * num_groups);
+	for(doc_i = 0; doc_i < num_docs; doc_i++)
+		findClosestCabinetYinyang(doc_i, group_min, group_arg);
+	
+	free(group_min);
+	free(group_arg);
+}
 
-	while(moved_flag){
-		updateAverages();
-		calculateDistances(distance);
-		moved_flag = changeDocuments();
-	}	
+/* Function that finds the closest cabinet of every document */
+void findClosestCabinets(){
+	int doc_i;
+	
+	assign_passes++;
+	if(single_precision)
+		convertAverages(0, num_cabs);
+	if(sparse)
+		calculateSparseNorms();
+	if(assign_mode == ASSIGN_GEMM){
+		calculateCabinetNorms();
+		
+		for(doc_i = 0; doc_i < num_docs; doc_i += DOC_TILE)
+			findClosestCabinetsTile(doc_i, num_docs - doc_i < DOC_TILE ? num_docs - doc_i : DOC_TILE);
+		return;
+	}
+	
+	if(assign_mode == ASSIGN_HAMERLY){
+		findClosestCabinetsPruned();
+		return;
+	}
+	
+	/* The first averages all come from doc_id%num_cabs and are nearly
+	   the same, so the Yinyang mode searches every cabinet in the first
+	   pass and groups the cabinets with the averages of the second  */
+	if(assign_mode == ASSIGN_YINYANG && assign_passes > 1){
+		findClosestCabinetsGrouped();
+		return;
+	}
+	else if(assign_mode == ASSIGN_YINYANG)
+		updateCabinetDrift();
+	
+	if(quantized){
+		findClosestCabinetsQuantized();
+		return;
+	}
+	
+	for(doc_i = 0; doc_i < num_docs; doc_i++)
+		closest_cabs[doc_i] = findMinDistance(doc_i, doc_index[doc_i], NULL);
+}
+
+/* Function that moves documents from one cabinet to another and yields
+   how many moved                                                  */
+int changeDocuments(){
+	int doc_i, moved_flag = 0;
+	
+	for(doc_i = 0; doc_i < num_docs; doc_i++){
+		int id, cabs_i = doc_index[doc_i];
+		
+		id = closest_cabs[doc_i];
+		
+		if(id != cabs_i){
+			int sub_i, nz_i;
+			moved_flag++;
+			
+			if(sparse){
+				for(nz_i = sparse_starts[doc_i]; nz_i < sparse_starts[doc_i + 1]; nz_i++){
+					cabinets[cabs_i].new_averages[sparse_subs[nz_i]] -= sparse_values[nz_i];
+					cabinets[id].new_averages[sparse_subs[nz_i]] += sparse_values[nz_i];
+				}
+			}
+			else {
+				for(sub_i = 0; sub_i < num_subs; sub_i++){
+					cabinets[cabs_i].new_averages[sub_i] -=	SUBJECT(doc_i, sub_i);
+					cabinets[id].new_averages[sub_i] += SUBJECT(doc_i, sub_i);
+				}
+			}
+
+			cabinets[cabs_i].prev_num_docs--;
+			cabinets[id].prev_num_docs++;
+			modified[cabs_i] = 1;
+			modified[id] = 1;
+			
+			doc_index[doc_i] = id;
+		}
+	}
+	
+	return moved_flag;
+}
+
+/* Function that moves a 32 bit xorshift generator, which gives the same
+   numbers everywhere, to its next state and yields it             */
+unsigned long nextRandom(unsigned long *state){
+	*state ^= (*state << 13) & 0xffffffffUL;
+	*state ^= *state >> 17;
+	*state ^= (*state << 5) & 0xffffffffUL;
+	return *state;
+}
+
+/* Function that yields a pseudo random number below limit */
+int randomBelow(int limit){
+	return (int) (nextRandom(&random_state) % (unsigned long) limit);
+}
+
+/* Function that yields a pseudo random number in [0, 1) */
+double randomUnit(unsigned long *state){
+	return nextRandom(state) / 4294967296.0;
+}
+
+/* Function that adds the subjects of a document to a line of sums */
+void addDocument(double *sums, int doc_i){
+	int sub_i, nz_i;
+	
+	if(sparse){
+		for(nz_i = sparse_starts[doc_i]; nz_i < sparse_starts[doc_i + 1]; nz_i++)
+			sums[sparse_subs[nz_i]] += sparse_values[nz_i];
+	}
+	else {
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			sums[sub_i] += SUBJECT(doc_i, sub_i);
+	}
+}
+
+/* Function that runs the mini-batch mode. Every iteration samples
+   batch_size documents at random, finds their closest cabinets and
+   moves each cabinet towards the mean of the documents it got, by the
+   share of all its sampled documents that came in this batch, or by
+   learning_rate/(1 + iteration) when a rate is given              */
+void miniBatch(){
+	int iter_i, sample_i, cab_i, sub_i;
+	int *batch = (int*) malloc(sizeof(int) * batch_size);
+	int *batch_cabs = (int*) malloc(sizeof(int) * batch_size);
+	double *cab_seen = (double*) calloc(num_cabs, sizeof(double));
+	double *cab_batch = (double*) calloc(num_cabs, sizeof(double));
+	double mini_time = omp_get_wtime();
+	
+	for(iter_i = 0; iter_i < mini_iterations; iter_i++){
+		for(sample_i = 0; sample_i < batch_size; sample_i++)
+			batch[sample_i] = randomBelow(num_docs);
+		if(single_precision)
+			convertAverages(0, num_cabs);
+		if(sparse)
+			calculateSparseNorms();
+		
+		for(sample_i = 0; sample_i < batch_size; sample_i++)
+			batch_cabs[sample_i] = findMinDistance(batch[sample_i], doc_index[batch[sample_i]], NULL);
+		
+		for(sample_i = 0; sample_i < batch_size; sample_i++){
+			addDocument(cabinets[batch_cabs[sample_i]].new_averages, batch[sample_i]);
+			cab_batch[batch_cabs[sample_i]]++;
+		}
+		
+		for(cab_i = 0; cab_i < num_cabs; cab_i++){
+			double *averages = cabinets[cab_i].averages, *sums = cabinets[cab_i].new_averages, rate;
+			
+			if(cab_batch[cab_i] == 0)
+				continue;
+			
+			cab_seen[cab_i] += cab_batch[cab_i];
+			rate = (learning_rate > 0) ? learning_rate / (1 + iter_i) : cab_batch[cab_i] / cab_seen[cab_i];
+			rate = (rate < 1) ? rate : 1;
+			for(sub_i = 0; sub_i < num_subs; sub_i++){
+				averages[sub_i] += rate * (sums[sub_i] / cab_batch[cab_i] - averages[sub_i]);
+				sums[sub_i] = 0;
+			}
+			cab_batch[cab_i] = 0;
+		}
+	}
+	
+	printf("Mini-batch Time: %f (%d iterations of %d documents)\n", omp_get_wtime() - mini_time, mini_iterations, batch_size);
+	free(batch);
+	free(batch_cabs);
+	free(cab_seen);
+	free(cab_batch);
+}
+
+/* Function that ends the mini-batch mode with a full pass that puts
+   every document in its closest cabinet. That is the result, unless
+   the full algorithm carries on with -mf, for which the averages are
+   recomputed from the documents of every cabinet. Yields whether the
+   full algorithm carries on                                       */
+int finishMiniBatch(){
+	int doc_i, cab_i;
+	
+	findClosestCabinets();
+	memcpy(doc_index, closest_cabs, sizeof(int) * num_docs);
+	if(!mini_refine)
+		return 0;
+	
+	memset(cab_averages, 0, sizeof(double) * num_cabs * sub_stride);
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		cabinets[cab_i].num_docs = 0;
+		modified[cab_i] = 1;
+	}
+	for(doc_i = 0; doc_i < num_docs; doc_i++)
+		cabinets[doc_index[doc_i]].num_docs++;
+	initializeAverages();
+	return 1;
+}
+
+/* Function that copies a document into a line of dense subjects */
+void copyDocument(double *line, int doc_i){
+	int sub_i, nz_i;
+	
+	memset(line, 0, sizeof(double) * sub_stride);
+	if(sparse){
+		for(nz_i = sparse_starts[doc_i]; nz_i < sparse_starts[doc_i + 1]; nz_i++)
+			line[sparse_subs[nz_i]] = sparse_values[nz_i];
+	}
+	else {
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			line[sub_i] = SUBJECT(doc_i, sub_i);
+	}
+}
+
+/* Function that yields the squared norm of a line of subjects */
+double lineNorm(double *line){
+	int sub_i;
+	double norm = 0;
+	
+	for(sub_i = 0; sub_i < num_subs; sub_i++)
+		norm += line[sub_i] * line[sub_i];
+	return norm;
+}
+
+/* Function that calculates the distance between a document and a seed,
+   a line of dense subjects whose squared norm is norm             */
+double seedDistance(int doc_i, double *line, double norm){
+	int sub_i;
+	double distance = 0;
+	
+	if(sparse){
+		int first = sparse_starts[doc_i];
+		
+		distance = norm + calculateSparseDistance(sparse_subs + first, sparse_values + first, 
+			sparse_starts[doc_i + 1] - first, line);
+		return (distance > 0) ? distance : 0;
+	}
+	if(!single_precision)
+		return calculateDistance(ROW(doc_subjects, doc_i), line);
+	
+	for(sub_i = 0; sub_i < num_subs; sub_i++){
+		double subtract = SUBJECT(doc_i, sub_i) - line[sub_i];
+		distance += subtract * subtract;
+	}
+	return distance;
+}
+
+/* Function that checks every document against the seeds first_seed to
+   last_seed - 1, keeping in distances and nearest the closest seed
+   found so far                                                    */
+void nearestSeeds(double *seeds, double *norms, int first_seed, int last_seed, double *distances, int *nearest){
+	int doc_i, seed_i;
+	
+	for(doc_i = 0; doc_i < num_docs; doc_i++){
+		for(seed_i = first_seed; seed_i < last_seed; seed_i++){
+			double distance = seedDistance(doc_i, ROW(seeds, seed_i), norms[seed_i]);
+			
+			if(distance < distances[doc_i]){
+				distances[doc_i] = distance;
+				nearest[doc_i] = seed_i;
+			}
+		}
+	}
+}
+
+/* Function that picks one of count items with a probability
+   proportional to its weight, or uniformly when weights is NULL or
+   every weight is 0                                               */
+int pickWeighted(double *weights, int count){
+	int item_i, last = count - 1;
+	double total = 0, target;
+	
+	if(weights != NULL)
+		for(item_i = 0; item_i < count; item_i++)
+			total += weights[item_i];
+	if(total <= 0)
+		return (int) (randomUnit(&random_state) * count);
+	
+	target = randomUnit(&random_state) * total;
+	for(item_i = 0; item_i < count; item_i++){
+		if(weights[item_i] > 0){
+			last = item_i;
+			target -= weights[item_i];
+			if(target < 0)
+				return item_i;
+		}
+	}
+	
+	/* Rounding left part of the total, the last weighted item takes it */
+	return last;
+}
+
+/* Function that picks the seeds among the candidates of k-means|| with
+   k-means++, each candidate weighing as much as the documents that
+   are closest to it                                               */
+void reduceCandidates(double *candidates, double *cand_norms, double *weights, int num_cands, double *seeds, double *norms){
+	int cab_i, cand_i, picked;
+	double *cand_distances = (double*) malloc(sizeof(double) * num_cands);
+	double *chances = (double*) malloc(sizeof(double) * num_cands);
+	
+	for(cand_i = 0; cand_i < num_cands; cand_i++)
+		cand_distances[cand_i] = DBL_MAX;
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		for(cand_i = 0; cand_i < num_cands; cand_i++)
+			chances[cand_i] = (cab_i == 0) ? weights[cand_i] : weights[cand_i] * cand_distances[cand_i];
+		picked = pickWeighted(chances, num_cands);
+		memcpy(ROW(seeds, cab_i), ROW(candidates, picked), sizeof(double) * sub_stride);
+		norms[cab_i] = cand_norms[picked];
+		
+		for(cand_i = 0; cand_i < num_cands; cand_i++){
+			double distance = calculateDistance(ROW(candidates, cand_i), ROW(seeds, cab_i));
+			
+			if(distance < cand_distances[cand_i])
+				cand_distances[cand_i] = distance;
+		}
+	}
+	
+	free(cand_distances);
+	free(chances);
+}
+
+/* Function that draws the candidates of k-means||: SEED_ROUNDS rounds
+   keep every document with a probability proportional to its
+   distance to the closest candidate so far, SEED_OVERSAMPLE *
+   num_cabs documents per round on average. The seeds are then picked
+   among the candidates                                            */
+void seedScalable(double *seeds, double *norms, double *distances){
+	int capacity = 1 + SEED_ROUNDS * SEED_OVERSAMPLE * num_cabs;
+	int round_i, doc_i, first, num_cands = 1;
+	int *nearest = (int*) malloc(sizeof(int) * num_docs);
+	double *candidates = allocateDoubleMatrix(capacity, sub_stride);
+	double *cand_norms = (double*) malloc(sizeof(double) * capacity);
+	double *weights = (double*) calloc(capacity, sizeof(double));
+	
+	copyDocument(candidates, pickWeighted(NULL, num_docs));
+	cand_norms[0] = lineNorm(candidates);
+	nearestSeeds(candidates, cand_norms, 0, 1, distances, nearest);
+	
+	for(round_i = 0; round_i < SEED_ROUNDS; round_i++){
+		double cost = 0;
+		unsigned long draw_state = nextRandom(&random_state);
+		
+		for(doc_i = 0; doc_i < num_docs; doc_i++)
+			cost += distances[doc_i];
+		
+		if(draw_state == 0)
+			draw_state = RANDOM_SEED;
+		
+		first = num_cands;
+		for(doc_i = 0; doc_i < num_docs && num_cands < capacity; doc_i++){
+			if(randomUnit(&draw_state) * cost < (double) SEED_OVERSAMPLE * num_cabs * distances[doc_i]){
+				copyDocument(ROW(candidates, num_cands), doc_i);
+				cand_norms[num_cands] = lineNorm(ROW(candidates, num_cands));
+				num_cands++;
+			}
+		}
+		nearestSeeds(candidates, cand_norms, first, num_cands, distances, nearest);
+	}
+	
+	for(doc_i = 0; doc_i < num_docs; doc_i++)
+		weights[nearest[doc_i]]++;
+	reduceCandidates(candidates, cand_norms, weights, num_cands, seeds, norms);
+	
+	free(nearest);
+	freeDoubleMatrix(candidates);
+	free(cand_norms);
+	free(weights);
+}
+
+/* Function that picks the first averages of the cabinets among the
+   documents, with the -init strategy, and puts every document in the
+   cabinet of its closest seed instead of cabinet doc_id % num_cabs */
+void seedCabinets(){
+	int cab_i, doc_i, seed_i;
+	double *seeds = allocateDoubleMatrix(num_cabs, sub_stride);
+	double *norms = (double*) malloc(sizeof(double) * num_cabs);
+	double *distances = (double*) malloc(sizeof(double) * num_docs);
+	double seed_time = omp_get_wtime();
+	
+	for(doc_i = 0; doc_i < num_docs; doc_i++)
+		distances[doc_i] = DBL_MAX;
+	
+	if(seed_mode == SEED_RANDOM){
+		int *picked = (int*) malloc(sizeof(int) * num_cabs);
+		
+		for(cab_i = 0; cab_i < num_cabs; cab_i++){
+			picked[cab_i] = pickWeighted(NULL, num_docs);
+			
+			/* Draw again documents already picked, while there are enough documents */
+			for(seed_i = 0; seed_i < cab_i && cab_i < num_docs; seed_i++){
+				if(picked[seed_i] == picked[cab_i]){
+					picked[cab_i] = pickWeighted(NULL, num_docs);
+					seed_i = -1;
+				}
+			}
+			copyDocument(ROW(seeds, cab_i), picked[cab_i]);
+			norms[cab_i] = lineNorm(ROW(seeds, cab_i));
+		}
+		free(picked);
+	}
+	else if(seed_mode == SEED_PLUSPLUS){
+		for(cab_i = 0; cab_i < num_cabs; cab_i++){
+			doc_i = pickWeighted((cab_i == 0) ? NULL : distances, num_docs);
+			copyDocument(ROW(seeds, cab_i), doc_i);
+			norms[cab_i] = lineNorm(ROW(seeds, cab_i));
+			nearestSeeds(seeds, norms, cab_i, cab_i + 1, distances, doc_index);
+		}
+	}
+	else {
+		seedScalable(seeds, norms, distances);
+		for(doc_i = 0; doc_i < num_docs; doc_i++)
+			distances[doc_i] = DBL_MAX;
+	}
+	
+	/* k-means++ already knows the closest seed of every document */
+	if(seed_mode != SEED_PLUSPLUS)
+		nearestSeeds(seeds, norms, 0, num_cabs, distances, doc_index);
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++)
+		cabinets[cab_i].num_docs = 0;
+	for(doc_i = 0; doc_i < num_docs; doc_i++)
+		cabinets[doc_index[doc_i]].num_docs++;
+	
+	printf("Seeding Time: %f (%s)\n", omp_get_wtime() - seed_time, seed_names[seed_mode]);
+	freeDoubleMatrix(seeds);
+	free(norms);
+	free(distances);
+}
+
+/* Function that reads the averages written with -write-averages into
+   seeds, which must hold as many cabinets and subjects            */
+void readAverages(char *seeds_filename, double *seeds){
+	int file_cabs, file_subs, cab_id, cab_i, sub_i, valid;
+	FILE *averages_file = fopen(seeds_filename, "r");
+	
+	if(averages_file == NULL){
+		perror(seeds_filename);
+		exit(-1);
+	}
+	valid = fscanf(averages_file, "%d %d", &file_cabs, &file_subs) == 2 && file_cabs == num_cabs && file_subs == num_subs;
+	for(cab_i = 0; valid && cab_i < num_cabs; cab_i++){
+		valid = fscanf(averages_file, "%d", &cab_id) == 1 && cab_id == cab_i;
+		for(sub_i = 0; valid && sub_i < num_subs; sub_i++)
+			valid = fscanf(averages_file, "%lf", ROW(seeds, cab_i) + sub_i) == 1;
+	}
+	fclose(averages_file);
+	if(!valid){
+		fprintf(stderr, "%s: not the averages of %d cabinets and %d subjects\n", seeds_filename, num_cabs, num_subs);
+		exit(-1);
+	}
+}
+
+/* Function that reads the cabinets of a .out file into assigned, -1
+   for the documents it does not list, such as the ones added since.
+   Yields how many documents it lists                               */
+int readWarmAssignment(int *assigned){
+	int doc_id, cab_id, doc_i, listed = 0;
+	FILE *warm_file = fopen(warm_filename, "r");
+	
+	if(warm_file == NULL){
+		perror(warm_filename);
+		exit(-1);
+	}
+	for(doc_i = 0; doc_i < num_docs; doc_i++)
+		assigned[doc_i] = -1;
+	while(fscanf(warm_file, "%d %d", &doc_id, &cab_id) == 2){
+		if(cab_id < 0 || cab_id >= num_cabs){
+			fprintf(stderr, "%s: cabinet %d of document %d out of range\n", warm_filename, cab_id, doc_id);
+			exit(-1);
+		}
+		if(doc_id >= 0 && doc_id < num_docs && assigned[doc_id] < 0){
+			assigned[doc_id] = cab_id;
+			listed++;
+		}
+	}
+	fclose(warm_file);
+	return listed;
+}
+
+/* Function that starts from a previous run instead of cabinet
+   doc_id % num_cabs. With -warm-averages every document starts in the
+   closest of the given averages. With a .out file the documents it
+   lists keep their cabinet and the others start in the closest of the
+   averages of the listed ones                                      */
+void warmStart(){
+	int cab_i, doc_i, sub_i, listed = 0;
+	double *seeds = allocateDoubleMatrix(num_cabs, sub_stride);
+	double *norms = (double*) malloc(sizeof(double) * num_cabs);
+	double *distances = (double*) malloc(sizeof(double) * num_docs);
+	int *assigned = (int*) malloc(sizeof(int) * num_docs);
+	double seed_time = omp_get_wtime();
+	
+	if(warm_averages)
+		readAverages(warm_filename, seeds);
+	else {
+		int *counts = (int*) calloc(num_cabs, sizeof(int));
+		
+		listed = readWarmAssignment(assigned);
+		for(doc_i = 0; doc_i < num_docs; doc_i++){
+			if(assigned[doc_i] >= 0){
+				addDocument(ROW(seeds, assigned[doc_i]), doc_i);
+				counts[assigned[doc_i]]++;
+			}
+		}
+		
+		/* A cabinet the file leaves empty starts from a random document */
+		for(cab_i = 0; cab_i < num_cabs; cab_i++){
+			if(counts[cab_i] == 0)
+				copyDocument(ROW(seeds, cab_i), pickWeighted(NULL, num_docs));
+			else
+				for(sub_i = 0; sub_i < num_subs; sub_i++)
+					ROW(seeds, cab_i)[sub_i] /= counts[cab_i];
+		}
+		free(counts);
+	}
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++)
+		norms[cab_i] = lineNorm(ROW(seeds, cab_i));
+	for(doc_i = 0; doc_i < num_docs; doc_i++)
+		distances[doc_i] = DBL_MAX;
+	if(listed < num_docs)
+		nearestSeeds(seeds, norms, 0, num_cabs, distances, doc_index);
+	if(!warm_averages)
+		for(doc_i = 0; doc_i < num_docs; doc_i++)
+			if(assigned[doc_i] >= 0)
+				doc_index[doc_i] = assigned[doc_i];
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++)
+		cabinets[cab_i].num_docs = 0;
+	for(doc_i = 0; doc_i < num_docs; doc_i++)
+		cabinets[doc_index[doc_i]].num_docs++;
+	
+	if(warm_averages)
+		printf("Seeding Time: %f (warm start from %s)\n", omp_get_wtime() - seed_time, warm_filename);
+	else
+		printf("Seeding Time: %f (warm start, %d of %d documents from %s)\n", omp_get_wtime() - seed_time, listed, num_docs, warm_filename);
+	freeDoubleMatrix(seeds);
+	free(norms);
+	free(distances);
+	free(assigned);
+}
+
+/* Function that yields the inertia, the sum over the documents of the
+   squared distance to the average of their cabinet, each distance
+   summed on its own so that no large terms cancel out              */
+double totalInertia(){
+	int doc_i, sub_i;
+	double inertia = 0;
+	
+	if(sparse)
+		calculateSparseNorms();
+	for(doc_i = 0; doc_i < num_docs; doc_i++){
+		double *cabinet = ROW(cab_averages, doc_index[doc_i]);
+		
+		if(sparse)
+			inertia += sparseDistance(doc_i, doc_index[doc_i]);
+		else {
+			for(sub_i = 0; sub_i < num_subs; sub_i++)
+				inertia += (SUBJECT(doc_i, sub_i) - cabinet[sub_i]) * (SUBJECT(doc_i, sub_i) - cabinet[sub_i]);
+		}
+	}
+	
+	return inertia;
+}
+
+/* Function that yields the largest distance a cabinet average moved in
+   the last update                                                 */
+double maxShift(){
+	int cab_i;
+	double shift = 0;
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++)
+		shift = (cab_shift[cab_i] > shift) ? cab_shift[cab_i] : shift;
+	return sqrt(shift);
+}
+
+/* Function that checks the stopping rules once the averages of an
+   iteration are updated, moved being the documents that changed
+   cabinet and elapsed the seconds the run has taken so far. Yields
+   why the run stops, or NULL to carry on                           */
+char *stopReason(int moved, double elapsed){
+	double inertia, shift = 0;
+	
+	if(max_iterations > 0 && iterations >= max_iterations)
+		return "iteration limit";
+	if(stop_moved > 0 && moved <= stop_moved * num_docs)
+		return "moved documents";
+	if(stop_shift > 0)
+		shift = maxShift();
+	if(stop_shift > 0 && shift <= stop_shift)
+		return "cabinet shift";
+	if(stop_inertia > 0){
+		inertia = totalInertia();
+		if(prev_inertia >= 0 && fabs(prev_inertia - inertia) <= stop_inertia * prev_inertia)
+			return "inertia change";
+		prev_inertia = inertia;
+	}
+	if(time_limit > 0 && elapsed >= time_limit)
+		return "time limit";
+	
+	return NULL;
+}
+
+/* Function that writes in name the input file name without its .in or
+   .bin extension, followed by suffix                              */
+void checkpointName(char *name, char *input_filename, char *suffix){
+	size_t name_len = strlen(input_filename);
+	
+	if(name_len > 4 && !strcmp(input_filename + name_len - 4, ".bin"))
+		name_len -= 4;
+	else if(name_len > 3 && !strcmp(input_filename + name_len - 3, ".in"))
+		name_len -= 3;
+	if(name_len + strlen(suffix) >= FILENAME_BUFFER){
+		fprintf(stderr, "%s: file name too long\n", input_filename);
+		exit(-1);
+	}
+	memcpy(name, input_filename, name_len);
+	strcpy(name + name_len, suffix);
+}
+
+/* Function that yields the file a resumed run reads its documents from:
+   the input itself when it is binary, else the documents saved with
+   the first checkpoint, written in saved_name                     */
+char *resumeDocuments(char *input_filename, char *saved_name){
+	binary_header header;
+	FILE *input_file = fopen(input_filename, "r");
+	int binary = (input_file != NULL) && readBinaryHeader(input_file, &header);
+	
+	if(input_file != NULL)
+		fclose(input_file);
+	if(binary)
+		return input_filename;
+	checkpointName(saved_name, input_filename, ".ckpt.bin");
+	return saved_name;
+}
+
+/* Function that reads the checkpoint of the run to resume: the averages
+   of the cabinets, put back by restoreAverages, and the cabinet of
+   every document, which mapBinaryDocuments uses as the assignment */
+void readCheckpoint(char *input_filename){
+	char name[FILENAME_BUFFER];
+	checkpoint_header header;
+	size_t num_values = (size_t) num_cabs * num_subs;
+	int doc_i, valid;
+	FILE *file;
+	
+	checkpointName(name, input_filename, ".ckpt");
+	file = fopen(name, "rb");
+	if(file == NULL){
+		perror(name);
+		exit(-1);
+	}
+	
+	resumed_averages = (double*) malloc(sizeof(double) * num_values);
+	resumed_index = (int*) malloc(sizeof(int) * num_docs);
+	valid = fread(&header, sizeof(header), 1, file) == 1 && !memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC))
+		&& header.version == CHECKPOINT_VERSION && header.num_cabs == num_cabs && header.num_docs == num_docs && header.num_subs == num_subs
+		&& fread(resumed_averages, sizeof(double), num_values, file) == num_values
+		&& fread(resumed_index, sizeof(int), num_docs, file) == (size_t) num_docs;
+	fclose(file);
+	for(doc_i = 0; valid && doc_i < num_docs; doc_i++)
+		valid = resumed_index[doc_i] >= 0 && resumed_index[doc_i] < num_cabs;
+	if(!valid){
+		fprintf(stderr, "%s: not a checkpoint of %d cabinets, %d documents and %d subjects\n", name, num_cabs, num_docs, num_subs);
+		exit(-1);
+	}
+	
+	iterations = header.iterations;
+	resumed_moved = header.moved;
+	checkpoint_iteration = iterations;
+}
+
+/* Function that writes the documents to docs_filename in the binary
+   format of docs-convert                                          */
+void writeDocuments(char *docs_filename){
+	double *line = allocateDoubleMatrix(1, sub_stride);
+	binary_header header;
+	int doc_i;
+	FILE *docs_file;
+	
+	docs_file = fopen(docs_filename, "wb");
+	if(docs_file == NULL){
+		perror(docs_filename);
+		exit(-1);
+	}
+	
+	initBinaryHeader(&header, single_precision ? BINARY_FLOAT32 : 0, num_cabs, num_docs, num_subs, sub_stride);
+	fwrite(&header, sizeof(header), 1, docs_file);
+	
+	for(doc_i = 0; doc_i < num_docs; doc_i++){
+		if(sparse){
+			copyDocument(line, doc_i);
+			fwrite(line, sizeof(double), sub_stride, docs_file);
+		}
+		else if(single_precision)
+			fwrite(ROW(doc_floats, doc_i), sizeof(float), sub_stride, docs_file);
+		else
+			fwrite(ROW(doc_subjects, doc_i), sizeof(double), sub_stride, docs_file);
+	}
+	if(fclose(docs_file) != 0){
+		perror(docs_filename);
+		exit(-1);
+	}
+	
+	freeDoubleMatrix(line);
+}
+
+/* Function that saves the documents once, in the binary format of
+   docs-convert, so that a resumed run does not parse the text again */
+void saveDocuments(char *input_filename){
+	char docs_filename[FILENAME_BUFFER];
+	
+	checkpointName(docs_filename, input_filename, ".ckpt.bin");
+	writeDocuments(docs_filename);
+	saved_documents = 1;
+}
+
+/* Function that takes the exact subjects of the documents out of memory
+   once they are quantized. They are written next to the input, mapped
+   and the file removed, so the few lines the quantized search measures
+   are read through the page cache, which can drop the others       */
+void spillDocuments(char *input_filename){
+	char docs_filename[FILENAME_BUFFER], *payload;
+	
+	checkpointName(docs_filename, input_filename, ".q8.bin");
+	writeDocuments(docs_filename);
+	if(mapBinaryFile(docs_filename) == NULL)
+		exit(-1);
+	unlink(docs_filename);
+	
+	payload = (char*) mapped_file + BINARY_HEADER;
+	if(single_precision){
+		freeDoubleMatrix((double*) doc_floats);
+		doc_floats = (float*) payload;
+	}
+	else {
+		freeDoubleMatrix(doc_subjects);
+		doc_subjects = (double*) payload;
+	}
+}
+
+/* Function that writes a checkpoint: the averages of the cabinets and
+   the cabinet of every document after the iteration just done. It is
+   written beside the last one and renamed over it, so a run killed
+   while writing still leaves the previous checkpoint             */
+void writeCheckpoint(char *input_filename, int moved){
+	char name[FILENAME_BUFFER], temp_name[FILENAME_BUFFER];
+	checkpoint_header header;
+	double write_time = omp_get_wtime();
+	int cab_i;
+	FILE *file;
+	
+	if(!saved_documents)
+		saveDocuments(input_filename);
+	
+	checkpointName(name, input_filename, ".ckpt");
+	checkpointName(temp_name, input_filename, ".ckpt.tmp");
+	file = fopen(temp_name, "wb");
+	if(file == NULL){
+		perror(temp_name);
+		exit(-1);
+	}
+	
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, CHECKPOINT_MAGIC);
+	header.version = CHECKPOINT_VERSION;
+	header.num_cabs = num_cabs;
+	header.num_docs = num_docs;
+	header.num_subs = num_subs;
+	header.iterations = iterations;
+	header.moved = moved;
+	fwrite(&header, sizeof(header), 1, file);
+	for(cab_i = 0; cab_i < num_cabs; cab_i++)
+		fwrite(ROW(cab_averages, cab_i), sizeof(double), num_subs, file);
+	fwrite(doc_index, sizeof(int), num_docs, file);
+	if(fclose(file) != 0 || rename(temp_name, name) != 0){
+		perror(name);
+		exit(-1);
+	}
+	
+	checkpoint_iteration = iterations;
+	checkpoint_clock = omp_get_wtime();
+	printf("Checkpoint after %d iterations: %f\n", iterations, checkpoint_clock - write_time);
+}
+
+/* Function that tells whether a checkpoint is due after the iteration
+   just done                                                       */
+int checkpointDue(){
+	if(checkpoint_every > 0 && iterations - checkpoint_iteration >= checkpoint_every)
+		return 1;
+	return checkpoint_time > 0 && omp_get_wtime() - checkpoint_clock >= checkpoint_time;
+}
+
+/* Function that puts back the averages of the checkpoint resumed from,
+   over the ones rebuilt from its cabinets, so that the run carries on
+   exactly where it stopped. Yields the documents moved by the last
+   iteration before the checkpoint                                */
+int restoreAverages(){
+	int cab_i;
+	
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		memcpy(cabinets[cab_i].averages, resumed_averages + (size_t) cab_i * num_subs, sizeof(double) * num_subs);
+		modified[cab_i] = 0;
+	}
+	free(resumed_averages);
+	free(resumed_index);
+	resumed_averages = NULL;
+	resumed_index = NULL;
+	return resumed_moved;
+}
+
+/* Function that writes the decimal digits of a non negative value ending
+   right before end, two at a time, and yields where they start      */
+char *formatInt(char *end, int value){
+	while(value >= 100){
+		end -= 2;
+		memcpy(end, digit_pairs + 2 * (value % 100), 2);
+		value /= 100;
+	}
+	if(value >= 10){
+		end -= 2;
+		memcpy(end, digit_pairs + 2 * value, 2);
+	}
+	else
+		*--end = '0' + value;
+	return end;
+}
+
+/* Function that writes the output line of a document at text, with the
+   digits worked out by hand instead of fprintf. Yields its length   */
+int formatLine(char *text, int doc_id, int cab_id){
+	char digits[LINE_CHARS], *end = digits + LINE_CHARS, *start;
+	
+	*--end = '\n';
+	start = formatInt(end, cab_id);
+	*--start = ' ';
+	start = formatInt(start, doc_id);
+	memcpy(text, start, digits + LINE_CHARS - start);
+	return digits + LINE_CHARS - start;
+}
+
+/* Function that formats the output lines of count documents, the first
+   one being first_doc, and yields the length of the text            */
+size_t formatLines(char *text, int first_doc, int *cabs, int count){
+	char *cursor = text;
+	int doc_i;
+	
+	for(doc_i = 0; doc_i < count; doc_i++)
+		if(cabs[doc_i] >= 0)
+			cursor += formatLine(cursor, first_doc + doc_i, cabs[doc_i]);
+	return cursor - text;
+}
+
+/* Function that writes the position of each document to a file */
+void writeToFile(char *input_filename){
+	size_t name_len;
+	FILE *output_file;
+	
+	char output_filename[FILENAME_BUFFER];
+	/* Binary files end in .bin instead of .in */
+	name_len = strlen(input_filename);
+	name_len -= (name_len > 4 && !strcmp(input_filename + name_len - 4, ".bin")) ? 4 : 3;
+	memcpy(output_filename, input_filename, name_len);
+	output_filename[name_len] = '\0';
+
+	strcat(output_filename, binary_output ? ".bout" : ".out");
+	output_file = fopen(output_filename, "w+");
+
+	if(binary_output)
+		fwrite(doc_index, sizeof(int), num_docs, output_file);
+	else {
+		char *text = (char*) malloc((size_t) num_docs * LINE_CHARS);
+		
+		fwrite(text, 1, formatLines(text, 0, doc_index, num_docs), output_file);
+		free(text);
+	}
+
+	fclose(output_file);
+}
+
+/* Function that writes the averages of the cabinets for -warm-averages:
+   the number of cabinets and subjects, then one line per cabinet   */
+void writeAverages(){
+	int cab_i, sub_i;
+	FILE *averages_file = fopen(averages_filename, "w");
+	
+	if(averages_file == NULL){
+		perror(averages_filename);
+		return;
+	}
+	fprintf(averages_file, "%d %d\n", num_cabs, num_subs);
+	for(cab_i = 0; cab_i < num_cabs; cab_i++){
+		fprintf(averages_file, "%d", cab_i);
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			fprintf(averages_file, " %.17g", cabinets[cab_i].averages[sub_i]);
+		fprintf(averages_file, "\n");
+	}
+	if(fclose(averages_file) != 0)
+		perror(averages_filename);
+}
+
+/* Function that subtracts a document from a line of sums, undoing
+   addDocument                                                    */
+void removeDocument(double *sums, int doc_i){
+	int sub_i, nz_i;
+	
+	if(sparse){
+		for(nz_i = sparse_starts[doc_i]; nz_i < sparse_starts[doc_i + 1]; nz_i++)
+			sums[sparse_subs[nz_i]] -= sparse_values[nz_i];
+	}
+	else {
+		for(sub_i = 0; sub_i < num_subs; sub_i++)
+			sums[sub_i] -= SUBJECT(doc_i, sub_i);
+	}
+}
+
+/* Function that keeps room for one more document after the last one,
+   where the server parses the subjects of every request. Documents
+   used straight from a mapped file are copied to the heap first    */
+void growDocuments(){
+	int capacity = 2 * doc_capacity + 1024;
+	
+	if(num_docs < doc_capacity && (mapped_file == NULL || sparse))
+		return;
+	
+	doc_index = (int*) realloc(doc_index, sizeof(int) * capacity);
+	closest_cabs = (int*) realloc(closest_cabs, sizeof(int) * capacity);
+	if(sparse)
+		sparse_starts = (int*) realloc(sparse_starts, sizeof(int) * (capacity + 1));
+	else if(single_precision){
+		float *lines = allocateFloatMatrix(capacity);
+		
+		memcpy(lines, doc_floats, sizeof(float) * num_docs * sub_stride);
+		if(mapped_file == NULL)
+			freeDoubleMatrix((double*) doc_floats);
+		doc_floats = lines;
+	}
+	else {
+		double *lines = allocateDoubleMatrix(capacity, sub_stride);
+		
+		memcpy(lines, doc_subjects, sizeof(double) * num_docs * sub_stride);
+		if(mapped_file == NULL)
+			freeDoubleMatrix(doc_subjects);
+		doc_subjects = lines;
+	}
+	if(mapped_file != NULL && !sparse){
+		munmap(mapped_file, mapped_size);
+		mapped_file = NULL;
+	}
+	doc_capacity = capacity;
+}
+
+/* Function that checks the subjects of a request before any of them is
+   stored: a dense request holds exactly num_subs numbers and a sparse
+   one only subjects from 0 to num_subs - 1, in increasing order    */
+int validRequest(char *text){
+	int count = 0, sub_i = 0;
+	
+	for(;;){
+		char *start;
+		double value;
+		
+		while(*text == ' ' || *text == '\t')
+			text++;
+		if(*text == '\r' || *text == '\n' || *text == '\0')
+			break;
+		
+		start = text;
+		value = parseDouble(&text);
+		if(text == start)
+			return 0;
+		if(*text == ':'){
+			if(!sparse || value < sub_i || value != (int) value)
+				return 0;
+			sub_i = (int) value;
+			start = ++text;
+			parseDouble(&text);
+			if(text == start)
+				return 0;
+		}
+		if(*text != ' ' && *text != '\t' && *text != '\r' && *text != '\n' && *text != '\0')
+			return 0;
+		if(sub_i >= num_subs)
+			return 0;
+		sub_i++;
+		count++;
+	}
+	return sparse || count == num_subs;
+}
+
+/* Function that parses the subjects of a request, written like in the
+   input file, into the free line after the last document. Invalid
+   requests are answered with an error and yield 0                 */
+int parseRequest(char *text){
+	if(!validRequest(text)){
+		if(sparse)
+			printf("error expected subjects from 0 to %d\n", num_subs - 1);
+		else
+			printf("error expected %d subjects\n", num_subs);
+		return 0;
+	}
+	if(sparse){
+		sparse_count = sparse_starts[num_docs];
+		parseSparseSubjects(text);
+		sparse_starts[num_docs + 1] = sparse_count;
+	}
+	else if(single_precision)
+		parseFloatSubjects(text, ROW(doc_floats, num_docs));
+	else
+		parseSubjects(text, ROW(doc_subjects, num_docs));
+	return 1;
+}
+
+/* Function that replaces the subjects of a document with the ones
+   parsed after the last document. Sparse documents are spliced into
+   place, moving the nonzeros of the documents after them          */
+void replaceDocument(int doc_i){
+	if(sparse){
+		int tail = sparse_starts[num_docs], count = sparse_count - tail;
+		int first = sparse_starts[doc_i], delta = count - (sparse_starts[doc_i + 1] - first);
+		int *subs = (int*) malloc(sizeof(int) * (count + 1)), next_i;
+		double *values = (double*) malloc(sizeof(double) * (count + 1));
+		
+		/* The parsed nonzeros already made room for the longer document */
+		memcpy(subs, sparse_subs + tail, sizeof(int) * count);
+		memcpy(values, sparse_values + tail, sizeof(double) * count);
+		memmove(sparse_subs + first + count, sparse_subs + sparse_starts[doc_i + 1], sizeof(int) * (tail - sparse_starts[doc_i + 1]));
+		memmove(sparse_values + first + count, sparse_values + sparse_starts[doc_i + 1], sizeof(double) * (tail - sparse_starts[doc_i + 1]));
+		memcpy(sparse_subs + first, subs, sizeof(int) * count);
+		memcpy(sparse_values + first, values, sizeof(double) * count);
+		for(next_i = doc_i + 1; next_i <= num_docs; next_i++)
+			sparse_starts[next_i] += delta;
+		sparse_count = sparse_starts[num_docs];
+		free(subs);
+		free(values);
+	}
+	else if(single_precision)
+		memcpy(ROW(doc_floats, doc_i), ROW(doc_floats, num_docs), sizeof(float) * sub_stride);
+	else
+		memcpy(ROW(doc_subjects, doc_i), ROW(doc_subjects, num_docs), sizeof(double) * sub_stride);
+}
+
+/* Function that refreshes the copies of the averages the distances of
+   the server read                                                */
+void refreshAverages(){
+	if(single_precision)
+		convertAverages(0, num_cabs);
+	if(sparse)
+		calculateSparseNorms();
+}
+
+/* Function that puts a document in a cabinet, or takes it out of its
+   cabinet when cab_id is -1, through the sums of the cabinets like
+   changeDocuments                                                 */
+void placeDocument(int doc_i, int cab_id){
+	int old_cab = doc_index[doc_i];
+	
+	if(old_cab >= 0){
+		removeDocument(cabinets[old_cab].new_averages, doc_i);
+		cabinets[old_cab].prev_num_docs--;
+		modified[old_cab] = 1;
+	}
+	if(cab_id >= 0){
+		addDocument(cabinets[cab_id].new_averages, doc_i);
+		cabinets[cab_id].prev_num_docs++;
+		modified[cab_id] = 1;
+	}
+	doc_index[doc_i] = cab_id;
+	closest_cabs[doc_i] = cab_id;
+}
+
+/* Function that applies the changes of the requests to the averages and
+   iterates from the current cabinets until no document moves, or for
+   -max-iter iterations. Removed documents stay out of every cabinet.
+   Yields the iterations done, and the documents moved in moved_total */
+int serveConverge(int *moved_total){
+	int doc_i, moved_flag = 1, serve_iterations = 0;
+	
+	*moved_total = 0;
+	while(moved_flag){
+		updateAverages();
+		if(max_iterations > 0 && serve_iterations == max_iterations)
+			break;
+		refreshAverages();
+		for(doc_i = 0; doc_i < num_docs; doc_i++)
+			closest_cabs[doc_i] = (doc_index[doc_i] < 0) ? -1 : findMinDistance(doc_i, doc_index[doc_i], NULL);
+		moved_flag = changeDocuments();
+		*moved_total += moved_flag;
+		serve_iterations++;
+	}
+	refreshAverages();
+	return serve_iterations;
+}
+
+/* Function that yields the arguments of a request when it starts with
+   the given word, or NULL                                        */
+char *requestArguments(char *request, char *word){
+	size_t length = strlen(word);
+	
+	if(strncmp(request, word, length) != 0 || (request[length] != ' ' && request[length] != '\t' 
+		&& request[length] != '\r' && request[length] != '\n' && request[length] != '\0'))
+		return NULL;
+	return request + length;
+}
+
+/* Function that keeps the documents and the cabinets resident after the
+   run and answers requests read from the standard input, one per line:
+	add <subjects>			stores a new document, answers its id and cabinet
+	update <doc_id> <subjects>	new subjects of a document, answers its cabinet
+	delete <doc_id>			removes a document
+	converge			applies the changes and iterates again
+	query <subjects>		closest cabinet of a document that is not stored
+	save				writes the .out file, without the removed documents
+	info				documents and cabinets held
+	quit
+   Subjects are written like in the input file. A changed document goes
+   to the closest cabinet right away, and the change reaches the sums
+   of the cabinets like changeDocuments, but the averages only move on
+   converge, so every query of a batch sees the same averages        */
+void serveRequests(char *input_filename){
+	size_t size = BUFFER_SIZE, length;
+	char *request = (char*) malloc(size), *line, *args;
+	int doc_id, cab_id, live = num_docs, moved;
+	double distances[2];
+	
+	doc_capacity = num_docs;
+	growDocuments();
+	/* New and changed documents have no codes, so the server measures exact distances */
+	quantized = 0;
+	refreshAverages();
+	printf("Serving %d documents in %d cabinets\n", live, num_cabs);
+	fflush(stdout);
+	
+	while(fgets(request, size, stdin) != NULL){
+		/* Long requests are read in several pieces */
+		length = strlen(request);
+		while(length == size - 1 && request[length - 1] != '\n'){
+			request = (char*) realloc(request, size *= 2);
+			if(fgets(request + length, size - length, stdin) == NULL)
+				break;
+			length += strlen(request + length);
+		}
+		line = request + strspn(request, " \t");
+		
+		if((args = requestArguments(line, "add")) != NULL){
+			if(parseRequest(args)){
+				cab_id = findMinDistance(num_docs, 0, NULL);
+				doc_index[num_docs] = -1;
+				placeDocument(num_docs, cab_id);
+				printf("added %d %d\n", num_docs++, cab_id);
+				live++;
+				growDocuments();
+			}
+		}
+		else if((args = requestArguments(line, "update")) != NULL){
+			doc_id = (int) strtol(args, &args, 10);
+			if(doc_id < 0 || doc_id >= num_docs || doc_index[doc_id] < 0)
+				printf("error no document %d\n", doc_id);
+			else if(parseRequest(args)){
+				placeDocument(doc_id, -1);
+				replaceDocument(doc_id);
+				cab_id = findMinDistance(doc_id, 0, NULL);
+				placeDocument(doc_id, cab_id);
+				printf("updated %d %d\n", doc_id, cab_id);
+			}
+		}
+		else if((args = requestArguments(line, "delete")) != NULL){
+			doc_id = (int) strtol(args, NULL, 10);
+			if(doc_id < 0 || doc_id >= num_docs || doc_index[doc_id] < 0)
+				printf("error no document %d\n", doc_id);
+			else {
+				placeDocument(doc_id, -1);
+				printf("deleted %d\n", doc_id);
+				live--;
+			}
+		}
+		else if((args = requestArguments(line, "query")) != NULL){
+			if(parseRequest(args)){
+				cab_id = findMinDistance(num_docs, 0, distances);
+				printf("nearest %d %g\n", cab_id, distances[0]);
+			}
+		}
+		else if(requestArguments(line, "converge") != NULL){
+			int done = serveConverge(&moved);
+			
+			printf("converged %d %d\n", done, moved);
+		}
+		else if(requestArguments(line, "save") != NULL){
+			writeToFile(input_filename);
+			printf("saved %d\n", live);
+		}
+		else if(requestArguments(line, "info") != NULL)
+			printf("documents %d cabinets %d\n", live, num_cabs);
+		else if(requestArguments(line, "quit") != NULL)
+			break;
+		else if(line[strspn(line, "\r\n")] != '\0')
+			printf("error unknown request\n");
+		fflush(stdout);
+	}
+	
+	/* Changes left without converge still reach the averages */
+	updateAverages();
+	free(request);
+}
+
+/* Function that finds the closest of the current averages for count
+   documents from first_doc on, into closest_cabs. It is the entry
+   point to classify documents into fixed cabinets and takes the
+   kernels of findClosestCabinets: the blocked expansion with -a gemm,
+   exact distances to every cabinet with any other algorithm, whose
+   bounds only pay off over several iterations                      */
+void classifyDocuments(int first_doc, int count){
+	int doc_i, last_doc = first_doc + count;
+	
+	if(assign_mode == ASSIGN_GEMM){
+		for(doc_i = first_doc; doc_i < last_doc; doc_i += DOC_TILE)
+			findClosestCabinetsTile(doc_i, last_doc - doc_i < DOC_TILE ? last_doc - doc_i : DOC_TILE);
+		return;
+	}
+	
+	for(doc_i = first_doc; doc_i < last_doc; doc_i++)
+		closest_cabs[doc_i] = findMinDistance(doc_i, doc_index[doc_i], NULL);
+}
+
+/* Function that orders two doubles for qsort */
+int compareDoubles(const void *first, const void *second){
+	double difference = *(const double*) first - *(const double*) second;
+	
+	return (difference > 0) - (difference < 0);
+}
+
+/* Function that times classifyDocuments on batches of 1, 8, 64, ...
+   documents, up to every document at once, going through the
+   documents in order, and prints for every batch size the number of
+   full batches timed, the documents they classified per second and
+   the median and 99th percentile time of a batch                   */
+void benchmarkClassify(){
+	int batch = 1, batch_i, first_doc, num_batches;
+	double *latencies = (double*) malloc(sizeof(double) * num_docs), total;
+	
+	while(num_docs > 0){
+		if(batch > num_docs)
+			batch = num_docs;
+		total = 0;
+		num_batches = num_docs / batch;
+		for(batch_i = 0, first_doc = 0; batch_i < num_batches; batch_i++, first_doc += batch){
+			double batch_start = omp_get_wtime();
+			
+			classifyDocuments(first_doc, batch);
+			latencies[batch_i] = omp_get_wtime() - batch_start;
+			total += latencies[batch_i];
+		}
+		/* The smaller last batch is classified but not timed */
+		if(first_doc < num_docs)
+			classifyDocuments(first_doc, num_docs - first_doc);
+		
+		qsort(latencies, num_batches, sizeof(double), compareDoubles);
+		printf("Batch %d: %d batches, %.0f documents/s, p50 %.1f us, p99 %.1f us\n", batch, num_batches, 
+			(double) num_batches * batch / total, latencies[(num_batches - 1) / 2] * 1e6, latencies[(num_batches - 1) * 99 / 100] * 1e6);
+		if(batch == num_docs)
+			break;
+		batch *= 8;
+	}
+	free(latencies);
+}
+
+/* Function that puts every document in the closest of the averages
+   written by -write-averages, in place of the clustering. Yields 0,
+   as no iteration follows                                        */
+int classifyAll(){
+	int cab_i, doc_i;
+	double classify_time;
+	
+	readAverages(classify_filename, cab_averages);
+	refreshAverages();
+	if(assign_mode == ASSIGN_GEMM)
+		calculateCabinetNorms();
+	if(classify_benchmark)
+		benchmarkClassify();
+	
+	classify_time = omp_get_wtime();
+	classifyDocuments(0, num_docs);
+	memcpy(doc_index, closest_cabs, sizeof(int) * num_docs);
+	for(cab_i = 0; cab_i < num_cabs; cab_i++)
+		cabinets[cab_i].num_docs = 0;
+	for(doc_i = 0; doc_i < num_docs; doc_i++)
+		cabinets[doc_index[doc_i]].num_docs++;
+	
+	classify_time = omp_get_wtime() - classify_time;
+	printf("Classify Time: %f (%.0f documents/s)\n", classify_time, num_docs / classify_time);
+	return 0;
+}
+
+/* Function that compares the cabinets found with the ones of a .out
+   file, such as the result of a double precision run, and prints how
+   many documents ended up in another cabinet                       */
+void validateAssignment(){
+	int doc_id, cab_id, compared = 0, differ = 0;
+	FILE *validate_file = fopen(validate_filename, "r");
+	
+	if(validate_file == NULL){
+		perror(validate_filename);
+		return;
+	}
+	
+	while(fscanf(validate_file, "%d %d", &doc_id, &cab_id) == 2){
+		if(doc_id >= 0 && doc_id < num_docs){
+			compared++;
+			differ += (doc_index[doc_id] != cab_id);
+		}
+	}
+	fclose(validate_file);
+	printf("Validation: %d of %d documents in another cabinet than in %s\n", differ, compared, validate_filename);
+}
+
+/* Function that frees the allocated structures along the program */
+void cleanup(){
+	freeDoubleMatrix(cab_averages);
+	freeDoubleMatrix(cab_new_averages);
+	free(doc_index);
+	free(closest_cabs);
+	free(doc_norms);
+	free(cab_norms);
+	freeDoubleMatrix(cab_packed);
+	freeDoubleMatrix(prev_averages);
+	free(upper_bounds);
+	free(lower_bounds);
+	free(cab_drift);
+	free(cab_half_gap);
+	free(cab_group);
+	free(group_cabs);
+	free(group_start);
+	free(group_bounds);
+	free(group_drift);
+	freeDoubleMatrix((double*) doc_codes);
+	freeDoubleMatrix(cab_offsets);
+	freeDoubleMatrix(quant_min);
+	freeDoubleMatrix(quant_scale);
+	free(doc_errors);
+	free(cab_shift);
+	free(sparse_starts);
+	free(sparse_subs);
+	free(sparse_values);
+	free(approx_distances);
+	free(modified);
+	free(cabinets);
+}
+
+/* Function that prints how to call the program and exits */
+void usage(char *program){
+	printf("Usage: %s <input file> [number of cabinets] [options]\n", program);
+	printf("  -a naive|gemm|hamerly|yinyang  algorithm used to find the closest cabinets\n");
+	printf("  -g <groups>       cabinet groups of the yinyang algorithm (default cabinets/10)\n");
+	printf("  -b                write the cabinets as binary ints to <input>.bout\n");
+	printf("  -f32              store and compare the documents as floats (not with gemm)\n");
+	printf("  -validate <file>  count the documents in another cabinet than in a .out file\n");
+	printf("  -q8               search through 8 bit codes of the subjects (naive only)\n");
+	printf("  -sparse           keep only the nonzero subjects, read as sub:value pairs\n");
+	printf("  -m <documents>    mini-batch mode, sampling this many documents per iteration\n");
+	printf("  -mi <iterations>  mini-batch iterations (default %d)\n", MINI_ITERATIONS);
+	printf("  -lr <rate>        move the cabinets by rate/(1+iteration) in the mini-batch\n");
+	printf("  -mf               carry on with the full algorithm after the mini-batch\n");
+	printf("  -max-iter <n>     stop after this many iterations\n");
+	printf("  -stop-moved <f>   stop once at most this fraction of the documents moves\n");
+	printf("  -stop-shift <d>   stop once no cabinet average moves farther than this\n");
+	printf("  -stop-inertia <r> stop once the inertia changes by at most this fraction\n");
+	printf("  -time <seconds>   stop once the run has taken this long\n");
+	printf("  -init <strategy>  modulo (default), random, kmeans++ or kmeans|| first cabinets\n");
+	printf("  -seed <n>         seed of the random numbers, not 0\n");
+	printf("  -checkpoint <n>   write a checkpoint every n iterations\n");
+	printf("  -checkpoint-time <seconds>  write a checkpoint every few seconds\n");
+	printf("  -resume           carry on from the last checkpoint of the input file\n");
+	printf("  -warm <file>      start from the cabinets of a .out file\n");
+	printf("  -warm-averages <file>  start from the averages of -write-averages\n");
+	printf("  -write-averages <file>  write the averages of the cabinets at the end\n");
+	printf("  -parse-only       stop once the documents are read, to time the reader\n");
+	printf("  -serve            then answer add, update, delete and query requests on stdin\n");
+	printf("  -classify <file>  put the documents in the closest averages of -write-averages\n");
+	printf("  -bench            with -classify, time batches of 1, 8, 64... documents\n");
+	exit(-1);
+}
+
+/* Function that reads the optional arguments that follow the input file:
+   the number of cabinets and the flags that tune the algorithm      */
+void parseOptions(int argc, char *argv[]){
+	int arg_i;
+	
+	if(argc < 2)
+		usage(argv[0]);
+	
+	for(arg_i = 2; arg_i < argc; arg_i++){
+		if(strcmp(argv[arg_i], "-a") == 0 && arg_i + 1 < argc){
+			arg_i++;
+			if(strcmp(argv[arg_i], "naive") == 0)
+				assign_mode = ASSIGN_NAIVE;
+			else if(strcmp(argv[arg_i], "gemm") == 0)
+				assign_mode = ASSIGN_GEMM;
+			else if(strcmp(argv[arg_i], "hamerly") == 0)
+				assign_mode = ASSIGN_HAMERLY;
+			else if(strcmp(argv[arg_i], "yinyang") == 0)
+				assign_mode = ASSIGN_YINYANG;
+			else
+				usage(argv[0]);
+		}
+		else if(strcmp(argv[arg_i], "-g") == 0 && arg_i + 1 < argc)
+			num_groups = atoi(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-b") == 0)
+			binary_output = 1;
+		else if(strcmp(argv[arg_i], "-f32") == 0)
+			single_precision = 1;
+		else if(strcmp(argv[arg_i], "-q8") == 0)
+			quantized = 1;
+		else if(strcmp(argv[arg_i], "-sparse") == 0)
+			sparse = 1;
+		else if(strcmp(argv[arg_i], "-m") == 0 && arg_i + 1 < argc)
+			batch_size = atoi(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-mi") == 0 && arg_i + 1 < argc)
+			mini_iterations = atoi(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-lr") == 0 && arg_i + 1 < argc)
+			learning_rate = atof(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-mf") == 0)
+			mini_refine = 1;
+		else if(strcmp(argv[arg_i], "-max-iter") == 0 && arg_i + 1 < argc)
+			max_iterations = atoi(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-stop-moved") == 0 && arg_i + 1 < argc)
+			stop_moved = atof(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-stop-shift") == 0 && arg_i + 1 < argc)
+			stop_shift = atof(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-stop-inertia") == 0 && arg_i + 1 < argc)
+			stop_inertia = atof(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-time") == 0 && arg_i + 1 < argc)
+			time_limit = atof(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-init") == 0 && arg_i + 1 < argc){
+			arg_i++;
+			for(seed_mode = SEED_SCALABLE; seed_mode > SEED_MODULO; seed_mode--)
+				if(strcmp(argv[arg_i], seed_names[seed_mode]) == 0)
+					break;
+			if(strcmp(argv[arg_i], seed_names[seed_mode]) != 0)
+				usage(argv[0]);
+		}
+		else if(strcmp(argv[arg_i], "-checkpoint") == 0 && arg_i + 1 < argc)
+			checkpoint_every = atoi(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-checkpoint-time") == 0 && arg_i + 1 < argc)
+			checkpoint_time = atof(argv[++arg_i]);
+		else if(strcmp(argv[arg_i], "-resume") == 0)
+			resume = 1;
+		else if(strcmp(argv[arg_i], "-seed") == 0 && arg_i + 1 < argc){
+			random_state = strtoul(argv[++arg_i], NULL, 10) & 0xffffffffUL;
+			if(random_state == 0)
+				usage(argv[0]);
+		}
+		else if(strcmp(argv[arg_i], "-validate") == 0 && arg_i + 1 < argc)
+			validate_filename = argv[++arg_i];
+		else if(strcmp(argv[arg_i], "-warm") == 0 && arg_i + 1 < argc){
+			warm_filename = argv[++arg_i];
+			warm_averages = 0;
+		}
+		else if(strcmp(argv[arg_i], "-warm-averages") == 0 && arg_i + 1 < argc){
+			warm_filename = argv[++arg_i];
+			warm_averages = 1;
+		}
+		else if(strcmp(argv[arg_i], "-write-averages") == 0 && arg_i + 1 < argc)
+			averages_filename = argv[++arg_i];
+		else if(strcmp(argv[arg_i], "-parse-only") == 0)
+			parse_only = 1;
+		else if(strcmp(argv[arg_i], "-serve") == 0)
+			serve = 1;
+		else if(strcmp(argv[arg_i], "-classify") == 0 && arg_i + 1 < argc)
+			classify_filename = argv[++arg_i];
+		else if(strcmp(argv[arg_i], "-bench") == 0)
+			classify_benchmark = 1;
+		else if(argv[arg_i][0] != '-')
+			num_cabs = atoi(argv[arg_i]);
+		else
+			usage(argv[0]);
+	}
+	
+	/* The blocked mode works on doubles, and float distances need wider bounds */
+	if(single_precision && assign_mode == ASSIGN_GEMM)
+		usage(argv[0]);
+	if(quantized && assign_mode != ASSIGN_NAIVE)
+		usage(argv[0]);
+	if(single_precision)
+		bound_slack = FLOAT_SLACK;
+	
+	/* Sparse documents are kept in double precision with distances of their own */
+	if(sparse && (single_precision || quantized || assign_mode == ASSIGN_GEMM))
+		usage(argv[0]);
+	if(sparse)
+		bound_slack = SPARSE_SLACK;
+}
+
+int main(int argc, char *argv[]){
+	
+	
+	int temp_cabs, moved_flag = 1;
+	int binary_input;
+	char *stop_reason = NULL;
+	FILE *input_file;
+	char *input_filename, *docs_filename, saved_name[FILENAME_BUFFER];
+	binary_header header;
+	double start = omp_get_wtime(), algorithm;
+	
+	parseOptions(argc, argv);
+	selectDistanceKernel();
+	input_filename = (char*)malloc(sizeof(char)*(strlen(argv[1])+2));
+	strcpy(input_filename, argv[1]);
+	docs_filename = resume ? resumeDocuments(input_filename, saved_name) : input_filename;
+	input_file = fopen(docs_filename, "r");
+	if(input_file == NULL){
+		perror(docs_filename);
+		return -1;
+	}
+	
+	binary_input = readBinaryHeader(input_file, &header);
+	if(binary_input){
+		temp_cabs = header.num_cabs;
+		num_docs = header.num_docs;
+		num_subs = header.num_subs;
+		fclose(input_file);
+	}
+	else
+		fscanf(input_file, "%d %d %d\n", &temp_cabs, &num_docs, &num_subs);
 
+	if(num_cabs == 0)
+		num_cabs = temp_cabs;
+	
+	sub_stride = PADDED(num_subs);
+	create_cabinets();
+	doc_index = (int*) malloc(sizeof(int)*num_docs);
+	closest_cabs = (int*) malloc(sizeof(int)*num_docs);
+	if(sparse){
+		sparse_starts = (int*) calloc(num_docs + 1, sizeof(int));
+		cab_norms = (double*) malloc(sizeof(double)*num_cabs);
+	}
+
+	saved_documents = binary_input;
+	if(resume)
+		readCheckpoint(input_filename);
+	if(binary_input)
+		mapBinaryDocuments(docs_filename);
+	else {
+		if(single_precision)
+			doc_floats = allocateFloatMatrix(num_docs);
+		else if(!sparse)
+			doc_subjects = allocateDoubleMatrix(num_docs, sub_stride);
+		readAndStore(input_file, docs_filename);
+	}
+	if(parse_only){
+		printf("Elapsed Time: %f \n", omp_get_wtime() - start);
+		return 0;
+	}
+	
+	if(single_precision)
+		float_averages = allocateFloatMatrix(num_cabs);
+	if(quantized){
+		quantizeDocuments();
+		/* Only the codes stay in memory, the exact subjects are read from a file */
+		if(mapped_file == NULL)
+			spillDocuments(input_filename);
+	}
+	
+	if(assign_mode == ASSIGN_GEMM){
+		doc_norms = (double*) malloc(sizeof(double)*num_docs);
+		cab_norms = (double*) malloc(sizeof(double)*num_cabs);
+		calculateDocumentNorms();
+	}
+	
+	if(assign_mode == ASSIGN_HAMERLY || assign_mode == ASSIGN_YINYANG){
+		int doc_i;
+		
+		upper_bounds = (double*) malloc(sizeof(double)*num_docs);
+		for(doc_i = 0; doc_i < num_docs; doc_i++)
+			upper_bounds[doc_i] = DBL_MAX;
+		prev_averages = allocateDoubleMatrix(num_cabs, sub_stride);
+		cab_drift = (double*) malloc(sizeof(double)*num_cabs);
+	}
+	
+	if(assign_mode == ASSIGN_HAMERLY){
+		lower_bounds = (double*) calloc(num_docs, sizeof(double));
+		cab_half_gap = (double*) malloc(sizeof(double)*num_cabs);
+	}
+	
+	if(assign_mode == ASSIGN_YINYANG){
+		if(num_groups <= 0)
+			num_groups = (num_cabs + 9) / 10;
+		if(num_groups > num_cabs)
+			num_groups = num_cabs;
+		group_bounds = (double*) calloc((size_t) num_docs * num_groups, sizeof(double));
+	}
+	
+	algorithm = omp_get_wtime();	
+	if(warm_filename != NULL && !resume)
+		warmStart();
+	else if(seed_mode != SEED_MODULO && !resume)
+		seedCabinets();
+	initializeAverages();
+	if(classify_filename != NULL)
+		moved_flag = classifyAll();
+	else if(resume)
+		moved_flag = restoreAverages();
+	else if(batch_size > 0){
+		miniBatch();
+		moved_flag = finishMiniBatch();
+	}
+
+	checkpoint_clock = omp_get_wtime();
+	while(moved_flag){
+		updateAverages();
+		if(iterations > 0 && (stop_reason = stopReason(moved_flag, omp_get_wtime() - start)) != NULL)
+			break;
+		if(checkpointDue())
+			writeCheckpoint(input_filename, moved_flag);
+		findClosestCabinets();
+		moved_flag = changeDocuments();
+		iterations++;
+	}	
+
+	if(stop_reason == NULL)
+		stop_reason = (batch_size > 0 && !mini_refine) ? "end of the mini-batch" : "no document moved";
+	printf("Stopped after %d iterations: %s\n", iterations, stop_reason);
+	if(quantized)
+		printf("Exact distances per document: %.2f of %d\n", exact_distances / ((double) num_docs * assign_passes), num_cabs);
+	if(serve)
+		serveRequests(input_filename);
+	if(validate_filename != NULL)
+		validateAssignment();
+	if(averages_filename != NULL)
+		writeAverages();
 	writeToFile(input_filename);
 	cleanup();	
-	freeDoubleMatrix(distance, num_docs);
-	freeDoubleMatrix(doc_subjects, num_docs);
+	if(mapped_file != NULL)
+		munmap(mapped_file, mapped_size);
+	else {
+		freeDoubleMatrix(doc_subjects);
+		freeDoubleMatrix((double*) doc_floats);
+	}
+	freeDoubleMatrix((double*) float_averages);
 	free(input_filename);
 
 	printf("Algorithm Time: %f \n", omp_get_wtime() - algorithm) ;	